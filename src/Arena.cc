@@ -0,0 +1,47 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "Arena.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+void Arena::addBlock(size_t min_size) {
+  // Anything too large for a regular block gets a block of its own.
+  const auto block_size = std::max(next_block_size_, min_size);
+  next_block_size_ = std::min(next_block_size_ * 2, MaxBlockSize);
+
+  // Blocks from new[] are aligned for any fundamental type. They are left
+  // uninitialized rather than zeroed like std::make_unique would.
+  blocks_.emplace_back(new char[block_size]);
+  current_ = blocks_.back().get();
+  remaining_ = block_size;
+  reserved_bytes_ += block_size;
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+  void* ptr = current_;
+  if (!current_ || !std::align(alignment, size, ptr, remaining_)) {
+    addBlock(size);
+    ptr = current_;
+  }
+
+  current_ = static_cast<char*>(ptr) + size;
+  remaining_ -= size;
+  used_bytes_ += size;
+  return ptr;
+}
+
+std::string_view Arena::copy(std::string_view str) {
+  if (str.empty()) {
+    return {};
+  }
+  auto* data = static_cast<char*>(allocate(str.size(), 1));
+  std::memcpy(data, str.data(), str.size());
+  return std::string_view(data, str.size());
+}
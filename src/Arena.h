@@ -0,0 +1,109 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __Arena_h__
+#define __Arena_h__
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// A bump allocator which hands out memory from a few large blocks.
+// Memory is never freed on its own. Every block is freed at once when the
+// arena is destroyed, which is far cheaper than freeing millions of small
+// allocations one by one and keeps the heap from fragmenting.
+// Blocks start small so an arena which holds little costs little, and grow
+// as the arena fills.
+// An arena is not thread-safe.
+class Arena {
+ public:
+  static constexpr size_t InitialBlockSize = 4 * 1024;
+  static constexpr size_t MaxBlockSize = 1024 * 1024;
+
+ private:
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char* current_ = nullptr;
+  size_t remaining_ = 0;
+  size_t next_block_size_ = InitialBlockSize;
+  size_t used_bytes_ = 0;
+  size_t reserved_bytes_ = 0;
+
+  // Start a new block with room for at least |min_size| bytes.
+  void addBlock(size_t min_size);
+
+ public:
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena() = default;
+
+  // Allocate |size| bytes aligned to |alignment|, which must be a power of two
+  // no larger than alignof(std::max_align_t).
+  void* allocate(size_t size, size_t alignment);
+
+  // Copy |str| into the arena and return a view of the copy.
+  std::string_view copy(std::string_view str);
+
+  // Returns the number of bytes handed out by allocate and copy.
+  size_t usedBytes() const {
+    return used_bytes_;
+  }
+
+  // Returns the number of bytes held in blocks, including unused space.
+  size_t reservedBytes() const {
+    return reserved_bytes_;
+  }
+
+  // Returns the number of blocks. Each one is a single heap allocation.
+  size_t blockCount() const {
+    return blocks_.size();
+  }
+};
+
+// A standard allocator which allocates from an Arena, so standard containers
+// can keep their nodes in one. Deallocation does nothing. The memory is
+// reclaimed with the arena, which must outlive the container.
+template <typename T>
+class ArenaAllocator {
+ private:
+  Arena* arena_;
+
+  template <typename U>
+  friend class ArenaAllocator;
+
+ public:
+  using value_type = T;
+  // The arena travels with the nodes allocated from it.
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  explicit ArenaAllocator(Arena* arena) noexcept :
+      arena_(arena) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) noexcept :
+      arena_(other.arena_) {}
+
+  T* allocate(size_t count) {
+    return static_cast<T*>(arena_->allocate(count * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T*, size_t) noexcept {}
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& rhs) const noexcept {
+    return arena_ == rhs.arena_;
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U>& rhs) const noexcept {
+    return arena_ != rhs.arena_;
+  }
+};
+
+#endif  // __Arena_h__
@@ -5,27 +5,435 @@
 
 #include "BackupSet.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+namespace {
+
+// Walk the maps |lhs| and |rhs| in lockstep, each in key order.
+// Filenames of |rhs| whose keys are not found in |lhs| are appended to
+// |missing| and filenames of |lhs| whose keys are not found in |rhs| are
+// appended to |extra|. Either output may be null if the caller is not
+// interested in it. |lhs_filename| and |rhs_filename| return the filename
+// held by a value of each map.
+template <typename Map, typename LhsFilename, typename RhsFilename>
+void mergeJoin(const Map& lhs, const Map& rhs, const LhsFilename& lhs_filename, const RhsFilename& rhs_filename, std::vector<std::string>* missing, std::vector<std::string>* extra) {
+  const auto lhs_files = lhs.sorted();
+  const auto rhs_files = rhs.sorted();
+  auto lhs_iter = lhs_files.begin();
+  auto rhs_iter = rhs_files.begin();
+  const std::less<> key_less;
+
+  while (lhs_iter != lhs_files.end() && rhs_iter != rhs_files.end()) {
+    if (key_less(lhs_iter->first, rhs_iter->first)) {
+      if (extra) {
+        extra->push_back(lhs_filename(lhs_iter->second));
+      }
+      ++lhs_iter;
+    } else if (key_less(rhs_iter->first, lhs_iter->first)) {
+      if (missing) {
+        missing->push_back(rhs_filename(rhs_iter->second));
+      }
+      ++rhs_iter;
+    } else {
+      ++lhs_iter;
+      ++rhs_iter;
+    }
+  }
+
+  // Whatever remains on either side has no match on the other side.
+  if (extra) {
+    for (; lhs_iter != lhs_files.end(); ++lhs_iter) {
+      extra->push_back(lhs_filename(lhs_iter->second));
+    }
+  }
+  if (missing) {
+    for (; rhs_iter != rhs_files.end(); ++rhs_iter) {
+      missing->push_back(rhs_filename(rhs_iter->second));
+    }
+  }
+}
+
+}  // namespace
+
+template <typename Storage>
+BasicBackupSet<Storage>::BasicBackupSet() :
+    BasicBackupSet(nullptr) {}
+
+template <typename Storage>
+BasicBackupSet<Storage>::BasicBackupSet(std::shared_ptr<FilenamePool> filename_pool) :
+    shards_(ShardCount), filename_pool_(std::move(filename_pool)) {}
+
+// Returns a copy of |filename| owned by the backup set.
+template <typename Storage>
+typename BasicBackupSet<Storage>::FilenameRef BasicBackupSet<Storage>::copyFilename(Arena& arena, std::string_view filename) {
+  if (filename_pool_) {
+    return FilenameRef::pooled(filename_pool_->intern(filename));
+  }
+  return arena.copy(filename);
+}
+
+// Returns a reference to |filename|, which is still copied into the pool if
+// there is one.
+template <typename Storage>
+typename BasicBackupSet<Storage>::FilenameRef BasicBackupSet<Storage>::referenceFilename(std::string_view filename) {
+  if (filename_pool_) {
+    return FilenameRef::pooled(filename_pool_->intern(filename));
+  }
+  return filename;
+}
+
+// Map |sha1| => |filename| in the files keyed by string hashes.
+template <typename Storage>
+void BasicBackupSet<Storage>::addStringHashFile(std::string_view sha1, FilenameRef filename) {
+  // Assume no collision. Only a new key needs a copy of |sha1|.
+  auto* existing = string_hashes_.files.find(sha1);
+  if (existing) {
+    *existing = filename;
+  } else {
+    string_hashes_.files.assign(string_hashes_.string_arena->copy(sha1), filename);
+  }
+}
+
 // Add a mapping from |sha1| => |filename| into the backup set.
-void BackupSet::addFile(const std::string& sha1, const std::string& filename) {
+template <typename Storage>
+void BasicBackupSet<Storage>::addFile(std::string_view sha1, std::string_view filename) {
+  Sha1Digest digest;
+  if (Sha1Digest::fromHex(sha1, digest)) {
+    addFile(digest, filename);
+  } else {
+    addFileWithStringHash(sha1, filename);
+  }
+}
+
+// Add a mapping from |digest| => |filename| into the backup set.
+template <typename Storage>
+void BasicBackupSet<Storage>::addFile(const Sha1Digest& digest, std::string_view filename) {
+  auto& shard = getShard(digest);
+  // Assume no collision.
+  shard.files.assign(digest, copyFilename(*shard.string_arena, filename));
+}
+
+// Add a mapping from |sha1| => |filename| into the backup set without
+// attempting to decode |sha1| as a digest.
+template <typename Storage>
+void BasicBackupSet<Storage>::addFileWithStringHash(std::string_view sha1, std::string_view filename) {
+  addStringHashFile(sha1, copyFilename(*string_hashes_.string_arena, filename));
+}
+
+// Add a mapping from |digest| => |filename| without copying |filename|.
+template <typename Storage>
+void BasicBackupSet<Storage>::addFileReference(const Sha1Digest& digest, std::string_view filename) {
   // Assume no collision.
-  hash_to_filename_map_[sha1] = filename;
+  getShard(digest).files.assign(digest, referenceFilename(filename));
+}
+
+// Add a mapping from |sha1| => |filename| without copying |filename| and
+// without attempting to decode |sha1| as a digest.
+template <typename Storage>
+void BasicBackupSet<Storage>::addFileReferenceWithStringHash(std::string_view sha1, std::string_view filename) {
+  addStringHashFile(sha1, referenceFilename(filename));
+}
+
+// Merge the files belonging to shard |shard_index| from each of |parts|.
+template <typename Storage>
+void BasicBackupSet<Storage>::addSortedFilesToShard(size_t shard_index, const std::vector<std::vector<BackupSetEntry>>& parts, bool copy_filenames) {
+  // Cursor into one part for the k-way merge. For equal digests, the cursor
+  // into the later part is ordered first so its file is the one kept.
+  struct Cursor {
+    const BackupSetEntry* current;
+    const BackupSetEntry* end;
+    size_t part_index;
+
+    bool operator<(const Cursor& rhs) const {
+      if (current->digest != rhs.current->digest) {
+        // std::priority_queue pops the greatest element first.
+        return rhs.current->digest < current->digest;
+      }
+      return part_index < rhs.part_index;
+    }
+  };
+
+  // Every part is sorted so the files in this shard are contiguous.
+  std::priority_queue<Cursor> cursors;
+  const auto is_before_shard = [shard_index](const BackupSetEntry& entry) {
+    return getShardIndex(entry.digest) < shard_index;
+  };
+  const auto is_in_shard = [shard_index](const BackupSetEntry& entry) {
+    return getShardIndex(entry.digest) == shard_index;
+  };
+  for (size_t i = 0; i < parts.size(); i++) {
+    const auto begin = std::partition_point(parts[i].cbegin(), parts[i].cend(), is_before_shard);
+    const auto end = std::partition_point(begin, parts[i].cend(), is_in_shard);
+    if (begin != end) {
+      cursors.push({&*begin, &*begin + (end - begin), i});
+    }
+  }
+
+  // Files come out of the merge in digest order so each one belongs right
+  // after the one before it.
+  auto& shard = shards_[shard_index];
+  const Sha1Digest* last_digest = nullptr;
+  while (!cursors.empty()) {
+    auto cursor = cursors.top();
+    cursors.pop();
+
+    const auto& entry = *cursor.current;
+    if (!last_digest || *last_digest != entry.digest) {
+      const auto filename = copy_filenames ? copyFilename(*shard.string_arena, entry.filename) : referenceFilename(entry.filename);
+      shard.files.assignSorted(entry.digest, filename);
+      last_digest = &entry.digest;
+    }
+
+    if (++cursor.current != cursor.end) {
+      cursors.push(cursor);
+    }
+  }
+}
+
+// Add the files from each of |parts| in order.
+template <typename Storage>
+void BasicBackupSet<Storage>::addSortedFiles(const std::vector<std::vector<BackupSetEntry>>& parts, bool copy_filenames, ThreadPool* pool) {
+  const auto add_shard = [&](size_t shard_index) {
+    addSortedFilesToShard(shard_index, parts, copy_filenames);
+  };
+
+  if (pool) {
+    pool->parallelFor(ShardCount, add_shard);
+  } else {
+    for (size_t i = 0; i < ShardCount; i++) {
+      add_shard(i);
+    }
+  }
+}
+
+// Keep |buffer| alive for as long as this backup set.
+template <typename Storage>
+void BasicBackupSet<Storage>::retainBuffer(std::shared_ptr<const void> buffer) {
+  if (filename_pool_) {
+    return;
+  }
+  retained_buffers_.push_back(std::move(buffer));
+}
+
+// Returns the filename held by |filename|.
+template <typename Storage>
+std::string_view BasicBackupSet<Storage>::getFilename(FilenameRef filename, std::string& buffer) const {
+  if (filename.isPooled()) {
+    return filename_pool_->get(static_cast<FilenamePool::Id>(filename.index()));
+  }
+  if (filename.isCompressed()) {
+    compressed_filenames_.get(filename.index(), buffer);
+    return buffer;
+  }
+
+  const auto view = filename.view();
+  if (!lazy_files_.empty() && !view.empty()) {
+    // Find the last file mapped at or before the filename.
+    const auto address = reinterpret_cast<uintptr_t>(view.data());
+    auto iter = std::upper_bound(lazy_files_.cbegin(), lazy_files_.cend(), address, [](uintptr_t address, const auto& mapped_file) {
+      return address < reinterpret_cast<uintptr_t>(mapped_file->data());
+    });
+    if (iter != lazy_files_.cbegin()) {
+      const auto& mapped_file = *--iter;
+      const auto offset = address - reinterpret_cast<uintptr_t>(mapped_file->data());
+      if (offset < mapped_file->size()) {
+        // A file which can no longer be read reads as an empty filename.
+        if (!mapped_file->read(offset, view.size(), buffer)) {
+          buffer.clear();
+        }
+        return buffer;
+      }
+    }
+  }
+  return view;
+}
+
+// Compress every filename in the backup set.
+template <typename Storage>
+void BasicBackupSet<Storage>::compressFilenames() {
+  // Gather every filename. Ones compressed before, or loaded lazily, are
+  // read into |buffer|, which the next one overwrites, so they are copied
+  // into a temporary arena to be compressed along with the rest.
+  Arena decoded_filenames;
+  std::string buffer;
+  std::vector<std::pair<std::string_view, FilenameRef*>> filenames;
+  filenames.reserve(size());
+  const auto gather = [&](auto& file_map) {
+    file_map.files.forEach([&](const auto&, FilenameRef& filename_ref) {
+      auto filename = getFilename(filename_ref, buffer);
+      if (filename.data() == buffer.data()) {
+        filename = decoded_filenames.copy(filename);
+      }
+      filenames.emplace_back(filename, &filename_ref);
+    });
+  };
+  for (auto& shard : shards_) {
+    gather(shard);
+  }
+  gather(string_hashes_);
+
+  // Sorting puts paths sharing a directory next to each other, which is
+  // what front coding needs. Identical filenames are stored once.
+  std::sort(filenames.begin(), filenames.end(), [](const auto& lhs, const auto& rhs) {
+    return lhs.first < rhs.first;
+  });
+  FrontCodedStrings compressed_filenames;
+  for (size_t i = 0; i < filenames.size(); i++) {
+    if (i == 0 || filenames[i].first != filenames[i - 1].first) {
+      compressed_filenames.append(filenames[i].first);
+    }
+    *filenames[i].second = FilenameRef::compressed(compressed_filenames.size() - 1);
+  }
+  compressed_filenames.shrinkToFit();
+  compressed_filenames_ = std::move(compressed_filenames);
+
+  // Nothing refers to the copies of filenames or the retained buffers now.
+  // String hashes are copied into a fresh map since they share an arena
+  // with the filenames.
+  for (auto& shard : shards_) {
+    shard.string_arena = std::make_unique<Arena>();
+  }
+  FileMap<std::string_view> string_hashes;
+  for (const auto& sha1_filename_pair : string_hashes_.files.sorted()) {
+    string_hashes.files.assignSorted(string_hashes.string_arena->copy(sha1_filename_pair.first), sha1_filename_pair.second);
+  }
+  string_hashes_ = std::move(string_hashes);
+  retained_buffers_.clear();
+  lazy_files_.clear();
+}
+
+// Keep |mapped_file| alive and load the filenames which refer into it lazily.
+template <typename Storage>
+void BasicBackupSet<Storage>::retainLazyFile(std::shared_ptr<const MappedFile> mapped_file) {
+  if (filename_pool_) {
+    return;
+  }
+  mapped_file->evict();
+  const auto iter = std::upper_bound(lazy_files_.cbegin(), lazy_files_.cend(), mapped_file, [](const auto& lhs, const auto& rhs) {
+    return reinterpret_cast<uintptr_t>(lhs->data()) < reinterpret_cast<uintptr_t>(rhs->data());
+  });
+  lazy_files_.insert(iter, std::move(mapped_file));
+}
+
+// Returns the number of files in the backup set.
+template <typename Storage>
+size_t BasicBackupSet<Storage>::size() const {
+  size_t file_count = string_hashes_.files.size();
+  for (const auto& shard : shards_) {
+    file_count += shard.files.size();
+  }
+  return file_count;
+}
+
+template <typename Storage>
+template <typename Key>
+void BasicBackupSet<Storage>::FileMap<Key>::addMemoryUsage(BackupSetMemoryUsage& usage) const {
+  usage.file_count += files.size();
+  usage.string_bytes += string_arena->usedBytes();
+  usage.node_bytes += node_arena->usedBytes() + files.bytes();
+  usage.reserved_bytes += string_arena->reservedBytes() + node_arena->reservedBytes() + files.bytes();
+  usage.block_count += string_arena->blockCount() + node_arena->blockCount();
+}
+
+// Report the memory held by the backup set.
+template <typename Storage>
+BackupSetMemoryUsage BasicBackupSet<Storage>::memoryUsage() const {
+  BackupSetMemoryUsage usage;
+  for (const auto& shard : shards_) {
+    shard.addMemoryUsage(usage);
+  }
+  string_hashes_.addMemoryUsage(usage);
+  usage.compressed_filename_bytes = compressed_filenames_.memoryUsage();
+  return usage;
 }
 
 // Return the set of filenames which are found in |rhs| but not found in this.
-std::vector<std::string> BackupSet::getMissingFiles(const BackupSet& rhs) {
+template <typename Storage>
+std::vector<std::string> BasicBackupSet<Storage>::getMissingFiles(const BasicBackupSet& rhs) const {
+  TRACE_SCOPE("BackupSet::getMissingFiles");
+  const auto lhs_filename = [this](FilenameRef filename) {
+    std::string buffer;
+    return std::string(getFilename(filename, buffer));
+  };
+  const auto rhs_filename = [&rhs](FilenameRef filename) {
+    std::string buffer;
+    return std::string(rhs.getFilename(filename, buffer));
+  };
+
   std::vector<std::string> missing;
-  for (const auto& hash_filename_pair : rhs.hash_to_filename_map_) {
-    const auto iter = hash_to_filename_map_.find(hash_filename_pair.first);
-    if (iter == hash_to_filename_map_.cend()) {
-      missing.push_back(hash_filename_pair.second);
-    }
+  for (size_t i = 0; i < ShardCount; i++) {
+    mergeJoin(shards_[i].files, rhs.shards_[i].files, lhs_filename, rhs_filename, &missing, nullptr);
   }
+  mergeJoin(string_hashes_.files, rhs.string_hashes_.files, lhs_filename, rhs_filename, &missing, nullptr);
   return missing;
 }
+
+// Compare this backup set with |rhs| in a single pass over both sets.
+template <typename Storage>
+BackupSetDiff BasicBackupSet<Storage>::diff(const BasicBackupSet& rhs, ThreadPool* pool) const {
+  TRACE_SCOPE("BackupSet::diff");
+  const auto lhs_filename = [this](FilenameRef filename) {
+    std::string buffer;
+    return std::string(getFilename(filename, buffer));
+  };
+  const auto rhs_filename = [&rhs](FilenameRef filename) {
+    std::string buffer;
+    return std::string(rhs.getFilename(filename, buffer));
+  };
+
+  // Compare each shard on its own and concatenate the results in shard order
+  // so the result is deterministic.
+  std::vector<BackupSetDiff> shard_diffs(ShardCount);
+  const auto diff_shard = [&](size_t shard_index) {
+    TRACE_SCOPE("diff shard");
+    auto& shard_diff = shard_diffs[shard_index];
+    mergeJoin(shards_[shard_index].files, rhs.shards_[shard_index].files, lhs_filename, rhs_filename, &shard_diff.missing_files, &shard_diff.extra_files);
+  };
+
+  if (pool) {
+    pool->parallelFor(ShardCount, diff_shard);
+  } else {
+    for (size_t i = 0; i < ShardCount; i++) {
+      diff_shard(i);
+    }
+  }
+
+  BackupSetDiff result;
+  size_t missing_count = 0;
+  size_t extra_count = 0;
+  for (const auto& shard_diff : shard_diffs) {
+    missing_count += shard_diff.missing_files.size();
+    extra_count += shard_diff.extra_files.size();
+  }
+  result.missing_files.reserve(missing_count);
+  result.extra_files.reserve(extra_count);
+  for (auto& shard_diff : shard_diffs) {
+    std::move(shard_diff.missing_files.begin(), shard_diff.missing_files.end(), std::back_inserter(result.missing_files));
+    std::move(shard_diff.extra_files.begin(), shard_diff.extra_files.end(), std::back_inserter(result.extra_files));
+  }
+
+  mergeJoin(string_hashes_.files, rhs.string_hashes_.files, lhs_filename, rhs_filename, &result.missing_files, &result.extra_files);
+  return result;
+}
+
+template class BasicBackupSet<OrderedMapStorage>;
+template class BasicBackupSet<HashMapStorage>;
+template class BasicBackupSet<SortedVectorStorage>;
+template class BasicBackupSet<SwissTableStorage>;
@@ -6,26 +6,305 @@
 #ifndef __BackupSet_h__
 #define __BackupSet_h__
 
-#include <map>
+#include <cstddef>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#include "Arena.h"
+#include "BackupSetStorage.h"
+#include "FilenamePool.h"
+#include "FrontCodedStrings.h"
+#include "Sha1Digest.h"
+
+class MappedFile;
+class ThreadPool;
+
+template <typename Storage>
+class BasicBackupSetWriter;
+
+// The result of comparing two backup sets.
+struct BackupSetDiff {
+  // Files found in the other backup set but not found in this one.
+  std::vector<std::string> missing_files;
+  // Files found in this backup set but not found in the other one.
+  std::vector<std::string> extra_files;
+};
+
+// Memory held by a backup set, in bytes unless noted otherwise.
+struct BackupSetMemoryUsage {
+  // Number of files in the backup set.
+  size_t file_count = 0;
+  // Filenames and string hashes copied into the backup set. Filenames added
+  // by reference are not counted.
+  size_t string_bytes = 0;
+  // Containers holding the files: map nodes, or the arrays of storage
+  // without nodes.
+  size_t node_bytes = 0;
+  // Arena blocks holding the strings and nodes, including unused space, and
+  // the arrays of storage without nodes.
+  size_t reserved_bytes = 0;
+  // Filenames held in compressed form by compressFilenames.
+  size_t compressed_filename_bytes = 0;
+  // Number of arena blocks. Each one is a single heap allocation, compared to
+  // one or two allocations for every file without an arena.
+  size_t block_count = 0;
+};
+
+// A file keyed by digest which has been read but not yet added to a backup set.
+struct BackupSetEntry {
+  Sha1Digest digest;
+  std::string_view filename;
+};
+
 // Hold the details of a set of backup files.
 // Each file consists of a full filesystem path and the sha1 hash of
 // the file contents.
 // File identity is determined by the sha1 hash regardless of the filename.
-class BackupSet {
+//
+// Filenames are held as views into storage owned by the backup set. That is
+// either a copy made when the file is added or a buffer, such as a mapped
+// input file, which the backup set keeps alive. Copies and map nodes are
+// allocated from arenas so a large backup set is freed as a few blocks.
+// Once loaded, the filenames can be compressed to take much less memory and
+// are then decoded as they are needed.
+// Filenames in a mapped file can also be loaded lazily. The backup set then
+// holds only where each filename is in the file and reads it back from the
+// file when it is needed.
+// Alternatively, several backup sets can be built against a shared
+// FilenamePool. Every filename is then held in the pool and each backup set
+// holds only its id, so filenames found in more than one set are stored once.
+//
+// Files keyed by digest are partitioned into shards by the leading byte of
+// the digest. Sha1 digests are uniformly distributed so the shards are evenly
+// sized and can be loaded and compared independently on a thread pool.
+// Visiting the shards in order visits every digest in order.
+//
+// The container holding the files of each shard is picked by |Storage|, one
+// of the policies in BackupSetStorage.h. Every policy gives the same results;
+// they differ in the cost of loading, looking up and comparing files. The
+// policies are instantiated in BackupSet.cc. BackupSet is the default.
+template <typename Storage>
+class BasicBackupSet {
+ public:
+  static constexpr size_t ShardCount = 256;
+
+  // Returns the index of the shard holding |digest|.
+  static size_t getShardIndex(const Sha1Digest& digest) {
+    return digest.bytes[0];
+  }
+
  private:
-  std::map<std::string, std::string> hash_to_filename_map_;
+  // A filename held by the backup set. Either a view of the filename, the
+  // index of the filename in |compressed_filenames_| or the id of the
+  // filename in |filename_pool_|. The size of a view never uses the top two
+  // bits so they mark an index or an id instead.
+  class FilenameRef {
+   private:
+    static constexpr size_t CompressedFlag = static_cast<size_t>(1) << (sizeof(size_t) * 8 - 1);
+    static constexpr size_t PooledFlag = static_cast<size_t>(1) << (sizeof(size_t) * 8 - 2);
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+
+   public:
+    FilenameRef() = default;
+    FilenameRef(std::string_view filename) :
+        data_(filename.data()), size_(filename.size()) {}
+
+    static FilenameRef compressed(size_t index) {
+      FilenameRef filename;
+      filename.size_ = index | CompressedFlag;
+      return filename;
+    }
+
+    static FilenameRef pooled(FilenamePool::Id id) {
+      FilenameRef filename;
+      filename.size_ = id | PooledFlag;
+      return filename;
+    }
+
+    bool isCompressed() const {
+      return (size_ & CompressedFlag) != 0;
+    }
+
+    bool isPooled() const {
+      return (size_ & PooledFlag) != 0;
+    }
+
+    // Returns the index of a compressed filename or the id of a pooled one.
+    size_t index() const {
+      return size_ & ~(CompressedFlag | PooledFlag);
+    }
+
+    // Returns the view of a filename which is not compressed.
+    std::string_view view() const {
+      return std::string_view(data_, size_);
+    }
+  };
+
+  // Files keyed by hash. The map nodes, if the storage has any, and any
+  // strings copied into the map are allocated from arenas owned alongside
+  // it. Each FileMap owns its arenas so shards can be filled concurrently.
+  template <typename Key>
+  struct FileMap {
+    using Map = typename Storage::template Map<Key, FilenameRef>;
+
+    // Declared before |files| so they outlive its nodes. They are held by
+    // pointer so moving the FileMap does not move them.
+    std::unique_ptr<Arena> node_arena;
+    std::unique_ptr<Arena> string_arena;
+    Map files;
+
+    FileMap() :
+        node_arena(std::make_unique<Arena>()),
+        string_arena(std::make_unique<Arena>()),
+        files(node_arena.get()) {}
+    FileMap(FileMap&&) = default;
+    // Swap rather than move member by member, which would free the arenas
+    // before the nodes allocated from them are destroyed.
+    FileMap& operator=(FileMap&& rhs) noexcept {
+      std::swap(node_arena, rhs.node_arena);
+      std::swap(string_arena, rhs.string_arena);
+      files.swap(rhs.files);
+      return *this;
+    }
+
+    void addMemoryUsage(BackupSetMemoryUsage& usage) const;
+  };
+
+  // Files whose digests share the same leading byte.
+  using Shard = FileMap<Sha1Digest>;
 
-  friend class BackupSetWriter;
+  std::vector<Shard> shards_;
+
+  // Fallback for files whose sha1 hash is not a valid hex-string. These hashes
+  // are treated as arbitrary unique string values and are copied into the
+  // map's string arena.
+  FileMap<std::string_view> string_hashes_;
+
+  // Buffers holding filenames added by reference.
+  std::vector<std::shared_ptr<const void>> retained_buffers_;
+
+  // Filenames compressed by compressFilenames, in sorted order.
+  FrontCodedStrings compressed_filenames_;
+
+  // Pool holding every filename added to the backup set, or null if the
+  // backup set holds its own filenames.
+  std::shared_ptr<FilenamePool> filename_pool_;
+
+  // Mapped files whose filenames are read back from the file rather than
+  // the mapping, ordered by address.
+  std::vector<std::shared_ptr<const MappedFile>> lazy_files_;
+
+  // Returns a copy of |filename| owned by the backup set, either in the pool
+  // or in |arena|.
+  FilenameRef copyFilename(Arena& arena, std::string_view filename);
+
+  // Returns a reference to |filename|, which is still copied into the pool
+  // if there is one.
+  FilenameRef referenceFilename(std::string_view filename);
+
+  // Map |sha1| => |filename| in the files keyed by string hashes.
+  void addStringHashFile(std::string_view sha1, FilenameRef filename);
+
+  // Returns the filename held by |filename|. A compressed filename is decoded
+  // into |buffer|, and a lazy one read into it, and the result refers to it.
+  std::string_view getFilename(FilenameRef filename, std::string& buffer) const;
+
+  Shard& getShard(const Sha1Digest& digest) {
+    return shards_[getShardIndex(digest)];
+  }
+
+  // Merge the files belonging to shard |shard_index| from each of |parts|.
+  void addSortedFilesToShard(size_t shard_index, const std::vector<std::vector<BackupSetEntry>>& parts, bool copy_filenames);
+
+  friend class BasicBackupSetWriter<Storage>;
 
  public:
+  BasicBackupSet();
+  // Hold every filename in |filename_pool| instead of in the backup set.
+  explicit BasicBackupSet(std::shared_ptr<FilenamePool> filename_pool);
+  BasicBackupSet(const BasicBackupSet&) = delete;
+  BasicBackupSet& operator=(const BasicBackupSet&) = delete;
+  BasicBackupSet(BasicBackupSet&&) = default;
+  BasicBackupSet& operator=(BasicBackupSet&&) = default;
+  ~BasicBackupSet() = default;
+
   // Add a mapping from |sha1| => |filename| into the backup set.
-  void addFile(const std::string& sha1, const std::string& filename);
+  // If |sha1| is a valid hex-encoded sha1 hash, it is stored as a digest.
+  void addFile(std::string_view sha1, std::string_view filename);
+
+  // Add a mapping from |digest| => |filename| into the backup set.
+  void addFile(const Sha1Digest& digest, std::string_view filename);
+
+  // Add a mapping from |sha1| => |filename| into the backup set without
+  // attempting to decode |sha1| as a digest.
+  void addFileWithStringHash(std::string_view sha1, std::string_view filename);
+
+  // Add a mapping from |digest| => |filename| without copying |filename|.
+  // The memory referenced by |filename| must live as long as this backup set,
+  // usually by passing the buffer which owns it to retainBuffer().
+  // A backup set built against a FilenamePool still adds |filename| to the
+  // pool and does not reference it.
+  void addFileReference(const Sha1Digest& digest, std::string_view filename);
+
+  // Add a mapping from |sha1| => |filename| without copying |filename| and
+  // without attempting to decode |sha1| as a digest.
+  void addFileReferenceWithStringHash(std::string_view sha1, std::string_view filename);
+
+  // Add the files from each of |parts| in order. Every part must be sorted by
+  // digest and hold no duplicate digests. The result is the same as adding
+  // every file one at a time so the file from the last part wins when a
+  // digest is found in more than one part. Sorted parts are merged and added
+  // in order, which is much cheaper than adding the files one at a time.
+  // If |copy_filenames| is false, filenames are added by reference.
+  // When |pool| is not null, shards are filled in parallel on it.
+  void addSortedFiles(const std::vector<std::vector<BackupSetEntry>>& parts, bool copy_filenames, ThreadPool* pool = nullptr);
+
+  // Keep |buffer| alive for as long as this backup set. A backup set built
+  // against a FilenamePool never references filenames so |buffer| is
+  // released right away.
+  void retainBuffer(std::shared_ptr<const void> buffer);
+
+  // Compress every filename in the backup set. Filenames are sorted and
+  // front-coded so paths sharing directories share their storage. The
+  // copies of filenames and the buffers kept alive by retainBuffer are then
+  // released. Filenames are decoded again when they are compared or written,
+  // which takes well under a microsecond each, so the backup set behaves the
+  // same as before. Files added afterwards are held as usual until this is
+  // called again. Filenames held in a FilenamePool are compressed too and
+  // are then no longer shared through the pool.
+  void compressFilenames();
+
+  // Keep |mapped_file| alive like retainBuffer, but load the filenames which
+  // refer into it lazily. Its pages are dropped from memory and the mapping
+  // is no longer read. Each filename is read back from the file with a single
+  // read when it is compared or written instead.
+  void retainLazyFile(std::shared_ptr<const MappedFile> mapped_file);
+
+  // Returns the number of files in the backup set.
+  size_t size() const;
+
+  // Report the memory held by the backup set. Buffers kept alive with
+  // retainBuffer and the FilenamePool, which may be shared, are not included.
+  BackupSetMemoryUsage memoryUsage() const;
 
   // Return the set of filenames which are found in |rhs| but not found in this.
-  std::vector<std::string> getMissingFiles(const BackupSet& rhs);
+  // Files keyed by digest are returned first, followed by files keyed by
+  // string hashes. Each group is ordered by hash.
+  std::vector<std::string> getMissingFiles(const BasicBackupSet& rhs) const;
+
+  // Compare this backup set with |rhs| in a single pass over both sets.
+  // The missing files are the same as getMissingFiles(rhs) and the extra
+  // files are the same as rhs.getMissingFiles(*this).
+  // When |pool| is not null, shards are compared in parallel on it. The
+  // result does not depend on whether a pool is used.
+  BackupSetDiff diff(const BasicBackupSet& rhs, ThreadPool* pool = nullptr) const;
 };
 
+using BackupSet = BasicBackupSet<OrderedMapStorage>;
+
 #endif  // __BackupSet_h__
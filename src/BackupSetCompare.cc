@@ -3,16 +3,34 @@
 // Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <charconv>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
 #include <vector>
 
 #include "BackupSet.h"
+#include "BackupSetExternalDiff.h"
+#include "BackupSetIndex.h"
 #include "BackupSetReader.h"
 #include "BackupSetWriter.h"
+#include "FilenamePool.h"
+#include "FrozenBackupSet.h"
+#include "OutputSink.h"
+#include "ParseCache.h"
+#include "ResourceUsage.h"
+#include "TempDirectory.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 
 using Args = std::vector<std::string>;
 
@@ -22,29 +40,129 @@ constexpr const auto DefaultNewNotInOldFilename = "NewNotInOld.txt";
 constexpr const auto DefaultOldNotInNewFilename = "OldNotInNew.txt";
 constexpr const auto DefaultWriteFilesFlag = false;
 constexpr const auto DefaultValidateInputFlag = false;
+constexpr const auto DefaultSortedInputFlag = false;
+constexpr const auto DefaultCompressFlag = false;
+constexpr const auto DefaultShareFilenamesFlag = false;
+constexpr const auto DefaultLazyFlag = false;
+constexpr const auto DefaultMmapFlag = false;
+constexpr const auto DefaultUringFlag = false;
+constexpr const auto DefaultWriteThreadFlag = false;
+constexpr const size_t DefaultThreadCount = 1;
+constexpr const auto IndexFileExtension = ".bsidx";
+constexpr const uint64_t DefaultMaxMemory = 0;
+constexpr const auto DefaultStatsFlag = false;
+constexpr const uint64_t DefaultCacheMaxBytes = ParseCache::DefaultMaxBytes;
 
 struct Options {
   std::string new_filename = DefaultNewFilename;
   std::string old_filename = DefaultOldFilename;
   bool write_files = DefaultWriteFilesFlag;
   bool validate_input = DefaultValidateInputFlag;
+  bool sorted_input = DefaultSortedInputFlag;
+  bool compress = DefaultCompressFlag;
+  bool share_filenames = DefaultShareFilenamesFlag;
+  bool lazy = DefaultLazyFlag;
+  bool mmap_input = DefaultMmapFlag;
+  bool uring_input = DefaultUringFlag;
+  bool write_thread = DefaultWriteThreadFlag;
+  size_t thread_count = DefaultThreadCount;
+  uint64_t max_memory = DefaultMaxMemory;
+  bool print_stats = DefaultStatsFlag;
+  std::string stats_json_filename;
+  std::string trace_filename;
+  std::string cache_directory;
+  uint64_t cache_max_bytes = DefaultCacheMaxBytes;
+  std::string convert_input_filename;
+  std::string convert_output_filename;
 };
 
 void printHelp() {
-  std::cout << "Usage: backup_set_compare [--new filename] [--old filename] [--writefiles] [--validate]" << std::endl << std::endl;
+  std::cout << "Usage: backup_set_compare [--new filename] [--old filename] [--writefiles] [--write-thread] [--validate] [--sorted] [--compress] [--share-filenames] [--lazy] [--mmap] [--uring] [--threads count] [--max-memory size] [--stats] [--stats-json filename] [--trace filename] [--cache directory] [--cache-size size]" << std::endl;
+  std::cout << "       backup_set_compare --convert input output [--validate] [--threads count]" << std::endl << std::endl;
   std::cout << "Options:" << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--new filename";
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--new filename";
   std::cout << "Load the new backup set from filename (Default: " << std::quoted(DefaultNewFilename) << ")." << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--old filename";
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--old filename";
   std::cout << "Load the old backup set from filename (Default: " << std::quoted(DefaultOldFilename) << ")." << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--writefiles";
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--writefiles";
   std::cout << "Write the sets of missing files between old and new backup sets to files (Default: off)." << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--validate";
-  std::cout << "Validate the backup set loaded from files (Default: off)." << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--help";
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--write-thread";
+  std::cout << "Write output on a thread of its own while the next lines are formatted (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--validate";
+  std::cout << "Validate the backup set loaded from files. Binary indexes are then loaded rather than compared in place (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--sorted";
+  std::cout << "Compare backup sets which are already sorted by hash while reading them, without loading them into memory. Falls back to loading them if they are not sorted (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--compress";
+  std::cout << "Compress the filenames of each backup set once it is loaded to use less memory. Does nothing when both inputs are binary indexes, whose filenames stay in the files (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--share-filenames";
+  std::cout << "Store filenames found in both backup sets once instead of referencing the loaded files. Does nothing when both inputs are binary indexes, whose filenames stay in the files (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--lazy";
+  std::cout << "Keep only the hashes of each backup set in memory and read filenames back from the files as they are needed. Does nothing when both inputs are binary indexes, whose filenames stay in the files (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--mmap";
+  std::cout << "Map text files into memory and parse them in place instead of reading them ahead into buffers on another thread (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--uring";
+  std::cout << "Read text files ahead with io_uring, keeping several direct reads in flight. Falls back to plain reads where io_uring is unavailable (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--threads count";
+  std::cout << "Parse, compare and write backup sets on count threads, 0 for one per hardware thread (Default: " << DefaultThreadCount << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--max-memory size";
+  std::cout << "Compare with an external sort when the backup sets would need more than size bytes of memory. Accepts K, M and G suffixes (Default: unlimited)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--stats";
+  std::cout << "Print the time, throughput and peak memory of each phase of the comparison (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--stats-json file";
+  std::cout << "Write the same statistics as JSON to file (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--trace filename";
+  std::cout << "Write a Chrome trace of the reader, diff and writer to filename. Needs a build with the BACKUP_SET_TRACING cmake option (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--cache directory";
+  std::cout << "Keep binary snapshots of parsed text files in directory and attach them instead of parsing files which have not changed (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--cache-size size";
+  std::cout << "Remove the least recently used snapshots once the cache holds more than size bytes. Accepts K, M and G suffixes (Default: 4G)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--convert in out";
+  std::cout << "Convert the backup set in file in and write it to file out. Writes a binary index if out ends with " << std::quoted(IndexFileExtension) << "." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--help";
   std::cout << "Display this usage information" << std::endl;
 }
 
+// Parse |str| as a non-negative integer into |count|.
+bool parseCount(const std::string& str, size_t& count) {
+  const char* end = str.data() + str.size();
+  const auto result = std::from_chars(str.data(), end, count);
+  return result.ec == std::errc() && result.ptr == end;
+}
+
+// Parse |str| as a number of bytes with an optional K, M or G suffix into
+// |size|.
+bool parseSize(const std::string& str, uint64_t& size) {
+  uint64_t multiplier = 1;
+  auto digits = str;
+  if (!digits.empty()) {
+    switch (digits.back()) {
+    case 'K':
+    case 'k':
+      multiplier = 1024;
+      break;
+    case 'M':
+    case 'm':
+      multiplier = 1024 * 1024;
+      break;
+    case 'G':
+    case 'g':
+      multiplier = 1024 * 1024 * 1024;
+      break;
+    }
+    if (multiplier != 1) {
+      digits.pop_back();
+    }
+  }
+
+  const char* end = digits.data() + digits.size();
+  const auto result = std::from_chars(digits.data(), end, size);
+  if (result.ec != std::errc() || result.ptr != end || size > UINT64_MAX / multiplier) {
+    return false;
+  }
+  size *= multiplier;
+  return true;
+}
+
 void parseArgs(const Args& args, Options& options) {
   for (auto iter = args.cbegin() + 1; iter != args.cend(); iter++) {
     const auto& arg = *iter;
@@ -62,8 +180,89 @@ void parseArgs(const Args& args, Options& options) {
       options.old_filename = *iter;
     } else if (arg == "--writefiles") {
       options.write_files = true;
+    } else if (arg == "--write-thread") {
+      options.write_thread = true;
     } else if (arg == "--validate") {
       options.validate_input = true;
+    } else if (arg == "--sorted") {
+      options.sorted_input = true;
+    } else if (arg == "--compress") {
+      options.compress = true;
+    } else if (arg == "--share-filenames") {
+      options.share_filenames = true;
+    } else if (arg == "--lazy") {
+      options.lazy = true;
+    } else if (arg == "--mmap") {
+      options.mmap_input = true;
+    } else if (arg == "--uring") {
+      options.uring_input = true;
+    } else if (arg == "--threads") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      if (!parseCount(*iter, options.thread_count)) {
+        std::cout << "Invalid thread count: " << std::quoted(*iter) << std::endl;
+        printHelp();
+        exit(-1);
+      }
+      if (options.thread_count == 0) {
+        options.thread_count = ThreadPool::hardwareThreadCount();
+      }
+    } else if (arg == "--max-memory") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      if (!parseSize(*iter, options.max_memory)) {
+        std::cout << "Invalid memory size: " << std::quoted(*iter) << std::endl;
+        printHelp();
+        exit(-1);
+      }
+    } else if (arg == "--stats") {
+      options.print_stats = true;
+    } else if (arg == "--stats-json") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      options.stats_json_filename = *iter;
+    } else if (arg == "--trace") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      if (!Trace::isAvailable()) {
+        std::cout << "Tracing is not available. Build with the BACKUP_SET_TRACING cmake option to use --trace." << std::endl;
+        exit(-1);
+      }
+      options.trace_filename = *iter;
+    } else if (arg == "--cache") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      options.cache_directory = *iter;
+    } else if (arg == "--cache-size") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      if (!parseSize(*iter, options.cache_max_bytes)) {
+        std::cout << "Invalid cache size: " << std::quoted(*iter) << std::endl;
+        printHelp();
+        exit(-1);
+      }
+    } else if (arg == "--convert") {
+      // If there are not two more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      options.convert_input_filename = *iter;
+      if (++iter == args.cend()) {
+        break;
+      }
+      options.convert_output_filename = *iter;
     } else if (arg == "--help") {
       printHelp();
       exit(0);
@@ -75,29 +274,467 @@ void parseArgs(const Args& args, Options& options) {
   }
 }
 
-void readFromFile(BackupSet& backup_set, const std::string& filename, bool validate = false) {
+// Time, work and peak memory of one phase of the comparison.
+struct PhaseStats {
+  std::string name;
+  double wall_seconds = 0;
+  double cpu_seconds = 0;
+  uint64_t bytes = 0;
+  uint64_t lines = 0;
+  uint64_t rejected_lines = 0;
+  size_t peak_resident_bytes = 0;
+};
+
+// Collects PhaseStats for --stats. Everything is measured at the edges of
+// phases, never inside them, and nothing at all is measured unless enabled.
+class CompareStats {
+ private:
+  bool is_enabled_;
+  std::vector<PhaseStats> phases_;
+  std::chrono::steady_clock::time_point wall_start_;
+  double cpu_start_ = 0;
+
+ public:
+  explicit CompareStats(const Options& options) :
+      is_enabled_(options.print_stats || !options.stats_json_filename.empty()) {}
+
+  void begin(const std::string& name) {
+    if (!is_enabled_) {
+      return;
+    }
+    PhaseStats phase;
+    phase.name = name;
+    phases_.push_back(phase);
+    resetPeakResidentBytes();
+    cpu_start_ = getProcessCpuSeconds();
+    wall_start_ = std::chrono::steady_clock::now();
+  }
+
+  // End the phase begun last, which processed |bytes| bytes in |lines| lines
+  // or entries and rejected |rejected_lines| of them.
+  void end(uint64_t bytes, uint64_t lines, uint64_t rejected_lines = 0) {
+    if (!is_enabled_) {
+      return;
+    }
+    auto& phase = phases_.back();
+    phase.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start_).count();
+    phase.cpu_seconds = getProcessCpuSeconds() - cpu_start_;
+    phase.bytes = bytes;
+    phase.lines = lines;
+    phase.rejected_lines = rejected_lines;
+    phase.peak_resident_bytes = getPeakResidentBytes();
+  }
+
+  // Forget the phase begun last, which did not happen after all.
+  void cancel() {
+    if (is_enabled_) {
+      phases_.pop_back();
+    }
+  }
+
+  void end(const BackupSetReaderStats& stats) {
+    end(stats.bytes, stats.line_count, stats.rejected_line_count);
+  }
+
+  bool isEnabled() const {
+    return is_enabled_;
+  }
+
+  // Add |phase|, which ran on a thread of its own while the phase ended last
+  // ran, just before that phase. It has the peak memory of that phase.
+  void addOverlapped(PhaseStats phase) {
+    if (!is_enabled_) {
+      return;
+    }
+    phase.peak_resident_bytes = phases_.back().peak_resident_bytes;
+    phases_.insert(phases_.end() - 1, std::move(phase));
+  }
+
+  // Print the phases as a table to the console and write them as JSON, as
+  // the options ask.
+  void report(const Options& options) const {
+    if (options.print_stats) {
+      print();
+    }
+    if (!options.stats_json_filename.empty() && !writeJson(options.stats_json_filename)) {
+      std::cout << "Failed to write statistics to " << std::quoted(options.stats_json_filename) << std::endl;
+      exit(-1);
+    }
+  }
+
+  void print() const {
+    std::cout << "Statistics:" << std::endl;
+    std::cout << std::left << std::setw(18) << "phase" << std::right << std::setw(10) << "wall s" << std::setw(10) << "cpu s" << std::setw(12) << "MB"
+              << std::setw(12) << "lines" << std::setw(10) << "rejected" << std::setw(10) << "MB/s" << std::setw(14) << "lines/s" << std::setw(14) << "peak RSS MB" << std::endl;
+    for (const auto& phase : phases_) {
+      const auto megabytes = static_cast<double>(phase.bytes) / (1024 * 1024);
+      const auto wall_seconds = phase.wall_seconds > 0 ? phase.wall_seconds : 1e-9;
+      std::cout << std::left << std::setw(18) << phase.name << std::right << std::fixed << std::setprecision(3) << std::setw(10) << phase.wall_seconds
+                << std::setw(10) << phase.cpu_seconds << std::setprecision(1) << std::setw(12) << megabytes << std::setw(12) << phase.lines
+                << std::setw(10) << phase.rejected_lines << std::setw(10) << megabytes / wall_seconds << std::setprecision(0)
+                << std::setw(14) << static_cast<double>(phase.lines) / wall_seconds << std::setprecision(1)
+                << std::setw(14) << static_cast<double>(phase.peak_resident_bytes) / (1024 * 1024) << std::endl;
+    }
+    std::cout << std::defaultfloat << std::setprecision(6) << std::endl;
+  }
+
+  bool writeJson(const std::string& filename) const {
+    std::ofstream ofs(filename, std::ofstream::out | std::ofstream::binary);
+    if (!ofs) {
+      return false;
+    }
+    ofs << std::setprecision(9) << "{\"phases\": [";
+    for (size_t i = 0; i < phases_.size(); i++) {
+      const auto& phase = phases_[i];
+      ofs << (i == 0 ? "\n" : ",\n") << "  {\"name\": \"" << phase.name << "\", \"wall_seconds\": " << phase.wall_seconds
+          << ", \"cpu_seconds\": " << phase.cpu_seconds << ", \"bytes\": " << phase.bytes << ", \"lines\": " << phase.lines
+          << ", \"rejected_lines\": " << phase.rejected_lines << ", \"peak_resident_bytes\": " << phase.peak_resident_bytes << "}";
+    }
+    ofs << "\n]}\n";
+    return static_cast<bool>(ofs.flush());
+  }
+};
+
+// Returns the size of the file named |filename|, or 0 if it has none.
+uint64_t getFileSize(const std::string& filename) {
+  std::error_code error;
+  const auto size = std::filesystem::file_size(filename, error);
+  return error ? 0 : size;
+}
+
+// Returns true if the file named |filename| is a regular file starting with
+// the binary index magic. Other files, such as pipes, are not peeked at so
+// they can still be read from the start.
+bool isIndexFile(const std::string& filename) {
+  if (!std::filesystem::is_regular_file(filename)) {
+    return false;
+  }
+  std::ifstream ifs(filename, std::ifstream::in | std::ifstream::binary);
+  char magic[sizeof(BackupSetIndexHeader::Magic)];
+  return ifs.read(magic, sizeof(magic)) && BackupSetIndexHeader::hasMagic(std::string_view(magic, sizeof(magic)));
+}
+
+// Parse the file named |filename| into |backup_set| and set |stats| to what
+// was read. Returns false with a message in |error| if the file could not be
+// read.
+bool parseFile(BackupSet& backup_set, const std::string& filename, const Options& options, BackupSetReaderStats& stats, std::string& error) {
   BackupSetReader reader(backup_set);
-  if (validate) {
+  if (options.validate_input) {
     reader.enableValidation();
   }
+  if (options.lazy) {
+    reader.enableLazyFilenames();
+  }
+  if (options.uring_input) {
+    reader.enableUring();
+  }
+  reader.setThreadCount(options.thread_count);
+
+  // Text is read ahead on a thread of its own while it is parsed. Binary
+  // indexes are attached in place and lazy filenames are read back from the
+  // file, so those need the file mapped instead.
+  const auto is_index = isIndexFile(filename);
+  if (!is_index && !options.lazy && !options.mmap_input) {
+    if (reader.readFilePipelined(filename)) {
+      stats = reader.getStats();
+      return true;
+    }
+    if (reader.getStats().bytes != 0) {
+      error = "Failed to read " + filename;
+      return false;
+    }
+  }
+
+  // Read the file in place if it can be mapped. Otherwise, fall back to
+  // reading it as a stream which also supports pipes.
+  if (reader.readFile(filename)) {
+    stats = reader.getStats();
+    return true;
+  }
+
+  // A regular file which could not be read in place is most likely an
+  // invalid binary index. Don't try to read that as text.
+  if (is_index) {
+    error = "Invalid backup set index: " + filename;
+    return false;
+  }
 
   std::ifstream ifs;
   ifs.open(filename, std::ifstream::in);
   reader.read(ifs);
   ifs.close();
+  stats = reader.getStats();
+  return true;
+}
+
+// Returns true if the file named |filename| may be read through |cache|.
+// Binary indexes need no parsing. Lazy filenames are read back from the text
+// file itself.
+bool isCacheable(const ParseCache* cache, const std::string& filename, const Options& options) {
+  return cache && !options.lazy && !isIndexFile(filename);
+}
+
+// Read the file named |filename| into |backup_set| and set |stats| to what
+// was read. A text file which is unchanged since it was last parsed is
+// attached from its snapshot in |cache|, if there is one, and the snapshot
+// is stored otherwise. Returns false with a message in |error| if the file
+// could not be read. Safe to call for two backup sets at once.
+bool readFromFile(BackupSet& backup_set, const std::string& filename, const Options& options, ParseCache* cache, BackupSetReaderStats& stats,
+                  std::string& error) {
+  TRACE_SCOPE("readFromFile");
+  ParseCacheKey key;
+  if (!isCacheable(cache, filename, options) || !ParseCache::makeKey(filename, options.validate_input, key)) {
+    return parseFile(backup_set, filename, options, stats, error);
+  }
+
+  const auto snapshot = cache->find(key);
+  if (!snapshot.empty()) {
+    BackupSetReader reader(backup_set);
+    if (reader.readFile(snapshot)) {
+      stats = reader.getStats();
+      return true;
+    }
+    cache->remove(key);
+  }
+
+  if (!parseFile(backup_set, filename, options, stats, error)) {
+    return false;
+  }
+  // The backup set is complete without its snapshot, so failing to store
+  // one is not an error.
+  cache->store(key, backup_set);
+  return true;
+}
+
+// Same as readFromFile but exits on failure.
+BackupSetReaderStats readFromFileOrExit(BackupSet& backup_set, const std::string& filename, const Options& options) {
+  BackupSetReaderStats stats;
+  std::string error;
+  if (!readFromFile(backup_set, filename, options, nullptr, stats, error)) {
+    std::cout << error << std::endl;
+    exit(-1);
+  }
+  return stats;
+}
+
+// Returns true if |filename| ends with the binary index file extension.
+bool isIndexFilename(const std::string& filename) {
+  const std::string extension = IndexFileExtension;
+  return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+void convertFile(const Options& options, CompareStats& stats) {
+  TRACE_SCOPE("convertFile");
+  BackupSet backup_set;
+  stats.begin("read input");
+  stats.end(readFromFileOrExit(backup_set, options.convert_input_filename, options));
+
+  stats.begin("write output");
+  BackupSetWriter writer(backup_set);
+  writer.setThreadCount(options.thread_count);
+  if (options.write_thread) {
+    writer.enableWriteThread();
+  }
+  const auto is_written = isIndexFilename(options.convert_output_filename) ? writer.writeIndexFile(options.convert_output_filename)
+                                                                             : writer.writeFile(options.convert_output_filename);
+  if (!is_written) {
+    std::cout << "Failed to write " << std::quoted(options.convert_output_filename) << std::endl;
+    exit(-1);
+  }
+  stats.end(getFileSize(options.convert_output_filename), backup_set.size());
 }
 
-void writeToStream(const std::vector<std::string>& filenames, std::ostream& os) {
+// Returns the number of bytes written.
+uint64_t writeToStream(const std::vector<std::string>& filenames, std::ostream& os) {
+  TRACE_SCOPE("writeToStream");
+  uint64_t bytes = 0;
   for (const auto& f : filenames) {
-    os << f << std::endl;
+    os << f << '\n';
+    bytes += f.size() + 1;
+  }
+  return bytes;
+}
+
+// Write |filenames| through |sink|, which is closed afterwards. |name| is
+// reported if they could not be written. Returns the number of bytes written.
+uint64_t writeToSink(const std::vector<std::string>& filenames, std::unique_ptr<OutputSink> sink, const std::string& name) {
+  if (!sink) {
+    std::cout << "Failed to open " << std::quoted(name) << std::endl;
+    exit(-1);
+  }
+  std::ostream os(sink.get());
+  const auto bytes = writeToStream(filenames, os);
+  if (!os.good() || !sink->close()) {
+    std::cout << "Failed to write " << std::quoted(name) << std::endl;
+    exit(-1);
+  }
+  return bytes;
+}
+
+uint64_t writeToFile(const std::vector<std::string>& filenames, const std::string& filename, const Options& options) {
+  TRACE_SCOPE("writeToFile");
+  return writeToSink(filenames, OutputSink::open(filename, options.write_thread), filename);
+}
+
+// Write |filenames| to the console, bypassing std::cout which is flushed
+// first so the output stays in order.
+uint64_t writeToConsole(const std::vector<std::string>& filenames, const Options& options) {
+  std::cout.flush();
+  return writeToSink(filenames, OutputSink::openStandardOutput(options.write_thread), "the console");
+}
+
+// Compare the backup sets with |diff|, which writes the missing files to the
+// two streams it is given as it finds them. Returns false if |diff| failed.
+bool streamDiff(const Options& options, const std::function<bool(std::ostream&, std::ostream&)>& diff) {
+  TRACE_SCOPE("streamDiff");
+  if (options.write_files) {
+    auto new_not_in_old_sink = OutputSink::open(DefaultNewNotInOldFilename, options.write_thread);
+    auto old_not_in_new_sink = OutputSink::open(DefaultOldNotInNewFilename, options.write_thread);
+    if (!new_not_in_old_sink || !old_not_in_new_sink) {
+      return false;
+    }
+    std::ostream new_not_in_old(new_not_in_old_sink.get());
+    std::ostream old_not_in_new(old_not_in_new_sink.get());
+    const auto is_done = diff(new_not_in_old, old_not_in_new) && new_not_in_old.good() && old_not_in_new.good();
+    const auto is_new_not_in_old_written = new_not_in_old_sink->close();
+    const auto is_old_not_in_new_written = old_not_in_new_sink->close();
+    return is_done && is_new_not_in_old_written && is_old_not_in_new_written;
+  }
+
+  // Both lists are found at once. Stream the first one to the console and
+  // hold the second one in a temporary file until the first is done. The
+  // file is in a directory of this run's own, so runs at the same time don't
+  // share it.
+  TempDirectory temp_directory("backup_set_compare_");
+  if (temp_directory.path().empty()) {
+    return false;
+  }
+  const auto old_not_in_new_filename = (temp_directory.path() / DefaultOldNotInNewFilename).string();
+  bool is_done;
+  std::cout << "Files found in new but not present in old (NewNotInOld):" << std::endl;
+  {
+    auto old_not_in_new_sink = OutputSink::open(old_not_in_new_filename, options.write_thread);
+    if (old_not_in_new_sink) {
+      std::ostream old_not_in_new(old_not_in_new_sink.get());
+      is_done = diff(std::cout, old_not_in_new) && old_not_in_new.good() && old_not_in_new_sink->close();
+    } else {
+      is_done = false;
+    }
+  }
+  std::cout << std::endl;
+
+  if (is_done) {
+    std::cout << "Files found in old but not present in new (OldNotInNew):" << std::endl;
+    std::ifstream old_not_in_new(old_not_in_new_filename, std::ifstream::in);
+    if (old_not_in_new.peek() != std::ifstream::traits_type::eof()) {
+      std::cout << old_not_in_new.rdbuf();
+    }
+    std::cout << std::endl;
+  }
+  return is_done;
+}
+
+// Compare the backup sets with an external sort which writes the missing
+// files as it finds them.
+void externalDiff(const Options& options, CompareStats& stats) {
+  BackupSetExternalDiff external_diff(static_cast<size_t>(options.max_memory));
+  if (options.validate_input) {
+    external_diff.enableValidation();
+  }
+
+  // Reading, sorting, comparing and writing are interleaved so they are
+  // measured as one phase.
+  stats.begin("external diff");
+  const auto is_done = streamDiff(options, [&](std::ostream& new_not_in_old, std::ostream& old_not_in_new) {
+    return external_diff.diff(options.old_filename, options.new_filename, new_not_in_old, old_not_in_new);
+  });
+  stats.end(getFileSize(options.old_filename) + getFileSize(options.new_filename), 0);
+  if (!is_done) {
+    std::cout << "Failed to compare the backup sets with an external sort." << std::endl;
+    exit(-1);
+  }
+}
+
+// Compare backup sets which are already sorted by hash straight from their
+// files. Returns false if they turned out not to be sorted or could not be
+// read, in which case they still need to be compared some other way.
+bool sortedDiff(const Options& options, CompareStats& stats) {
+  BackupSetExternalDiff external_diff(static_cast<size_t>(options.max_memory));
+  if (options.validate_input) {
+    external_diff.enableValidation();
+  }
+
+  stats.begin("sorted diff");
+  const auto is_done = streamDiff(options, [&](std::ostream& new_not_in_old, std::ostream& old_not_in_new) {
+    return external_diff.diffSorted(options.old_filename, options.new_filename, new_not_in_old, old_not_in_new);
+  });
+  stats.end(getFileSize(options.old_filename) + getFileSize(options.new_filename), 0);
+  if (!is_done) {
+    std::cout << "The backup sets are not sorted by hash or could not be read. Comparing them in memory instead." << std::endl << std::endl;
+  }
+  return is_done;
+}
+
+// Write the missing files found by |diff| to the console or to files.
+void writeDiff(const BackupSetDiff& diff, const Options& options, CompareStats& stats) {
+  const auto& new_not_in_old = diff.missing_files;
+  const auto& old_not_in_new = diff.extra_files;
+
+  if (options.write_files) {
+    stats.begin("write new not old");
+    stats.end(writeToFile(new_not_in_old, DefaultNewNotInOldFilename, options), new_not_in_old.size());
+    stats.begin("write old not new");
+    stats.end(writeToFile(old_not_in_new, DefaultOldNotInNewFilename, options), old_not_in_new.size());
+  } else {
+    stats.begin("write new not old");
+    std::cout << "Files found in new but not present in old (NewNotInOld):" << std::endl;
+    const auto new_not_in_old_bytes = writeToConsole(new_not_in_old, options);
+    std::cout << std::endl;
+    stats.end(new_not_in_old_bytes, new_not_in_old.size());
+
+    stats.begin("write old not new");
+    std::cout << "Files found in old but not present in new (OldNotInNew):" << std::endl;
+    const auto old_not_in_new_bytes = writeToConsole(old_not_in_new, options);
+    std::cout << std::endl;
+    stats.end(old_not_in_new_bytes, old_not_in_new.size());
   }
 }
 
-void writeToFile(const std::vector<std::string>& filenames, const std::string& filename) {
-  std::ofstream ofs;
-  ofs.open(filename, std::ofstream::out);
-  writeToStream(filenames, ofs);
-  ofs.close();
+// Compare two binary indexes in place as frozen backup sets, without
+// loading them into maps. Returns false if either file is not a valid index,
+// in which case they still need to be compared some other way.
+bool frozenDiff(const Options& options, ThreadPool* pool, CompareStats& stats) {
+  stats.begin("open new index");
+  const auto new_set = FrozenBackupSet::open(options.new_filename);
+  if (!new_set) {
+    stats.cancel();
+    return false;
+  }
+  stats.end(getFileSize(options.new_filename), new_set->size());
+  stats.begin("open old index");
+  const auto old_set = FrozenBackupSet::open(options.old_filename);
+  if (!old_set) {
+    // The new index was opened for nothing, so forget both phases.
+    stats.cancel();
+    stats.cancel();
+    return false;
+  }
+  stats.end(getFileSize(options.old_filename), old_set->size());
+
+  stats.begin("diff");
+  const auto diff = old_set->diff(*new_set, pool);
+  stats.end(0, old_set->size() + new_set->size());
+  writeDiff(diff, options, stats);
+  return true;
+}
+
+// Report the statistics and write the trace, as the options ask.
+void finish(const Options& options, const CompareStats& stats) {
+  stats.report(options);
+  if (!options.trace_filename.empty() && !Trace::writeChromeJson(options.trace_filename)) {
+    std::cout << "Failed to write the trace to " << std::quoted(options.trace_filename) << std::endl;
+    exit(-1);
+  }
 }
 
 int main(int argc, const char** argv) {
@@ -111,28 +748,157 @@ int main(int argc, const char** argv) {
 
   Options options;
   parseArgs(args, options);
+  CompareStats stats(options);
+  if (!options.trace_filename.empty()) {
+    Trace::enable();
+  }
 
-  BackupSet new_set;
-  BackupSet old_set;
-  readFromFile(new_set, options.new_filename, options.validate_input);
-  readFromFile(old_set, options.old_filename, options.validate_input);
+  if (!options.convert_input_filename.empty()) {
+    convertFile(options, stats);
+    finish(options, stats);
+    std::cout << "Done" << std::endl;
+    return 0;
+  }
 
-  const auto new_not_in_old = old_set.getMissingFiles(new_set);
-  const auto old_not_in_new = new_set.getMissingFiles(old_set);
+  // Sorted inputs can be compared without loading or sorting them.
+  if (options.sorted_input && sortedDiff(options, stats)) {
+    finish(options, stats);
+    std::cout << "Done" << std::endl;
+    return 0;
+  }
 
-  if (options.write_files) {
-    writeToFile(new_not_in_old, DefaultNewNotInOldFilename);
-    writeToFile(old_not_in_new, DefaultOldNotInNewFilename);
-  } else {
-    std::cout << "Files found in new but not present in old (NewNotInOld):" << std::endl;
-    writeToStream(new_not_in_old, std::cout);
-    std::cout << std::endl;
+  // Fall back to the external sort if loading both sets would not fit.
+  if (options.max_memory != 0) {
+    const auto estimated_memory = BackupSetExternalDiff::estimateMemoryUsage(options.new_filename) + BackupSetExternalDiff::estimateMemoryUsage(options.old_filename);
+    if (estimated_memory > options.max_memory) {
+      externalDiff(options, stats);
+      finish(options, stats);
+      std::cout << "Done" << std::endl;
+      return 0;
+    }
+  }
 
-    std::cout << "Files found in old but not present in new (OldNotInNew):" << std::endl;
-    writeToStream(old_not_in_new, std::cout);
-    std::cout << std::endl;
+  // Compare the sets shard by shard on a thread pool if we have threads.
+  std::unique_ptr<ThreadPool> pool;
+  if (options.thread_count > 1) {
+    pool = std::make_unique<ThreadPool>(options.thread_count);
+  }
+
+  // Binary indexes are already laid out for lookups and can be compared
+  // where they are. Their filenames stay in the files either way, so there
+  // is nothing to compress or load lazily. Validation has to look at every
+  // entry, so validated indexes are loaded instead.
+  if (!options.validate_input && frozenDiff(options, pool.get(), stats)) {
+    finish(options, stats);
+    std::cout << "Done" << std::endl;
+    return 0;
+  }
+
+  // Text files parsed before are kept as binary snapshots. When both files
+  // have one, compare the snapshots in place without loading anything.
+  std::unique_ptr<ParseCache> cache;
+  if (!options.cache_directory.empty()) {
+    cache = ParseCache::open(options.cache_directory, options.cache_max_bytes);
+    if (!cache) {
+      std::cout << "Failed to open the cache directory " << std::quoted(options.cache_directory) << std::endl;
+      exit(-1);
+    }
+    ParseCacheKey new_key;
+    ParseCacheKey old_key;
+    if (isCacheable(cache.get(), options.new_filename, options) && isCacheable(cache.get(), options.old_filename, options) &&
+        ParseCache::makeKey(options.new_filename, options.validate_input, new_key) &&
+        ParseCache::makeKey(options.old_filename, options.validate_input, old_key)) {
+      auto snapshot_options = options;
+      snapshot_options.new_filename = cache->find(new_key);
+      snapshot_options.old_filename = cache->find(old_key);
+      if (!snapshot_options.new_filename.empty() && !snapshot_options.old_filename.empty() && frozenDiff(snapshot_options, pool.get(), stats)) {
+        finish(options, stats);
+        std::cout << "Done" << std::endl;
+        return 0;
+      }
+    }
+  }
+
+  // Both sets share one pool of filenames if asked.
+  std::shared_ptr<FilenamePool> filename_pool;
+  if (options.share_filenames) {
+    filename_pool = std::make_shared<FilenamePool>();
+  }
+  BackupSet new_set(filename_pool);
+  BackupSet old_set(filename_pool);
+  // Load both sets at once so reading one file overlaps with parsing the
+  // other. On a single hardware thread the two parsers would only take turns
+  // and evict each other's cache lines, so load one after the other there;
+  // each load still reads ahead while it parses. Validation happens while
+  // parsing, so its cost is part of reading and the lines it rejects are
+  // counted there.
+  const std::string read_names[2] = {
+      options.validate_input ? "read+validate new" : "read new",
+      options.validate_input ? "read+validate old" : "read old"};
+  BackupSetReaderStats read_stats[2];
+  std::string errors[2];
+  bool is_read[2];
+  const auto load = [&](size_t i) {
+    is_read[i] = i == 0 ? readFromFile(new_set, options.new_filename, options, cache.get(), read_stats[0], errors[0])
+                        : readFromFile(old_set, options.old_filename, options, cache.get(), read_stats[1], errors[1]);
+  };
+  const auto exit_if_unread = [&](size_t i) {
+    if (!is_read[i]) {
+      std::cout << errors[i] << std::endl;
+      exit(-1);
+    }
+  };
+  if (ThreadPool::hardwareThreadCount() > 1) {
+    // The process CPU time of overlapping loads can't be split between them.
+    // Each set gets the wall time of its load and the CPU time of the thread
+    // which loaded it, and a last row holds both loads together.
+    PhaseStats read_phases[2];
+    stats.begin(options.validate_input ? "read+validate both" : "read both");
+    ThreadPool loaders(2);
+    loaders.parallelFor(2, [&](size_t i) {
+      if (!stats.isEnabled()) {
+        load(i);
+        return;
+      }
+      const auto wall_start = std::chrono::steady_clock::now();
+      const auto cpu_start = getThreadCpuSeconds();
+      load(i);
+      read_phases[i].wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+      read_phases[i].cpu_seconds = getThreadCpuSeconds() - cpu_start;
+    });
+    exit_if_unread(0);
+    exit_if_unread(1);
+    stats.end(read_stats[0].bytes + read_stats[1].bytes, read_stats[0].line_count + read_stats[1].line_count,
+        read_stats[0].rejected_line_count + read_stats[1].rejected_line_count);
+    for (size_t i = 0; i < 2; i++) {
+      read_phases[i].name = read_names[i];
+      read_phases[i].bytes = read_stats[i].bytes;
+      read_phases[i].lines = read_stats[i].line_count;
+      read_phases[i].rejected_lines = read_stats[i].rejected_line_count;
+      stats.addOverlapped(read_phases[i]);
+    }
+  } else {
+    for (size_t i = 0; i < 2; i++) {
+      stats.begin(read_names[i]);
+      load(i);
+      exit_if_unread(i);
+      stats.end(read_stats[i]);
+    }
+  }
+  if (options.compress) {
+    stats.begin("compress");
+    new_set.compressFilenames();
+    old_set.compressFilenames();
+    stats.end(0, new_set.size() + old_set.size());
   }
 
+  // Both directions are found in one merge of the sets.
+  stats.begin("diff");
+  const auto diff = old_set.diff(new_set, pool.get());
+  stats.end(0, old_set.size() + new_set.size());
+  writeDiff(diff, options, stats);
+
+  finish(options, stats);
   std::cout << "Done" << std::endl;
   return 0;
 }
@@ -0,0 +1,631 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "BackupSetExternalDiff.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "BackupSetIndex.h"
+#include "BackupSetLine.h"
+#include "MappedFile.h"
+#include "Sha1Digest.h"
+#include "TempDirectory.h"
+
+namespace {
+
+// Largest and smallest buffer used for each run file while writing or
+// merging.
+constexpr size_t RunBufferSize = 256 * 1024;
+constexpr size_t MinRunBufferSize = 4 * 1024;
+
+// Most run files of one input merged at once. Both inputs are merged at the
+// same time, so this keeps the open files well under common descriptor
+// limits. Inputs with more runs are merged in several passes.
+constexpr size_t MaxMergeWidth = 32;
+
+// Merging fewer runs than this at once would take more passes than the
+// memory saved is worth.
+constexpr size_t MinMergeBufferSize = 16 * 1024;
+
+// Rough cost of one file in a BackupSet beyond its filename: a map node
+// holding the digest and filename view plus allocator overhead.
+constexpr uint64_t EstimatedBytesPerFile = 96;
+
+// Files keyed by digest sort before files keyed by string hashes, matching
+// the order BackupSet reports them in.
+enum class KeyType : uint8_t {
+  Digest = 0,
+  StringHash = 1,
+};
+
+// A file read from a sorted run or index. The strings are reused from one
+// record to the next to avoid allocating for every file.
+struct Record {
+  KeyType key_type = KeyType::Digest;
+  Sha1Digest digest;
+  std::string string_hash;
+  std::string filename;
+};
+
+int compareKeys(KeyType lhs_type, const Sha1Digest& lhs_digest, std::string_view lhs_hash, KeyType rhs_type, const Sha1Digest& rhs_digest, std::string_view rhs_hash) {
+  if (lhs_type != rhs_type) {
+    return lhs_type < rhs_type ? -1 : 1;
+  }
+  if (lhs_type == KeyType::Digest) {
+    return std::memcmp(lhs_digest.bytes.data(), rhs_digest.bytes.data(), Sha1Digest::Size);
+  }
+  // Compares as unsigned characters like the std::string keys in BackupSet.
+  return lhs_hash.compare(rhs_hash);
+}
+
+int compareKeys(const Record& lhs, const Record& rhs) {
+  return compareKeys(lhs.key_type, lhs.digest, lhs.string_hash, rhs.key_type, rhs.digest, rhs.string_hash);
+}
+
+// Produces records in key order with no duplicate keys.
+class RecordSource {
+ public:
+  virtual ~RecordSource() = default;
+
+  // Read the next record into |record|. Returns false when there are no more
+  // records or the source failed.
+  virtual bool next(Record& record) = 0;
+
+  // Returns true if the source stopped early because its input is invalid.
+  virtual bool failed() const {
+    return false;
+  }
+};
+
+// Reads a run file written by writeRun or mergeRuns.
+class RunFileSource : public RecordSource {
+ private:
+  std::vector<char> buffer_;
+  std::ifstream ifs_;
+  bool failed_ = false;
+
+  bool readString(std::string& str) {
+    char size[sizeof(uint64_t)];
+    if (!ifs_.read(size, sizeof(size))) {
+      return false;
+    }
+    str.resize(loadLittleEndian64(size));
+    return static_cast<bool>(ifs_.read(str.data(), static_cast<std::streamsize>(str.size())));
+  }
+
+ public:
+  RunFileSource(const std::filesystem::path& path, size_t buffer_size) :
+      buffer_(buffer_size) {
+    ifs_.rdbuf()->pubsetbuf(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    ifs_.open(path, std::ifstream::in | std::ifstream::binary);
+    failed_ = !ifs_;
+  }
+
+  bool next(Record& record) override {
+    char key_type;
+    if (failed_ || !ifs_.get(key_type)) {
+      // The end of the file is only expected between records.
+      failed_ = failed_ || ifs_.bad() || !ifs_.eof();
+      return false;
+    }
+    record.key_type = static_cast<KeyType>(key_type);
+    bool is_read;
+    if (record.key_type == KeyType::Digest) {
+      is_read = static_cast<bool>(ifs_.read(reinterpret_cast<char*>(record.digest.bytes.data()), Sha1Digest::Size));
+    } else {
+      is_read = record.key_type == KeyType::StringHash && readString(record.string_hash);
+    }
+    is_read = is_read && readString(record.filename);
+    failed_ = !is_read;
+    return is_read;
+  }
+
+  bool failed() const override {
+    return failed_;
+  }
+};
+
+// Reads the files in a mapped binary index, which are already in key order.
+class IndexSource : public RecordSource {
+ private:
+  std::shared_ptr<MappedFile> mapped_file_;
+  BackupSetIndexHeader header_;
+  uint64_t next_index_ = 0;
+  Sha1Digest previous_digest_;
+  bool should_validate_;
+  bool failed_ = false;
+
+  // Read the blob slice described by offsets |index| and |index| + 1 of the
+  // offset table at |offsets_offset| into |str|.
+  bool readSlice(uint64_t offsets_offset, uint64_t index, uint64_t blob_offset, uint64_t blob_size, std::string& str) {
+    const char* offsets = mapped_file_->data() + offsets_offset;
+    const auto begin = loadLittleEndian64(offsets + index * sizeof(uint64_t));
+    const auto end = loadLittleEndian64(offsets + (index + 1) * sizeof(uint64_t));
+    if (begin > end || end > blob_size) {
+      return false;
+    }
+    str.assign(mapped_file_->data() + blob_offset + begin, end - begin);
+    return true;
+  }
+
+ public:
+  IndexSource(std::shared_ptr<MappedFile> mapped_file, const BackupSetIndexHeader& header, bool should_validate) :
+      mapped_file_(std::move(mapped_file)), header_(header), should_validate_(should_validate) {}
+
+  bool next(Record& record) override {
+    // String hashes are not hex-strings, so validation skips them like the
+    // lines of text they were read from.
+    const auto file_count = header_.digest_count + (should_validate_ ? 0 : header_.string_hash_count);
+    if (failed_ || next_index_ >= file_count) {
+      return false;
+    }
+
+    const auto i = next_index_++;
+    bool is_valid;
+    if (i < header_.digest_count) {
+      record.key_type = KeyType::Digest;
+      std::memcpy(record.digest.bytes.data(), mapped_file_->data() + header_.digests_offset + i * Sha1Digest::Size, Sha1Digest::Size);
+      // Digests must be strictly ascending.
+      is_valid = i == 0 || previous_digest_ < record.digest;
+      previous_digest_ = record.digest;
+    } else {
+      const auto string_hashes_size = header_.filenames_offset - std::min(header_.filenames_offset, header_.string_hashes_offset);
+      record.key_type = KeyType::StringHash;
+      is_valid = readSlice(header_.string_hash_offsets_offset, i - header_.digest_count, header_.string_hashes_offset, string_hashes_size, record.string_hash);
+    }
+
+    is_valid = is_valid && readSlice(header_.filename_offsets_offset, i, header_.filenames_offset, header_.filenames_size, record.filename);
+    failed_ = !is_valid;
+    return is_valid;
+  }
+
+  bool failed() const override {
+    return failed_;
+  }
+};
+
+// Reads a text backup set which is already sorted by key, one line at a time.
+// A line is read ahead so duplicate keys, which are next to each other in a
+// sorted input, can be dropped in favor of the last one. The source fails as
+// soon as a key is found out of order.
+class SortedTextSource : public RecordSource {
+ private:
+  std::vector<char> buffer_;
+  std::ifstream ifs_;
+  std::string line_;
+  Record pending_;
+  bool has_pending_ = false;
+  bool should_validate_;
+  bool failed_ = false;
+
+  // Read the next valid line into |record|. Returns false at the end of the
+  // input.
+  bool readRecord(Record& record) {
+    while (std::getline(ifs_, line_)) {
+      Sha1Digest digest;
+      std::string_view sha1hash;
+      std::string_view filename;
+      const auto line_type = parseBackupSetLine(line_, should_validate_, digest, sha1hash, filename);
+      if (line_type == BackupSetLineType::Invalid) {
+        continue;
+      }
+
+      if (line_type == BackupSetLineType::Digest) {
+        record.key_type = KeyType::Digest;
+        record.digest = digest;
+      } else {
+        record.key_type = KeyType::StringHash;
+        record.string_hash.assign(sha1hash);
+      }
+      record.filename.assign(filename);
+      return true;
+    }
+    return false;
+  }
+
+ public:
+  SortedTextSource(const std::string& filename, bool should_validate) :
+      buffer_(RunBufferSize), should_validate_(should_validate) {
+    ifs_.rdbuf()->pubsetbuf(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    ifs_.open(filename, std::ifstream::in);
+    failed_ = !ifs_;
+    has_pending_ = !failed_ && readRecord(pending_);
+  }
+
+  bool next(Record& record) override {
+    if (failed_ || !has_pending_) {
+      return false;
+    }
+
+    std::swap(record, pending_);
+    while ((has_pending_ = readRecord(pending_))) {
+      const auto result = compareKeys(record, pending_);
+      if (result < 0) {
+        break;
+      }
+      if (result > 0) {
+        failed_ = true;
+        return false;
+      }
+      std::swap(record, pending_);
+    }
+    return true;
+  }
+
+  bool failed() const override {
+    return failed_;
+  }
+};
+
+// Merges several sources into one. When more than one source holds the same
+// key, the record from the last source wins as if every source had been read
+// in order.
+class MergedSource : public RecordSource {
+ private:
+  std::vector<std::unique_ptr<RecordSource>> sources_;
+  std::vector<Record> heads_;
+  std::priority_queue<size_t, std::vector<size_t>, std::function<bool(size_t, size_t)>> queue_;
+
+  void advance(size_t source_index) {
+    if (sources_[source_index]->next(heads_[source_index])) {
+      queue_.push(source_index);
+    }
+  }
+
+ public:
+  explicit MergedSource(std::vector<std::unique_ptr<RecordSource>> sources) :
+      sources_(std::move(sources)),
+      heads_(sources_.size()),
+      queue_([this](size_t lhs, size_t rhs) {
+        // std::priority_queue pops the greatest element first. Pop the
+        // smallest key first and, for equal keys, the last source first.
+        const auto result = compareKeys(heads_[lhs], heads_[rhs]);
+        return result != 0 ? result > 0 : lhs < rhs;
+      }) {
+    for (size_t i = 0; i < sources_.size(); i++) {
+      advance(i);
+    }
+  }
+
+  bool next(Record& record) override {
+    if (queue_.empty()) {
+      return false;
+    }
+
+    const auto source_index = queue_.top();
+    queue_.pop();
+    std::swap(record, heads_[source_index]);
+    advance(source_index);
+
+    // Drop the same key from earlier sources.
+    while (!queue_.empty() && compareKeys(heads_[queue_.top()], record) == 0) {
+      const auto duplicate_index = queue_.top();
+      queue_.pop();
+      advance(duplicate_index);
+    }
+    return true;
+  }
+
+  bool failed() const override {
+    for (const auto& source : sources_) {
+      if (source->failed()) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// A file parsed from text and held in memory until its run is sorted. The
+// strings live in the run's text buffer.
+struct PendingRecord {
+  KeyType key_type;
+  Sha1Digest digest;
+  uint32_t string_hash_size;
+  uint64_t string_hash_offset;
+  uint64_t filename_offset;
+  uint64_t filename_size;
+};
+
+void writeString(std::ostream& os, std::string_view str) {
+  char size[sizeof(uint64_t)];
+  storeLittleEndian64(str.size(), size);
+  os.write(size, sizeof(size));
+  os.write(str.data(), static_cast<std::streamsize>(str.size()));
+}
+
+// Write one file to a run in the format RunFileSource reads.
+void writeRecord(std::ostream& os, KeyType key_type, const Sha1Digest& digest, std::string_view string_hash, std::string_view filename) {
+  os.put(static_cast<char>(key_type));
+  if (key_type == KeyType::Digest) {
+    os.write(reinterpret_cast<const char*>(digest.bytes.data()), Sha1Digest::Size);
+  } else {
+    writeString(os, string_hash);
+  }
+  writeString(os, filename);
+}
+
+// Sort |records| by key, keep only the last of any duplicates and write them
+// into a run file at |path|.
+bool writeRun(std::vector<PendingRecord>& records, const std::string& text, const std::filesystem::path& path) {
+  const auto get_string_hash = [&text](const PendingRecord& record) {
+    return std::string_view(text).substr(record.string_hash_offset, record.string_hash_size);
+  };
+
+  // Filenames are appended to the text buffer in the order they are read so
+  // the filename offset breaks ties in favor of the file read last.
+  std::sort(records.begin(), records.end(), [&](const PendingRecord& lhs, const PendingRecord& rhs) {
+    const auto result = compareKeys(lhs.key_type, lhs.digest, get_string_hash(lhs), rhs.key_type, rhs.digest, get_string_hash(rhs));
+    return result != 0 ? result < 0 : lhs.filename_offset < rhs.filename_offset;
+  });
+
+  std::vector<char> buffer(RunBufferSize);
+  std::ofstream ofs;
+  ofs.rdbuf()->pubsetbuf(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  ofs.open(path, std::ofstream::out | std::ofstream::binary);
+
+  for (size_t i = 0; i < records.size(); i++) {
+    const auto& record = records[i];
+    if (i + 1 < records.size()) {
+      const auto& next_record = records[i + 1];
+      if (compareKeys(record.key_type, record.digest, get_string_hash(record), next_record.key_type, next_record.digest, get_string_hash(next_record)) == 0) {
+        continue;
+      }
+    }
+
+    writeRecord(ofs, record.key_type, record.digest, get_string_hash(record), std::string_view(text).substr(record.filename_offset, record.filename_size));
+  }
+
+  ofs.close();
+  return static_cast<bool>(ofs);
+}
+
+// Merge consecutive groups of at most |width| of the |runs| into new runs
+// in |directory| until there are no more than |width| left, removing the
+// runs merged. The merged runs stay in order so later files still win.
+bool mergeRuns(std::vector<std::filesystem::path>& runs, const std::filesystem::path& directory, const std::string& prefix, size_t width,
+               size_t buffer_size) {
+  for (size_t pass = 0; runs.size() > width; pass++) {
+    std::vector<std::filesystem::path> merged_runs;
+    for (size_t first = 0; first < runs.size(); first += width) {
+      const auto last = std::min(first + width, runs.size());
+      std::vector<std::unique_ptr<RecordSource>> sources;
+      for (size_t i = first; i < last; i++) {
+        sources.push_back(std::make_unique<RunFileSource>(runs[i], buffer_size));
+      }
+      MergedSource merged_source(std::move(sources));
+
+      merged_runs.push_back(directory / (prefix + "pass" + std::to_string(pass) + "_" + std::to_string(merged_runs.size()) + ".run"));
+      std::vector<char> buffer(buffer_size);
+      std::ofstream ofs;
+      ofs.rdbuf()->pubsetbuf(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+      ofs.open(merged_runs.back(), std::ofstream::out | std::ofstream::binary);
+      Record record;
+      while (merged_source.next(record)) {
+        writeRecord(ofs, record.key_type, record.digest, record.string_hash, record.filename);
+      }
+      ofs.close();
+      if (merged_source.failed() || !ofs) {
+        return false;
+      }
+
+      std::error_code error;
+      for (size_t i = first; i < last; i++) {
+        std::filesystem::remove(runs[i], error);
+      }
+    }
+    runs = std::move(merged_runs);
+  }
+  return true;
+}
+
+// Walk both sorted sources in lockstep like BackupSet::diff, writing the
+// filenames of keys found in only one of them.
+bool mergeJoin(RecordSource& old_source, RecordSource& new_source, std::ostream& new_not_in_old, std::ostream& old_not_in_new) {
+  Record old_record;
+  Record new_record;
+  bool has_old = old_source.next(old_record);
+  bool has_new = new_source.next(new_record);
+  while (has_old && has_new) {
+    const auto result = compareKeys(old_record, new_record);
+    if (result < 0) {
+      old_not_in_new << old_record.filename << '\n';
+      has_old = old_source.next(old_record);
+    } else if (result > 0) {
+      new_not_in_old << new_record.filename << '\n';
+      has_new = new_source.next(new_record);
+    } else {
+      has_old = old_source.next(old_record);
+      has_new = new_source.next(new_record);
+    }
+  }
+  for (; has_old; has_old = old_source.next(old_record)) {
+    old_not_in_new << old_record.filename << '\n';
+  }
+  for (; has_new; has_new = new_source.next(new_record)) {
+    new_not_in_old << new_record.filename << '\n';
+  }
+
+  return !old_source.failed() && !new_source.failed();
+}
+
+// Map |filename| and return it if it holds a binary index.
+std::shared_ptr<MappedFile> openIndex(const std::string& filename, BackupSetIndexHeader& header, bool& is_index) {
+  auto mapped_file = MappedFile::open(filename);
+  is_index = mapped_file && BackupSetIndexHeader::hasMagic(mapped_file->view());
+  if (!is_index || !header.decode(mapped_file->view())) {
+    return nullptr;
+  }
+  return mapped_file;
+}
+
+}  // namespace
+
+BackupSetExternalDiff::BackupSetExternalDiff(size_t max_memory) :
+    max_memory_(max_memory) {}
+
+void BackupSetExternalDiff::enableValidation() {
+  should_validate_ = true;
+}
+
+bool BackupSetExternalDiff::writeRuns(std::istream& is, const std::filesystem::path& directory, const std::string& prefix, std::vector<std::filesystem::path>& runs) {
+  // Split the budget between the text of the run and its records. Reserving
+  // both up front means neither grows past the budget.
+  const size_t text_capacity = std::max<size_t>(max_memory_ / 2, 4096);
+  const size_t record_capacity = std::max<size_t>(max_memory_ / 2 / sizeof(PendingRecord), 16);
+  std::string text;
+  text.reserve(text_capacity);
+  std::vector<PendingRecord> records;
+  records.reserve(record_capacity);
+
+  const auto flush_run = [&]() {
+    if (records.empty()) {
+      return true;
+    }
+    runs.push_back(directory / (prefix + std::to_string(runs.size()) + ".run"));
+    const bool is_written = writeRun(records, text, runs.back());
+    records.clear();
+    text.clear();
+    return is_written;
+  };
+
+  std::string line;
+  while (std::getline(is, line)) {
+    Sha1Digest digest;
+    std::string_view sha1hash;
+    std::string_view filename;
+    const auto line_type = parseBackupSetLine(line, should_validate_, digest, sha1hash, filename);
+    if (line_type == BackupSetLineType::Invalid) {
+      continue;
+    }
+
+    const auto string_hash_size = line_type == BackupSetLineType::StringHash ? sha1hash.size() : 0;
+    if (records.size() == record_capacity || text.size() + string_hash_size + filename.size() > text_capacity) {
+      if (!flush_run()) {
+        return false;
+      }
+    }
+
+    PendingRecord record;
+    record.key_type = line_type == BackupSetLineType::Digest ? KeyType::Digest : KeyType::StringHash;
+    record.digest = digest;
+    record.string_hash_offset = text.size();
+    record.string_hash_size = static_cast<uint32_t>(string_hash_size);
+    text.append(sha1hash.data(), string_hash_size);
+    record.filename_offset = text.size();
+    record.filename_size = filename.size();
+    text.append(filename);
+    records.push_back(record);
+  }
+
+  return flush_run();
+}
+
+bool BackupSetExternalDiff::diff(const std::string& old_filename, const std::string& new_filename, std::ostream& new_not_in_old, std::ostream& old_not_in_new) {
+  TempDirectory temp_directory("backup_set_runs_");
+  if (temp_directory.path().empty()) {
+    return false;
+  }
+
+  // The runs of both inputs are merged at the same time within the budget.
+  const auto width = getMergeWidth(max_memory_);
+  const auto buffer_size = std::clamp<size_t>(max_memory_ / 2 / width, MinRunBufferSize, RunBufferSize);
+
+  const auto open_source = [&](const std::string& filename, const std::string& prefix) -> std::unique_ptr<RecordSource> {
+    BackupSetIndexHeader header;
+    bool is_index;
+    auto mapped_file = openIndex(filename, header, is_index);
+    if (is_index) {
+      return mapped_file ? std::make_unique<IndexSource>(std::move(mapped_file), header, should_validate_) : nullptr;
+    }
+
+    std::ifstream ifs(filename, std::ifstream::in);
+    if (!ifs) {
+      return nullptr;
+    }
+    std::vector<std::filesystem::path> runs;
+    if (!writeRuns(ifs, temp_directory.path(), prefix, runs) || !mergeRuns(runs, temp_directory.path(), prefix, width, buffer_size)) {
+      return nullptr;
+    }
+
+    std::vector<std::unique_ptr<RecordSource>> sources;
+    for (const auto& run : runs) {
+      sources.push_back(std::make_unique<RunFileSource>(run, buffer_size));
+    }
+    return std::make_unique<MergedSource>(std::move(sources));
+  };
+
+  auto old_source = open_source(old_filename, "old_");
+  auto new_source = open_source(new_filename, "new_");
+  if (!old_source || !new_source) {
+    return false;
+  }
+
+  return mergeJoin(*old_source, *new_source, new_not_in_old, old_not_in_new);
+}
+
+bool BackupSetExternalDiff::diffSorted(const std::string& old_filename, const std::string& new_filename, std::ostream& new_not_in_old, std::ostream& old_not_in_new) {
+  const auto open_source = [&](const std::string& filename) -> std::unique_ptr<RecordSource> {
+    BackupSetIndexHeader header;
+    bool is_index;
+    auto mapped_file = openIndex(filename, header, is_index);
+    if (is_index) {
+      return mapped_file ? std::make_unique<IndexSource>(std::move(mapped_file), header, should_validate_) : nullptr;
+    }
+    return std::make_unique<SortedTextSource>(filename, should_validate_);
+  };
+
+  auto old_source = open_source(old_filename);
+  auto new_source = open_source(new_filename);
+  if (!old_source || !new_source) {
+    return false;
+  }
+  return mergeJoin(*old_source, *new_source, new_not_in_old, old_not_in_new);
+}
+
+// static
+size_t BackupSetExternalDiff::getMergeWidth(size_t max_memory) {
+  return std::clamp<size_t>(max_memory / 2 / MinMergeBufferSize, 2, MaxMergeWidth);
+}
+
+// static
+uint64_t BackupSetExternalDiff::estimateMemoryUsage(const std::string& filename) {
+  std::error_code error;
+  const auto size = std::filesystem::file_size(filename, error);
+  if (error) {
+    return 0;
+  }
+
+  // Filenames in a binary index stay in the mapping and are paged in lazily.
+  BackupSetIndexHeader header;
+  bool is_index;
+  openIndex(filename, header, is_index);
+  if (is_index) {
+    return (header.digest_count + header.string_hash_count) * EstimatedBytesPerFile;
+  }
+
+  // Estimate the number of lines in a text file from the start of it. The
+  // text itself is mapped and referenced by the BackupSet.
+  constexpr size_t SampleSize = 1024 * 1024;
+  std::ifstream ifs(filename, std::ifstream::in | std::ifstream::binary);
+  std::string sample(std::min<uint64_t>(size, SampleSize), '\0');
+  ifs.read(sample.data(), static_cast<std::streamsize>(sample.size()));
+  const auto line_count = std::max<uint64_t>(std::count(sample.cbegin(), sample.cend(), '\n'), 1);
+  const auto estimated_lines = size * line_count / std::max<uint64_t>(sample.size(), 1);
+  return size + estimated_lines * EstimatedBytesPerFile;
+}
@@ -0,0 +1,76 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __BackupSetExternalDiff_h__
+#define __BackupSetExternalDiff_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Compare two serialized backup sets which are too large to load into memory
+// as BackupSets.
+// Each text input is read in runs which fit within a memory budget. Each run
+// is sorted by hash and spilled into a temporary directory. The runs of each
+// input are then merged, a limited number at a time and in several passes if
+// needed, and the two merged inputs are compared in a single pass, writing
+// missing files as they are found. Binary indexes are already sorted and are
+// merged straight from their mapping.
+// Inputs which are already sorted by hash, like the ones BackupSetWriter
+// writes, can instead be compared straight from the files with diffSorted.
+// The missing files and their order are the same as BackupSet::diff.
+class BackupSetExternalDiff {
+ private:
+  size_t max_memory_;
+  bool should_validate_ = false;
+
+  // Read the text backup set in |is| in runs, sort each run and write it into
+  // |directory|. Paths of the runs are appended to |runs| in the order they
+  // were read.
+  bool writeRuns(std::istream& is, const std::filesystem::path& directory, const std::string& prefix, std::vector<std::filesystem::path>& runs);
+
+ public:
+  BackupSetExternalDiff() = delete;
+  // Use at most about |max_memory| bytes for each sorted run.
+  explicit BackupSetExternalDiff(size_t max_memory);
+  ~BackupSetExternalDiff() = default;
+
+  // Enable validation of the input files while reading.
+  void enableValidation();
+
+  // Compare the backup sets in the files named |old_filename| and
+  // |new_filename|. Each may hold lines of text or a binary index.
+  // Files found in new but not in old are written to |new_not_in_old| and
+  // files found in old but not in new are written to |old_not_in_new|, one
+  // filename per line.
+  // Returns false if an input could not be read or is an invalid index, or if
+  // the temporary files could not be written.
+  bool diff(const std::string& old_filename, const std::string& new_filename, std::ostream& new_not_in_old, std::ostream& old_not_in_new);
+
+  // Compare the backup sets in the files named |old_filename| and
+  // |new_filename| like diff, but without sorting them first. Each text input
+  // must already be sorted by hash the way BackupSetWriter writes it, with
+  // digests before string hashes. Lines are read one at a time so memory use
+  // does not depend on the size of the inputs and the first missing files are
+  // written right away.
+  // Returns false if an input could not be read, is an invalid index or is
+  // found not to be sorted. The files written so far are then incomplete and
+  // the backup sets should be compared with diff or in memory instead.
+  bool diffSorted(const std::string& old_filename, const std::string& new_filename, std::ostream& new_not_in_old, std::ostream& old_not_in_new);
+
+  // Returns the most runs of one input which diff merges at once with a
+  // budget of |max_memory| bytes. Inputs with more runs are merged in several
+  // passes.
+  static size_t getMergeWidth(size_t max_memory);
+
+  // Estimate the number of bytes a BackupSet loaded from the file named
+  // |filename| would use.
+  static uint64_t estimateMemoryUsage(const std::string& filename);
+};
+
+#endif  // __BackupSetExternalDiff_h__
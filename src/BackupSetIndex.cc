@@ -0,0 +1,160 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "BackupSetIndex.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "Sha1Digest.h"
+
+namespace {
+
+constexpr uint64_t OffsetSize = sizeof(uint64_t);
+
+// Lookup entries are taken from the leading 32 bits of a digest.
+constexpr uint32_t MaxLookupBits = 32;
+
+uint64_t alignUp(uint64_t value) {
+  return (value + OffsetSize - 1) & ~(OffsetSize - 1);
+}
+
+uint32_t loadLittleEndian32(const char* in) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < sizeof(value); i++) {
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (i * 8);
+  }
+  return value;
+}
+
+void storeLittleEndian32(uint32_t value, char* out) {
+  for (size_t i = 0; i < sizeof(value); i++) {
+    out[i] = static_cast<char>(value >> (i * 8));
+  }
+}
+
+// Returns true if the section [offset, offset + count * element_size) fits
+// within |file_size| without overflowing.
+bool sectionFits(uint64_t offset, uint64_t count, uint64_t element_size, uint64_t file_size) {
+  if (offset > file_size || count > (file_size - offset) / element_size) {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+uint64_t loadLittleEndian64(const char* in) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < sizeof(value); i++) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (i * 8);
+  }
+  return value;
+}
+
+void storeLittleEndian64(uint64_t value, char* out) {
+  for (size_t i = 0; i < sizeof(value); i++) {
+    out[i] = static_cast<char>(value >> (i * 8));
+  }
+}
+
+// static
+bool BackupSetIndexHeader::hasMagic(std::string_view buffer) {
+  return buffer.size() >= sizeof(Magic) && std::memcmp(buffer.data(), Magic, sizeof(Magic)) == 0;
+}
+
+void BackupSetIndexHeader::layout(uint64_t string_hashes_size, uint64_t filenames_size) {
+  digests_offset = EncodedSize;
+  filename_offsets_offset = alignUp(digests_offset + digest_count * Sha1Digest::Size);
+  string_hash_offsets_offset = filename_offsets_offset + (digest_count + string_hash_count + 1) * OffsetSize;
+  string_hashes_offset = string_hash_offsets_offset + (string_hash_count + 1) * OffsetSize;
+  filenames_offset = string_hashes_offset + string_hashes_size;
+  this->filenames_size = filenames_size;
+  lookup_offset = alignUp(filenames_offset + filenames_size);
+  lookup_bits = getLookupBits(digest_count);
+}
+
+// static
+uint32_t BackupSetIndexHeader::getLookupBits(uint64_t digest_count) {
+  // Aim for two to four digests per entry, which fit in one or two cache
+  // lines, with a table a fraction of the size of the digests.
+  uint32_t bits = 0;
+  while (bits < MaxLookupBits && (digest_count >> (bits + 2)) != 0) {
+    bits++;
+  }
+  return bits;
+}
+
+// static
+size_t BackupSetIndexHeader::getLookupEntry(const Sha1Digest& digest, uint32_t lookup_bits) {
+  if (lookup_bits == 0) {
+    return 0;
+  }
+  uint32_t prefix = 0;
+  for (size_t i = 0; i < sizeof(prefix); i++) {
+    prefix = (prefix << 8) | digest.bytes[i];
+  }
+  return prefix >> (32 - lookup_bits);
+}
+
+void BackupSetIndexHeader::encode(char* out) const {
+  std::memcpy(out, Magic, sizeof(Magic));
+  storeLittleEndian32(version, out + 8);
+  storeLittleEndian32(static_cast<uint32_t>(EncodedSize), out + 12);
+  storeLittleEndian64(digest_count, out + 16);
+  storeLittleEndian64(string_hash_count, out + 24);
+  storeLittleEndian64(digests_offset, out + 32);
+  storeLittleEndian64(filename_offsets_offset, out + 40);
+  storeLittleEndian64(string_hash_offsets_offset, out + 48);
+  storeLittleEndian64(string_hashes_offset, out + 56);
+  storeLittleEndian64(filenames_offset, out + 64);
+  storeLittleEndian64(filenames_size, out + 72);
+  storeLittleEndian64(lookup_offset, out + 80);
+  storeLittleEndian32(lookup_bits, out + 88);
+  storeLittleEndian32(0, out + 92);
+}
+
+bool BackupSetIndexHeader::decode(std::string_view buffer) {
+  if (buffer.size() < Version1EncodedSize || !hasMagic(buffer)) {
+    return false;
+  }
+
+  const char* in = buffer.data();
+  version = loadLittleEndian32(in + 8);
+  const auto encoded_size = version == 1 ? Version1EncodedSize : EncodedSize;
+  if (version < 1 || version > CurrentVersion || loadLittleEndian32(in + 12) != encoded_size || buffer.size() < encoded_size) {
+    return false;
+  }
+  digest_count = loadLittleEndian64(in + 16);
+  string_hash_count = loadLittleEndian64(in + 24);
+  digests_offset = loadLittleEndian64(in + 32);
+  filename_offsets_offset = loadLittleEndian64(in + 40);
+  string_hash_offsets_offset = loadLittleEndian64(in + 48);
+  string_hashes_offset = loadLittleEndian64(in + 56);
+  filenames_offset = loadLittleEndian64(in + 64);
+  filenames_size = loadLittleEndian64(in + 72);
+  lookup_offset = 0;
+  lookup_bits = 0;
+  if (version >= 2) {
+    lookup_offset = loadLittleEndian64(in + 80);
+    lookup_bits = loadLittleEndian32(in + 88);
+    if (lookup_offset == 0 || lookup_bits > MaxLookupBits) {
+      return false;
+    }
+  }
+
+  // Make sure every fixed-size section lies within the buffer. The blobs are
+  // bounded by the offsets which point into them.
+  const uint64_t size = buffer.size();
+  return digest_count < UINT64_MAX / 2 && string_hash_count < UINT64_MAX / 2 &&
+      sectionFits(digests_offset, digest_count, Sha1Digest::Size, size) &&
+      sectionFits(filename_offsets_offset, digest_count + string_hash_count + 1, OffsetSize, size) &&
+      sectionFits(string_hash_offsets_offset, string_hash_count + 1, OffsetSize, size) &&
+      sectionFits(string_hashes_offset, 0, 1, size) &&
+      sectionFits(filenames_offset, filenames_size, 1, size) &&
+      (!hasLookupTable() || sectionFits(lookup_offset, (static_cast<uint64_t>(1) << lookup_bits) + 1, OffsetSize, size));
+}
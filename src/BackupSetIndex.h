@@ -0,0 +1,85 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __BackupSetIndex_h__
+#define __BackupSetIndex_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "Sha1Digest.h"
+
+// A BackupSet may also be serialized into a binary index which can be
+// loaded without parsing. Index files conventionally use the .bsidx
+// extension. All integers are little-endian and the file is laid out as:
+//
+//   header               BackupSetIndexHeader::EncodedSize bytes
+//   digests              digest_count sorted 20-byte digests
+//   filename offsets     digest_count + string_hash_count + 1 uint64 offsets
+//                        into the filename blob. Filename i spans
+//                        [offset[i], offset[i + 1]). Filenames of files keyed
+//                        by digest come first, in digest order.
+//   string hash offsets  string_hash_count + 1 uint64 offsets into the string
+//                        hash blob, laid out like the filename offsets.
+//   string hashes        blob of sorted hashes which are not valid digests
+//   filenames            blob of filenames
+//   lookup table         2^lookup_bits + 1 uint64 indexes into the digests.
+//                        Digests whose leading lookup_bits bits are b span
+//                        [lookup[b], lookup[b + 1]). Only in version 2.
+//
+// Both offset tables and the lookup table start on an 8-byte boundary.
+// Version 1 indexes have no lookup table and a smaller header. They are
+// still read and leave lookup_offset at zero.
+struct BackupSetIndexHeader {
+  static constexpr char Magic[8] = {'B', 'S', 'I', 'D', 'X', '\r', '\n', '\x1a'};
+  static constexpr uint32_t CurrentVersion = 2;
+  static constexpr size_t EncodedSize = 96;
+  static constexpr size_t Version1EncodedSize = 80;
+
+  uint32_t version = CurrentVersion;
+  uint64_t digest_count = 0;
+  uint64_t string_hash_count = 0;
+  uint64_t digests_offset = 0;
+  uint64_t filename_offsets_offset = 0;
+  uint64_t string_hash_offsets_offset = 0;
+  uint64_t string_hashes_offset = 0;
+  uint64_t filenames_offset = 0;
+  uint64_t filenames_size = 0;
+  uint64_t lookup_offset = 0;
+  uint32_t lookup_bits = 0;
+
+  // Returns true if |buffer| begins with the index magic.
+  static bool hasMagic(std::string_view buffer);
+
+  // Fill in the section offsets from the counts and the sizes of the blobs.
+  void layout(uint64_t string_hashes_size, uint64_t filenames_size);
+
+  // Returns true if the index has a lookup table.
+  bool hasLookupTable() const {
+    return lookup_offset != 0;
+  }
+
+  // Returns the number of leading bits of a digest used to pick its entry
+  // in the lookup table of an index holding |digest_count| digests. There
+  // are a few digests for each entry.
+  static uint32_t getLookupBits(uint64_t digest_count);
+
+  // Returns the entry in a lookup table of |lookup_bits| bits for |digest|.
+  static size_t getLookupEntry(const Sha1Digest& digest, uint32_t lookup_bits);
+
+  // Write EncodedSize bytes into |out|.
+  void encode(char* out) const;
+
+  // Decode the header at the start of |buffer|. Returns false if |buffer| is
+  // not an index of a supported version or the sections do not fit in it.
+  bool decode(std::string_view buffer);
+};
+
+// Read and write little-endian integers in index files.
+uint64_t loadLittleEndian64(const char* in);
+void storeLittleEndian64(uint64_t value, char* out);
+
+#endif  // __BackupSetIndex_h__
@@ -0,0 +1,61 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "BackupSetLine.h"
+
+#include <cstddef>
+#include <string_view>
+
+#include "Sha1Digest.h"
+
+namespace {
+
+// Matches the characters skipped by std::ws in the classic locale.
+bool isSpace(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Split |line| into the sha1hash and filename.
+// Leading whitespace is skipped, the sha1hash extends to the next whitespace
+// character and the filename is everything after the whitespace which follows
+// the sha1hash. Returns false if either part is empty.
+bool splitLine(std::string_view line, std::string_view& sha1hash, std::string_view& filename) {
+  size_t pos = 0;
+  while (pos < line.size() && isSpace(line[pos])) {
+    pos++;
+  }
+  const size_t hash_start = pos;
+  while (pos < line.size() && !isSpace(line[pos])) {
+    pos++;
+  }
+  if (pos == hash_start) {
+    return false;
+  }
+  sha1hash = line.substr(hash_start, pos - hash_start);
+
+  while (pos < line.size() && isSpace(line[pos])) {
+    pos++;
+  }
+  if (pos == line.size()) {
+    return false;
+  }
+  filename = line.substr(pos);
+  return true;
+}
+
+}  // namespace
+
+BackupSetLineType parseBackupSetLine(std::string_view line, bool should_validate, Sha1Digest& digest, std::string_view& sha1hash, std::string_view& filename) {
+  if (!splitLine(line, sha1hash, filename)) {
+    return BackupSetLineType::Invalid;
+  }
+
+  if (Sha1Digest::fromHex(sha1hash, digest)) {
+    return BackupSetLineType::Digest;
+  }
+
+  // Validate the sha1hash is valid if we enabled doing that.
+  return should_validate ? BackupSetLineType::Invalid : BackupSetLineType::StringHash;
+}
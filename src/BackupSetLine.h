@@ -0,0 +1,29 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __BackupSetLine_h__
+#define __BackupSetLine_h__
+
+#include <string_view>
+
+#include "Sha1Digest.h"
+
+// What parseBackupSetLine found in a line.
+enum class BackupSetLineType {
+  Invalid,
+  Digest,
+  StringHash,
+};
+
+// Parse one |line| of a serialized BackupSet into its sha1hash and filename.
+// Leading whitespace is skipped, the sha1hash extends to the next whitespace
+// character and the filename is everything after the whitespace which follows
+// the sha1hash. Lines missing either part are invalid.
+// When the sha1hash is a valid hex-string it is also decoded into |digest|.
+// Decoding doubles as validation so it costs nothing extra. Other hashes are
+// invalid if |should_validate| is true.
+BackupSetLineType parseBackupSetLine(std::string_view line, bool should_validate, Sha1Digest& digest, std::string_view& sha1hash, std::string_view& filename);
+
+#endif  // __BackupSetLine_h__
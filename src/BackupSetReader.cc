@@ -5,62 +5,375 @@
 
 #include "BackupSetReader.h"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
-#include <regex>
-#include <sstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 #include "BackupSet.h"
+#include "BackupSetIndex.h"
+#include "BackupSetLine.h"
+#include "BlockPipeline.h"
+#include "MappedFile.h"
+#include "Sha1Digest.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include "UringBlockSource.h"
 
 namespace {
 
-// Returns true if |sha1hash| is a valid 40-character hex-string.
-bool isValidSha1Hash(const std::string& sha1hash) {
-  // Simple regex expects 40 valid hex-characters, case insensitive.
-  const std::regex sha1hash_regex("^[a-f0-9]{40}$", std::regex::icase);
-  std::smatch sha1hash_match;
+// Don't bother splitting buffers into chunks smaller than this.
+constexpr size_t MinimumChunkSize = 64 * 1024;
 
-  // See if the sha1hash matches the expected regex.
-  if (std::regex_match(sha1hash, sha1hash_match, sha1hash_regex)) {
-    return true;
-  }
+// The lines parsed from one chunk of a buffer.
+struct ParsedChunk {
+  // Files keyed by digest, sorted by digest with only the last of any
+  // duplicates kept.
+  std::vector<BackupSetEntry> files;
+  // Files keyed by string hashes in the order they were found.
+  std::vector<std::pair<std::string_view, std::string_view>> string_hash_files;
+  // Lines in the chunk and how many of them were rejected.
+  uint64_t line_count = 0;
+  uint64_t rejected_line_count = 0;
+};
 
-  // Didn't match the regex. Either the string wasn't 40-characters or
-  // some of the characters were not valid in hex.
-  return false;
+// Split |buffer| into at most |chunk_count| chunks of roughly equal size.
+// Chunks end just after a newline so no line spans two chunks.
+std::vector<std::string_view> splitIntoChunks(std::string_view buffer, size_t chunk_count) {
+  std::vector<std::string_view> chunks;
+  const size_t target_size = buffer.size() / chunk_count + 1;
+  size_t start = 0;
+  while (start < buffer.size()) {
+    size_t end = start + target_size;
+    if (end >= buffer.size()) {
+      end = buffer.size();
+    } else {
+      end = buffer.find('\n', end);
+      end = end == std::string_view::npos ? buffer.size() : end + 1;
+    }
+    chunks.push_back(buffer.substr(start, end - start));
+    start = end;
+  }
+  return chunks;
 }
 
 }  // namespace
 
-BackupSetReader::BackupSetReader(BackupSet& backup_set) :
+template <typename Storage>
+BasicBackupSetReader<Storage>::BasicBackupSetReader(BasicBackupSet<Storage>& backup_set) :
     backup_set_(backup_set) {}
 
-void BackupSetReader::read(std::istream& is) {
+template <typename Storage>
+bool BasicBackupSetReader<Storage>::readLine(std::string_view line, bool copy_filename) {
+  Sha1Digest digest;
+  std::string_view sha1hash;
+  std::string_view filename;
+  switch (parseBackupSetLine(line, should_validate_, digest, sha1hash, filename)) {
+  case BackupSetLineType::Invalid:
+    return false;
+  case BackupSetLineType::Digest:
+    if (copy_filename) {
+      backup_set_.addFile(digest, filename);
+    } else {
+      backup_set_.addFileReference(digest, filename);
+    }
+    break;
+  case BackupSetLineType::StringHash:
+    if (copy_filename) {
+      backup_set_.addFileWithStringHash(sha1hash, filename);
+    } else {
+      backup_set_.addFileReferenceWithStringHash(sha1hash, filename);
+    }
+    break;
+  }
+  return true;
+}
+
+template <typename Storage>
+void BasicBackupSetReader<Storage>::readBuffer(std::string_view buffer, bool copy_filename) {
+  const size_t chunk_count = std::min(thread_count_, buffer.size() / MinimumChunkSize);
+  if (chunk_count > 1) {
+    readBufferParallel(buffer, copy_filename, chunk_count);
+    return;
+  }
+
+  const char* pos = buffer.data();
+  const char* const end = pos + buffer.size();
+  uint64_t line_count = 0;
+  uint64_t rejected_line_count = 0;
+
+  // Process one line at a time. The last line need not be terminated.
+  while (pos < end) {
+    const auto* newline = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+    const char* line_end = newline ? newline : end;
+    if (!readLine(std::string_view(pos, line_end - pos), copy_filename)) {
+      rejected_line_count++;
+    }
+    line_count++;
+    pos = line_end + 1;
+  }
+  stats_.bytes += buffer.size();
+  stats_.line_count += line_count;
+  stats_.rejected_line_count += rejected_line_count;
+}
+
+template <typename Storage>
+void BasicBackupSetReader<Storage>::readBufferParallel(std::string_view buffer, bool copy_filename, size_t chunk_count) {
+  const auto chunks = splitIntoChunks(buffer, chunk_count);
+  std::vector<ParsedChunk> parsed_chunks(chunks.size());
+
+  ThreadPool pool(chunks.size());
+  pool.parallelFor(chunks.size(), [&](size_t i) {
+    TRACE_SCOPE("parse chunk");
+    auto& parsed = parsed_chunks[i];
+    const auto chunk = chunks[i];
+    size_t start = 0;
+    while (start < chunk.size()) {
+      size_t end = chunk.find('\n', start);
+      if (end == std::string_view::npos) {
+        end = chunk.size();
+      }
+
+      Sha1Digest digest;
+      std::string_view sha1hash;
+      std::string_view filename;
+      parsed.line_count++;
+      switch (parseBackupSetLine(chunk.substr(start, end - start), should_validate_, digest, sha1hash, filename)) {
+      case BackupSetLineType::Invalid:
+        parsed.rejected_line_count++;
+        break;
+      case BackupSetLineType::Digest:
+        parsed.files.push_back({digest, filename});
+        break;
+      case BackupSetLineType::StringHash:
+        parsed.string_hash_files.emplace_back(sha1hash, filename);
+        break;
+      }
+      start = end + 1;
+    }
+
+    // Sort so the chunks can be merged in order. A stable sort keeps
+    // duplicates in the order they were read so the last one can be kept.
+    auto& files = parsed.files;
+    std::stable_sort(files.begin(), files.end(), [](const BackupSetEntry& lhs, const BackupSetEntry& rhs) {
+      return lhs.digest < rhs.digest;
+    });
+    auto out = files.begin();
+    for (auto iter = files.begin(); iter != files.end(); ++iter) {
+      const auto next = std::next(iter);
+      if (next == files.end() || next->digest != iter->digest) {
+        *out++ = *iter;
+      }
+    }
+    files.erase(out, files.end());
+  });
+
+  std::vector<std::vector<BackupSetEntry>> parts;
+  parts.reserve(parsed_chunks.size());
+  for (auto& parsed : parsed_chunks) {
+    parts.push_back(std::move(parsed.files));
+    stats_.line_count += parsed.line_count;
+    stats_.rejected_line_count += parsed.rejected_line_count;
+  }
+  stats_.bytes += buffer.size();
+  {
+    TRACE_SCOPE("merge chunks");
+    backup_set_.addSortedFiles(parts, copy_filename, &pool);
+  }
+
+  // Files keyed by string hashes are rare. Add them in the order they were
+  // read.
+  for (const auto& parsed : parsed_chunks) {
+    for (const auto& hash_filename_pair : parsed.string_hash_files) {
+      if (copy_filename) {
+        backup_set_.addFileWithStringHash(hash_filename_pair.first, hash_filename_pair.second);
+      } else {
+        backup_set_.addFileReferenceWithStringHash(hash_filename_pair.first, hash_filename_pair.second);
+      }
+    }
+  }
+}
+
+template <typename Storage>
+bool BasicBackupSetReader<Storage>::readIndex(std::string_view buffer, bool copy_filename) {
+  TRACE_SCOPE("BackupSetReader::readIndex");
+  BackupSetIndexHeader header;
+  if (!header.decode(buffer)) {
+    return false;
+  }
+
+  const char* const digests = buffer.data() + header.digests_offset;
+  const char* const filename_offsets = buffer.data() + header.filename_offsets_offset;
+  const char* const string_hash_offsets = buffer.data() + header.string_hash_offsets_offset;
+  const auto string_hashes = buffer.substr(header.string_hashes_offset, header.filenames_offset - std::min(header.filenames_offset, header.string_hashes_offset));
+  const auto filenames = buffer.substr(header.filenames_offset, header.filenames_size);
+
+  // The offsets must be ascending and stay within their blobs and the digests
+  // must be sorted and unique. Check everything before adding any files.
+  const auto get_filename = [&](uint64_t i, std::string_view& filename) {
+    const auto begin = loadLittleEndian64(filename_offsets + i * sizeof(uint64_t));
+    const auto end = loadLittleEndian64(filename_offsets + (i + 1) * sizeof(uint64_t));
+    if (begin > end || end > filenames.size()) {
+      return false;
+    }
+    filename = filenames.substr(begin, end - begin);
+    return true;
+  };
+
+  std::vector<BackupSetEntry> files(header.digest_count);
+  for (uint64_t i = 0; i < header.digest_count; i++) {
+    auto& entry = files[i];
+    std::memcpy(entry.digest.bytes.data(), digests + i * Sha1Digest::Size, Sha1Digest::Size);
+    if (!get_filename(i, entry.filename) || (i > 0 && !(files[i - 1].digest < entry.digest))) {
+      return false;
+    }
+  }
+
+  std::vector<std::pair<std::string_view, std::string_view>> string_hash_files(header.string_hash_count);
+  for (uint64_t i = 0; i < header.string_hash_count; i++) {
+    const auto begin = loadLittleEndian64(string_hash_offsets + i * sizeof(uint64_t));
+    const auto end = loadLittleEndian64(string_hash_offsets + (i + 1) * sizeof(uint64_t));
+    if (begin > end || end > string_hashes.size() || !get_filename(header.digest_count + i, string_hash_files[i].second)) {
+      return false;
+    }
+    string_hash_files[i].first = string_hashes.substr(begin, end - begin);
+  }
+  // String hashes are not hex-strings, so validation rejects them like the
+  // lines of text they were read from.
+  if (should_validate_) {
+    stats_.rejected_line_count += string_hash_files.size();
+    string_hash_files.clear();
+  }
+
+  std::vector<std::vector<BackupSetEntry>> parts;
+  parts.push_back(std::move(files));
+  if (thread_count_ > 1) {
+    ThreadPool pool(thread_count_);
+    backup_set_.addSortedFiles(parts, copy_filename, &pool);
+  } else {
+    backup_set_.addSortedFiles(parts, copy_filename);
+  }
+
+  for (const auto& hash_filename_pair : string_hash_files) {
+    if (copy_filename) {
+      backup_set_.addFileWithStringHash(hash_filename_pair.first, hash_filename_pair.second);
+    } else {
+      backup_set_.addFileReferenceWithStringHash(hash_filename_pair.first, hash_filename_pair.second);
+    }
+  }
+  stats_.bytes += buffer.size();
+  stats_.line_count += header.digest_count + header.string_hash_count;
+  return true;
+}
+
+template <typename Storage>
+void BasicBackupSetReader<Storage>::read(std::istream& is) {
+  TRACE_SCOPE("BackupSetReader::read");
   std::string line;
-  std::string sha1hash;
-  std::string filename;
 
   // Process one line at a time.
   while (std::getline(is, line)) {
-    std::istringstream line_stream(line);
+    if (!readLine(line, true)) {
+      stats_.rejected_line_count++;
+    }
+    stats_.line_count++;
+    stats_.bytes += line.size() + 1;
+  }
+}
 
-    // Read the sha1 hash and ' ' delimiter.
-    if (line_stream >> sha1hash >> std::ws) {
-      // Validate the sha1hash is valid if we enabled doing that.
-      if (should_validate_ && !isValidSha1Hash(sha1hash)) {
-        continue;
-      }
+template <typename Storage>
+bool BasicBackupSetReader<Storage>::read(std::string_view buffer) {
+  TRACE_SCOPE("BackupSetReader::read");
+  if (BackupSetIndexHeader::hasMagic(buffer)) {
+    return readIndex(buffer, true);
+  }
+  readBuffer(buffer, true);
+  return true;
+}
 
-      // Fetch the rest of the line as the filename.
-      if (std::getline(line_stream, filename)) {
-        // If that all parsed correctly, add the file to the set.
-        backup_set_.addFile(sha1hash, filename);
-      }
+template <typename Storage>
+bool BasicBackupSetReader<Storage>::readFile(const std::string& filename) {
+  TRACE_SCOPE("BackupSetReader::readFile");
+  auto mapped_file = MappedFile::open(filename);
+  if (!mapped_file) {
+    return false;
+  }
+
+  if (BackupSetIndexHeader::hasMagic(mapped_file->view())) {
+    if (!readIndex(mapped_file->view(), false)) {
+      return false;
     }
+  } else {
+    readBuffer(mapped_file->view(), false);
   }
+  if (lazy_filenames_) {
+    backup_set_.retainLazyFile(std::move(mapped_file));
+  } else {
+    backup_set_.retainBuffer(std::move(mapped_file));
+  }
+  return true;
 }
 
-void BackupSetReader::enableValidation() {
+template <typename Storage>
+bool BasicBackupSetReader<Storage>::readFilePipelined(const std::string& filename) {
+  TRACE_SCOPE("BackupSetReader::readFilePipelined");
+  std::unique_ptr<BlockSource> source;
+  if (use_uring_) {
+    source = UringBlockSource::open(filename);
+  }
+  if (!source) {
+    source = FileBlockSource::open(filename);
+  }
+  if (!source) {
+    return false;
+  }
+
+  // Parallel parsing splits each block, so give every thread a block's worth.
+  BlockPipeline pipeline(*source, BlockPipeline::DefaultBlockSize * thread_count_);
+  bool is_first = true;
+  bool is_index = false;
+  const auto is_read = pipeline.run([&](std::string_view block) {
+    if (is_first && BackupSetIndexHeader::hasMagic(block)) {
+      is_index = true;
+      return false;
+    }
+    is_first = false;
+    readBuffer(block, true);
+    return true;
+  });
+  return is_read && !is_index;
+}
+
+template <typename Storage>
+void BasicBackupSetReader<Storage>::enableValidation() {
   should_validate_ = true;
 }
+
+template <typename Storage>
+void BasicBackupSetReader<Storage>::enableUring() {
+  use_uring_ = true;
+}
+
+template <typename Storage>
+void BasicBackupSetReader<Storage>::enableLazyFilenames() {
+  lazy_filenames_ = true;
+}
+
+template <typename Storage>
+void BasicBackupSetReader<Storage>::setThreadCount(size_t thread_count) {
+  thread_count_ = std::max<size_t>(thread_count, 1);
+}
+
+template class BasicBackupSetReader<OrderedMapStorage>;
+template class BasicBackupSetReader<HashMapStorage>;
+template class BasicBackupSetReader<SortedVectorStorage>;
+template class BasicBackupSetReader<SwissTableStorage>;
@@ -6,31 +6,124 @@
 #ifndef __BackupSetReader_h__
 #define __BackupSetReader_h__
 
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <string>
+#include <string_view>
 
-class BackupSet;
+struct OrderedMapStorage;
+
+template <typename Storage>
+class BasicBackupSet;
+
+// What a BackupSetReader has read so far.
+struct BackupSetReaderStats {
+  // Bytes of text or binary index read.
+  uint64_t bytes = 0;
+  // Lines of text, or entries of a binary index, read.
+  uint64_t line_count = 0;
+  // Lines which were not added because they were malformed or, with
+  // validation enabled, did not hold a valid hash.
+  uint64_t rejected_line_count = 0;
+};
 
 // A BackupSet may be serialized into a series of lines where each line
 // begins with a 40-character sha1hash followed by a single space character
 // followed by the filename and line terminator.
 // This utility class can read a BackupSet from a buffer containing a serialized
-// BackupSet as defined above.
-class BackupSetReader {
+// BackupSet as defined above or the binary index defined in BackupSetIndex.h.
+template <typename Storage>
+class BasicBackupSetReader {
  private:
-  BackupSet& backup_set_;
+  BasicBackupSet<Storage>& backup_set_;
   bool should_validate_ = false;
+  bool lazy_filenames_ = false;
+  bool use_uring_ = false;
+  size_t thread_count_ = 1;
+  BackupSetReaderStats stats_;
+
+  // Parse |line| and add the file it describes to the BackupSet. Returns
+  // false if the line was rejected.
+  // When |copy_filename| is false, the filename is added by reference and the
+  // caller is responsible for keeping |line| alive.
+  bool readLine(std::string_view line, bool copy_filename);
+
+  // Read every line in |buffer|.
+  void readBuffer(std::string_view buffer, bool copy_filename);
+
+  // Read the binary index in |buffer|. Returns false without reading anything
+  // if |buffer| does not hold a valid index.
+  bool readIndex(std::string_view buffer, bool copy_filename);
+
+  // Read every line in |buffer| by splitting it into chunks which are parsed
+  // on |chunk_count| threads.
+  void readBufferParallel(std::string_view buffer, bool copy_filename, size_t chunk_count);
 
  public:
-  BackupSetReader() = delete;
-  explicit BackupSetReader(BackupSet& backup_set);
-  ~BackupSetReader() = default;
+  BasicBackupSetReader() = delete;
+  explicit BasicBackupSetReader(BasicBackupSet<Storage>& backup_set);
+  ~BasicBackupSetReader() = default;
 
   // Read lines from the input stream and store file information into the
   // BackupSet.
   void read(std::istream& is);
 
-  // Enable validation of the input stream while reading.
+  // Read lines from |buffer| and store file information into the BackupSet.
+  // If |buffer| holds a binary index instead, the index is read.
+  // Filenames are copied out of |buffer|.
+  // Returns false if |buffer| holds an invalid binary index, in which case
+  // nothing is read.
+  bool read(std::string_view buffer);
+
+  // Map the file named |filename| into memory and read it in place. The file
+  // may hold either lines of text or a binary index.
+  // Filenames are not copied. The BackupSet refers to them in the mapping and
+  // keeps the mapping alive. A binary index is attached without any parsing
+  // and its filenames are only paged in when they are used.
+  // Returns false if the file could not be mapped or holds an invalid binary
+  // index. Nothing is read in that case. If the file could not be mapped, the
+  // caller may fall back to reading the file as a stream.
+  bool readFile(const std::string& filename);
+
+  // Read the text file named |filename| through a BlockPipeline: a thread of
+  // its own reads the file ahead in large blocks while this thread parses
+  // the blocks already read, so the disk and the parser are busy at once.
+  // This suits files where page faults on a mapping are slow, such as ones
+  // on network volumes. Filenames are copied and nothing stays mapped.
+  // Returns false if the file could not be opened or read to the end. Also
+  // returns false without reading anything if the file holds a binary index,
+  // which must be read with readFile.
+  bool readFilePipelined(const std::string& filename);
+
+  // Enable validation of the input stream while reading. The string hashes of
+  // a binary index are rejected as well.
   void enableValidation();
+
+  // Read files for readFilePipelined through io_uring, with several large
+  // reads in flight and the page cache bypassed where possible. Falls back
+  // to plain reads where io_uring is unavailable.
+  void enableUring();
+
+  // Load filenames lazily from files read with readFile. Once a file has been
+  // scanned, its pages are dropped from memory and the BackupSet holds only
+  // the position and length of each filename in the file. Filenames are read
+  // back from the file as they are needed, so a diff keeps little more than
+  // the hashes resident.
+  void enableLazyFilenames();
+
+  // Parse buffers and mapped files on |thread_count| threads. Streams are
+  // always read on the calling thread. The resulting BackupSet is identical to
+  // reading on a single thread.
+  void setThreadCount(size_t thread_count);
+
+  // Returns what has been read so far. The counts are kept per buffer and
+  // per chunk, so keeping them costs nothing per line.
+  const BackupSetReaderStats& getStats() const {
+    return stats_;
+  }
 };
 
+using BackupSetReader = BasicBackupSetReader<OrderedMapStorage>;
+
 #endif  // __BackupSetReader_h__
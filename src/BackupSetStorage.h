@@ -0,0 +1,481 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __BackupSetStorage_h__
+#define __BackupSetStorage_h__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Arena.h"
+#include "Sha1Digest.h"
+
+// Storage policies for BasicBackupSet. A policy picks the container which
+// holds the files of each shard. Every policy provides
+//
+//   template <typename Key, typename Value> class Map;
+//
+// with these members:
+//
+//   explicit Map(Arena* arena)    Nodes, if the container has any, are
+//                                 allocated from |arena|.
+//   Value* find(const Key& key)   Returns the value for |key| or nullptr.
+//   void assign(const Key& key, const Value& value)
+//                                 Insert or overwrite the value for |key|.
+//   void assignSorted(const Key& key, const Value& value)
+//                                 Same as assign. Cheaper for a run of calls
+//                                 with ascending keys.
+//   size_t size() const           Returns the number of keys.
+//   size_t bytes() const          Returns the bytes held outside |arena|.
+//   void forEach(visit)           Calls visit(key, value&) for every key in
+//                                 any order.
+//   sorted() const                Returns a range of pairs in key order, each
+//                                 with |first| and |second|.
+//   void swap(Map& rhs)
+//
+// Keys are Sha1Digest or std::string_view and are ordered by std::less<>.
+
+// Hashes the keys of a backup set.
+struct BackupSetKeyHash {
+  size_t operator()(const Sha1Digest& digest) const {
+    // Digests are uniformly distributed already. The leading byte picks the
+    // shard so it is the same for every key in a map. Fold in the trailing
+    // bytes too in case the digests are not real hashes.
+    uint64_t head;
+    uint64_t tail;
+    std::memcpy(&head, digest.bytes.data() + 1, sizeof(head));
+    std::memcpy(&tail, digest.bytes.data() + Sha1Digest::Size - sizeof(tail), sizeof(tail));
+    return static_cast<size_t>(head ^ (tail * 0x9e3779b97f4a7c15ull));
+  }
+
+  size_t operator()(std::string_view str) const {
+    return std::hash<std::string_view>()(str);
+  }
+};
+
+// A pair of iterators which can be used in a range-based for loop.
+template <typename Iterator>
+class IteratorRange {
+ private:
+  Iterator begin_;
+  Iterator end_;
+
+ public:
+  IteratorRange(Iterator begin, Iterator end) :
+      begin_(begin), end_(end) {}
+
+  Iterator begin() const {
+    return begin_;
+  }
+
+  Iterator end() const {
+    return end_;
+  }
+};
+
+// Pointers to the pairs of an unordered container, sorted by key, which
+// iterate as the pairs themselves.
+template <typename Pair>
+class SortedPairs {
+ private:
+  using Pointers = std::vector<const Pair*>;
+
+  Pointers pointers_;
+
+ public:
+  class const_iterator {
+   private:
+    typename Pointers::const_iterator iter_;
+
+   public:
+    explicit const_iterator(typename Pointers::const_iterator iter) :
+        iter_(iter) {}
+
+    const Pair& operator*() const {
+      return **iter_;
+    }
+
+    const Pair* operator->() const {
+      return *iter_;
+    }
+
+    const_iterator& operator++() {
+      ++iter_;
+      return *this;
+    }
+
+    bool operator==(const const_iterator& rhs) const {
+      return iter_ == rhs.iter_;
+    }
+
+    bool operator!=(const const_iterator& rhs) const {
+      return iter_ != rhs.iter_;
+    }
+  };
+
+  explicit SortedPairs(Pointers pointers) :
+      pointers_(std::move(pointers)) {
+    std::sort(pointers_.begin(), pointers_.end(), [](const Pair* lhs, const Pair* rhs) {
+      return std::less<>()(lhs->first, rhs->first);
+    });
+  }
+
+  const_iterator begin() const {
+    return const_iterator(pointers_.cbegin());
+  }
+
+  const_iterator end() const {
+    return const_iterator(pointers_.cend());
+  }
+};
+
+// A balanced tree. Lookups and inserts are logarithmic and the files are
+// always in order, so a diff or a write walks them directly. Each file costs
+// a tree node of about 64 bytes. This is the default.
+struct OrderedMapStorage {
+  template <typename Key, typename Value>
+  class Map {
+   private:
+    using Container = std::map<Key, Value, std::less<>, ArenaAllocator<std::pair<const Key, Value>>>;
+
+    Container map_;
+
+   public:
+    explicit Map(Arena* arena) :
+        map_(typename Container::allocator_type(arena)) {}
+
+    Value* find(const Key& key) {
+      const auto iter = map_.find(key);
+      return iter == map_.end() ? nullptr : &iter->second;
+    }
+
+    void assign(const Key& key, const Value& value) {
+      map_[key] = value;
+    }
+
+    void assignSorted(const Key& key, const Value& value) {
+      // Ascending keys belong at the end in the common case of an empty map.
+      map_.insert_or_assign(map_.end(), key, value);
+    }
+
+    size_t size() const {
+      return map_.size();
+    }
+
+    size_t bytes() const {
+      return 0;
+    }
+
+    template <typename Visitor>
+    void forEach(const Visitor& visit) {
+      for (auto& key_value_pair : map_) {
+        visit(key_value_pair.first, key_value_pair.second);
+      }
+    }
+
+    IteratorRange<typename Container::const_iterator> sorted() const {
+      return IteratorRange<typename Container::const_iterator>(map_.cbegin(), map_.cend());
+    }
+
+    void swap(Map& rhs) {
+      map_.swap(rhs.map_);
+    }
+  };
+};
+
+// A chained hash table. Lookups and inserts take constant time but a diff or
+// a write first sorts pointers to the files. Each file costs a node of about
+// 48 bytes plus its bucket. Buckets left behind when the table grows stay in
+// the arena until it is freed.
+struct HashMapStorage {
+  template <typename Key, typename Value>
+  class Map {
+   private:
+    using Pair = std::pair<const Key, Value>;
+    using Container = std::unordered_map<Key, Value, BackupSetKeyHash, std::equal_to<Key>, ArenaAllocator<Pair>>;
+
+    Container map_;
+
+   public:
+    explicit Map(Arena* arena) :
+        map_(0, BackupSetKeyHash(), std::equal_to<Key>(), typename Container::allocator_type(arena)) {}
+
+    Value* find(const Key& key) {
+      const auto iter = map_.find(key);
+      return iter == map_.end() ? nullptr : &iter->second;
+    }
+
+    void assign(const Key& key, const Value& value) {
+      map_[key] = value;
+    }
+
+    void assignSorted(const Key& key, const Value& value) {
+      map_[key] = value;
+    }
+
+    size_t size() const {
+      return map_.size();
+    }
+
+    size_t bytes() const {
+      return 0;
+    }
+
+    template <typename Visitor>
+    void forEach(const Visitor& visit) {
+      for (auto& key_value_pair : map_) {
+        visit(key_value_pair.first, key_value_pair.second);
+      }
+    }
+
+    SortedPairs<Pair> sorted() const {
+      std::vector<const Pair*> pointers;
+      pointers.reserve(map_.size());
+      for (const auto& key_value_pair : map_) {
+        pointers.push_back(&key_value_pair);
+      }
+      return SortedPairs<Pair>(std::move(pointers));
+    }
+
+    void swap(Map& rhs) {
+      map_.swap(rhs.map_);
+    }
+  };
+};
+
+// A vector of files sorted by key. Files added out of order are appended and
+// merged into place the next time the map is read, so bulk loads cost one
+// sort and lookups are binary searches. Each file costs only its key and
+// value. Best for backup sets which are loaded once and then compared, and
+// the worst choice when files are added and looked up in turn.
+struct SortedVectorStorage {
+  template <typename Key, typename Value>
+  class Map {
+   private:
+    using Pair = std::pair<Key, Value>;
+
+    mutable std::vector<Pair> entries_;
+    // The number of leading entries which are sorted and unique. The rest
+    // were appended since, in the order they were assigned.
+    mutable size_t sorted_size_ = 0;
+    // Serializes merging the appended entries from const members.
+    mutable std::mutex mutex_;
+
+    // Merge the appended entries into place. The last value assigned to a
+    // key wins.
+    void normalize() const {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (sorted_size_ == entries_.size()) {
+        return;
+      }
+
+      const auto key_less = [](const Pair& lhs, const Pair& rhs) {
+        return std::less<>()(lhs.first, rhs.first);
+      };
+      const auto middle = entries_.begin() + static_cast<std::ptrdiff_t>(sorted_size_);
+      std::stable_sort(middle, entries_.end(), key_less);
+      std::inplace_merge(entries_.begin(), middle, entries_.end(), key_less);
+
+      // Equal keys are now in the order they were assigned. Keep the last.
+      auto out = entries_.begin();
+      for (auto iter = entries_.begin(); iter != entries_.end(); ++iter) {
+        const auto next = std::next(iter);
+        if (next == entries_.end() || key_less(*iter, *next)) {
+          *out++ = *iter;
+        }
+      }
+      entries_.erase(out, entries_.end());
+      sorted_size_ = entries_.size();
+    }
+
+   public:
+    explicit Map(Arena*) {}
+    Map(Map&& rhs) noexcept :
+        entries_(std::move(rhs.entries_)), sorted_size_(rhs.sorted_size_) {
+      rhs.sorted_size_ = 0;
+    }
+
+    Value* find(const Key& key) {
+      normalize();
+      const auto iter = std::lower_bound(entries_.begin(), entries_.end(), key, [](const Pair& lhs, const Key& rhs) {
+        return std::less<>()(lhs.first, rhs);
+      });
+      return iter == entries_.end() || std::less<>()(key, iter->first) ? nullptr : &iter->second;
+    }
+
+    void assign(const Key& key, const Value& value) {
+      const bool in_order = sorted_size_ == entries_.size() && (entries_.empty() || std::less<>()(entries_.back().first, key));
+      entries_.emplace_back(key, value);
+      if (in_order) {
+        sorted_size_++;
+      }
+    }
+
+    void assignSorted(const Key& key, const Value& value) {
+      assign(key, value);
+    }
+
+    size_t size() const {
+      normalize();
+      return entries_.size();
+    }
+
+    size_t bytes() const {
+      return entries_.capacity() * sizeof(Pair);
+    }
+
+    template <typename Visitor>
+    void forEach(const Visitor& visit) {
+      normalize();
+      for (auto& key_value_pair : entries_) {
+        visit(key_value_pair.first, key_value_pair.second);
+      }
+    }
+
+    IteratorRange<typename std::vector<Pair>::const_iterator> sorted() const {
+      normalize();
+      return IteratorRange<typename std::vector<Pair>::const_iterator>(entries_.cbegin(), entries_.cend());
+    }
+
+    void swap(Map& rhs) {
+      entries_.swap(rhs.entries_);
+      std::swap(sorted_size_, rhs.sorted_size_);
+    }
+  };
+};
+
+// An open addressing hash table in the style of a swiss table. A separate
+// array holds one control byte per slot, either empty or 7 bits of the hash
+// of the key in the slot, so a probe scans a group of control bytes and
+// only compares keys whose bits match. Files live in the slots themselves
+// without nodes. Like HashMapStorage, a diff or a write first sorts pointers
+// to the files.
+struct SwissTableStorage {
+  template <typename Key, typename Value>
+  class Map {
+   private:
+    using Pair = std::pair<Key, Value>;
+
+    static constexpr size_t GroupSize = 8;
+    static constexpr size_t InitialGroupCount = 2;
+    static constexpr uint8_t Empty = 0x80;
+
+    std::vector<uint8_t> control_;
+    std::vector<Pair> slots_;
+    size_t size_ = 0;
+
+    // Returns the slot holding |key|, or the empty slot where it belongs if
+    // it is not in the table. The table must have an empty slot.
+    size_t findSlot(const Key& key) const {
+      const auto hash = BackupSetKeyHash()(key);
+      const auto tag = static_cast<uint8_t>(hash & 0x7f);
+      const auto group_mask = control_.size() / GroupSize - 1;
+
+      // Triangular probing visits every group of a power of two table.
+      auto group = (hash >> 7) & group_mask;
+      for (size_t step = 1;; step++) {
+        for (size_t i = group * GroupSize; i < (group + 1) * GroupSize; i++) {
+          if (control_[i] == tag && slots_[i].first == key) {
+            return i;
+          }
+          // Nothing is ever erased so the key would have been put here.
+          if (control_[i] == Empty) {
+            return i;
+          }
+        }
+        group = (group + step) & group_mask;
+      }
+    }
+
+    // Double the number of slots and insert every key again.
+    void grow() {
+      std::vector<uint8_t> control(std::max(control_.size() * 2, InitialGroupCount * GroupSize), Empty);
+      std::vector<Pair> slots(control.size());
+      control.swap(control_);
+      slots.swap(slots_);
+      for (size_t i = 0; i < control.size(); i++) {
+        if (control[i] != Empty) {
+          const auto slot = findSlot(slots[i].first);
+          control_[slot] = control[i];
+          slots_[slot] = std::move(slots[i]);
+        }
+      }
+    }
+
+   public:
+    explicit Map(Arena*) {}
+
+    Value* find(const Key& key) {
+      if (size_ == 0) {
+        return nullptr;
+      }
+      const auto slot = findSlot(key);
+      return control_[slot] == Empty ? nullptr : &slots_[slot].second;
+    }
+
+    void assign(const Key& key, const Value& value) {
+      // Keep the table at most 7/8 full so probes stay short.
+      if ((size_ + 1) * 8 > control_.size() * 7) {
+        grow();
+      }
+      const auto slot = findSlot(key);
+      if (control_[slot] == Empty) {
+        control_[slot] = static_cast<uint8_t>(BackupSetKeyHash()(key) & 0x7f);
+        slots_[slot].first = key;
+        size_++;
+      }
+      slots_[slot].second = value;
+    }
+
+    void assignSorted(const Key& key, const Value& value) {
+      assign(key, value);
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    size_t bytes() const {
+      return control_.capacity() + slots_.capacity() * sizeof(Pair);
+    }
+
+    template <typename Visitor>
+    void forEach(const Visitor& visit) {
+      for (size_t i = 0; i < control_.size(); i++) {
+        if (control_[i] != Empty) {
+          visit(slots_[i].first, slots_[i].second);
+        }
+      }
+    }
+
+    SortedPairs<Pair> sorted() const {
+      std::vector<const Pair*> pointers;
+      pointers.reserve(size_);
+      for (size_t i = 0; i < control_.size(); i++) {
+        if (control_[i] != Empty) {
+          pointers.push_back(&slots_[i]);
+        }
+      }
+      return SortedPairs<Pair>(std::move(pointers));
+    }
+
+    void swap(Map& rhs) {
+      control_.swap(rhs.control_);
+      slots_.swap(rhs.slots_);
+      std::swap(size_, rhs.size_);
+    }
+  };
+};
+
+#endif  // __BackupSetStorage_h__
@@ -5,17 +5,262 @@
 
 #include "BackupSetWriter.h"
 
-#include <iomanip>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "BackupSet.h"
+#include "BackupSetIndex.h"
+#include "OutputSink.h"
+#include "Sha1Digest.h"
+#include "ThreadPool.h"
+#include "Trace.h"
 
-BackupSetWriter::BackupSetWriter(const BackupSet& backup_set) :
+namespace {
+
+// Ranges formatted per worker thread before the batch is written. More than
+// one evens out ranges of different sizes.
+constexpr size_t RangesPerThread = 4;
+
+// Format each of |range_count| ranges into a buffer of its own with
+// |format| and write the buffers to |os| in order. With a |pool|, a batch of
+// ranges is formatted at once on its threads, so only a batch of buffers is
+// held at a time.
+void writeRanges(std::ostream& os, ThreadPool* pool, size_t range_count, const std::function<void(size_t, std::string&)>& format) {
+  const auto batch_size = pool ? pool->size() * RangesPerThread : 1;
+  std::vector<std::string> buffers(std::min(batch_size, range_count));
+  for (size_t first = 0; first < range_count; first += batch_size) {
+    const auto count = std::min(batch_size, range_count - first);
+    const auto format_range = [&](size_t i) {
+      TRACE_SCOPE("format range");
+      buffers[i].clear();
+      format(first + i, buffers[i]);
+    };
+    if (pool) {
+      pool->parallelFor(count, format_range);
+    } else {
+      format_range(0);
+    }
+    for (size_t i = 0; i < count; i++) {
+      os.write(buffers[i].data(), static_cast<std::streamsize>(buffers[i].size()));
+    }
+  }
+}
+
+void appendLittleEndian64(uint64_t value, std::string& buffer) {
+  char encoded[sizeof(value)];
+  storeLittleEndian64(value, encoded);
+  buffer.append(encoded, sizeof(encoded));
+}
+
+}  // namespace
+
+template <typename Storage>
+BasicBackupSetWriter<Storage>::BasicBackupSetWriter(const BasicBackupSet<Storage>& backup_set) :
     backup_set_(backup_set) {}
 
-void BackupSetWriter::write(std::ostream& os) {
-  for (const auto& sha1_filename_pair : backup_set_.hash_to_filename_map_) {
-      os << sha1_filename_pair.first << " " << sha1_filename_pair.second << std::endl;
+template <typename Storage>
+void BasicBackupSetWriter<Storage>::write(std::ostream& os) {
+  TRACE_SCOPE("BackupSetWriter::write");
+  std::unique_ptr<ThreadPool> pool;
+  if (thread_count_ > 1) {
+    pool = std::make_unique<ThreadPool>(thread_count_);
+  }
+
+  // Each shard is a range, followed by the string hashes.
+  const auto& shards = backup_set_.shards_;
+  writeRanges(os, pool.get(), shards.size() + 1, [this, &shards](size_t range, std::string& buffer) {
+    std::string filename_buffer;
+    if (range < shards.size()) {
+      for (const auto& digest_filename_pair : shards[range].files.sorted()) {
+        const auto filename = backup_set_.getFilename(digest_filename_pair.second, filename_buffer);
+        const auto size = buffer.size();
+        buffer.resize(size + Sha1Digest::Size * 2 + 1);
+        digest_filename_pair.first.toHex(&buffer[size]);
+        buffer.back() = ' ';
+        buffer.append(filename);
+        buffer.push_back('\n');
+      }
+      return;
+    }
+    for (const auto& sha1_filename_pair : backup_set_.string_hashes_.files.sorted()) {
+      buffer.append(sha1_filename_pair.first);
+      buffer.push_back(' ');
+      buffer.append(backup_set_.getFilename(sha1_filename_pair.second, filename_buffer));
+      buffer.push_back('\n');
+    }
+  });
+}
+
+template <typename Storage>
+void BasicBackupSetWriter<Storage>::writeIndex(std::ostream& os) {
+  TRACE_SCOPE("BackupSetWriter::writeIndex");
+  std::unique_ptr<ThreadPool> pool;
+  if (thread_count_ > 1) {
+    pool = std::make_unique<ThreadPool>(thread_count_);
+  }
+  const auto for_each_shard = [&pool](const std::function<void(size_t)>& task) {
+    if (pool) {
+      pool->parallelFor(BasicBackupSet<Storage>::ShardCount, task);
+    } else {
+      for (size_t i = 0; i < BasicBackupSet<Storage>::ShardCount; i++) {
+        task(i);
+      }
+    }
+  };
+
+  // Every section visits the files in order. Put each shard in order once
+  // and measure the filenames of each, which may need decoding.
+  using SortedShard = decltype(backup_set_.shards_.front().files.sorted());
+  std::vector<std::optional<SortedShard>> shards(backup_set_.shards_.size());
+  std::vector<uint64_t> shard_filenames_sizes(shards.size());
+  for_each_shard([&](size_t i) {
+    shards[i].emplace(backup_set_.shards_[i].files.sorted());
+    std::string filename_buffer;
+    for (const auto& digest_filename_pair : *shards[i]) {
+      shard_filenames_sizes[i] += backup_set_.getFilename(digest_filename_pair.second, filename_buffer).size();
+    }
+  });
+  const auto string_hashes = backup_set_.string_hashes_.files.sorted();
+
+  // Measure everything first so the header can be written up front.
+  std::string filename_buffer;
+  BackupSetIndexHeader header;
+  uint64_t filenames_size = 0;
+  for (size_t i = 0; i < shards.size(); i++) {
+    header.digest_count += backup_set_.shards_[i].files.size();
+    filenames_size += shard_filenames_sizes[i];
+  }
+  uint64_t string_hashes_size = 0;
+  for (const auto& sha1_filename_pair : string_hashes) {
+    header.string_hash_count++;
+    string_hashes_size += sha1_filename_pair.first.size();
+    filenames_size += backup_set_.getFilename(sha1_filename_pair.second, filename_buffer).size();
+  }
+  header.layout(string_hashes_size, filenames_size);
+
+  char buffer[BackupSetIndexHeader::EncodedSize];
+  header.encode(buffer);
+  os.write(buffer, sizeof(buffer));
+
+  // Digests.
+  writeRanges(os, pool.get(), shards.size(), [&shards](size_t i, std::string& buffer) {
+    for (const auto& digest_filename_pair : *shards[i]) {
+      buffer.append(reinterpret_cast<const char*>(digest_filename_pair.first.bytes.data()), Sha1Digest::Size);
+    }
+  });
+  const auto padding = header.filename_offsets_offset - header.digests_offset - header.digest_count * Sha1Digest::Size;
+  os.write("\0\0\0\0\0\0\0", static_cast<std::streamsize>(padding));
+
+  // Filename offsets. Each shard starts where the filenames of the shards
+  // before it end.
+  std::vector<uint64_t> shard_offsets(shards.size());
+  uint64_t offset = 0;
+  for (size_t i = 0; i < shards.size(); i++) {
+    shard_offsets[i] = offset;
+    offset += shard_filenames_sizes[i];
   }
+  const auto write_offset = [&os](uint64_t offset) {
+    char encoded[sizeof(offset)];
+    storeLittleEndian64(offset, encoded);
+    os.write(encoded, sizeof(encoded));
+  };
+  write_offset(0);
+  writeRanges(os, pool.get(), shards.size(), [&](size_t i, std::string& buffer) {
+    std::string filename_buffer;
+    auto offset = shard_offsets[i];
+    for (const auto& digest_filename_pair : *shards[i]) {
+      offset += backup_set_.getFilename(digest_filename_pair.second, filename_buffer).size();
+      appendLittleEndian64(offset, buffer);
+    }
+  });
+  for (const auto& sha1_filename_pair : string_hashes) {
+    offset += backup_set_.getFilename(sha1_filename_pair.second, filename_buffer).size();
+    write_offset(offset);
+  }
+
+  // String hash offsets and string hashes.
+  offset = 0;
+  write_offset(offset);
+  for (const auto& sha1_filename_pair : string_hashes) {
+    offset += sha1_filename_pair.first.size();
+    write_offset(offset);
+  }
+  for (const auto& sha1_filename_pair : string_hashes) {
+    os.write(sha1_filename_pair.first.data(), static_cast<std::streamsize>(sha1_filename_pair.first.size()));
+  }
+
+  // Filenames.
+  writeRanges(os, pool.get(), shards.size(), [&](size_t i, std::string& buffer) {
+    std::string filename_buffer;
+    for (const auto& digest_filename_pair : *shards[i]) {
+      buffer.append(backup_set_.getFilename(digest_filename_pair.second, filename_buffer));
+    }
+  });
+  for (const auto& sha1_filename_pair : string_hashes) {
+    const auto filename = backup_set_.getFilename(sha1_filename_pair.second, filename_buffer);
+    os.write(filename.data(), static_cast<std::streamsize>(filename.size()));
+  }
+  const auto lookup_padding = header.lookup_offset - header.filenames_offset - header.filenames_size;
+  os.write("\0\0\0\0\0\0\0", static_cast<std::streamsize>(lookup_padding));
+
+  // Lookup table. Count the digests for each entry, then write where each
+  // entry starts.
+  std::vector<uint64_t> entry_counts(static_cast<size_t>(1) << header.lookup_bits);
+  for (const auto& shard : shards) {
+    for (const auto& digest_filename_pair : *shard) {
+      entry_counts[BackupSetIndexHeader::getLookupEntry(digest_filename_pair.first, header.lookup_bits)]++;
+    }
+  }
+  offset = 0;
+  write_offset(offset);
+  for (const auto count : entry_counts) {
+    offset += count;
+    write_offset(offset);
+  }
+}
+
+template <typename Storage>
+bool BasicBackupSetWriter<Storage>::writeFile(const std::string& filename) {
+  auto sink = OutputSink::open(filename, use_write_thread_);
+  if (!sink) {
+    return false;
+  }
+  std::ostream os(sink.get());
+  write(os);
+  return os.good() && sink->close();
+}
+
+template <typename Storage>
+bool BasicBackupSetWriter<Storage>::writeIndexFile(const std::string& filename) {
+  auto sink = OutputSink::open(filename, use_write_thread_);
+  if (!sink) {
+    return false;
+  }
+  std::ostream os(sink.get());
+  writeIndex(os);
+  return os.good() && sink->close();
 }
+
+template <typename Storage>
+void BasicBackupSetWriter<Storage>::enableWriteThread() {
+  use_write_thread_ = true;
+}
+
+template <typename Storage>
+void BasicBackupSetWriter<Storage>::setThreadCount(size_t thread_count) {
+  thread_count_ = std::max<size_t>(thread_count, 1);
+}
+
+template class BasicBackupSetWriter<OrderedMapStorage>;
+template class BasicBackupSetWriter<HashMapStorage>;
+template class BasicBackupSetWriter<SortedVectorStorage>;
+template class BasicBackupSetWriter<SwissTableStorage>;
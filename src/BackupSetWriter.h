@@ -6,25 +6,59 @@
 #ifndef __BackupSetWriter_h__
 #define __BackupSetWriter_h__
 
+#include <cstddef>
 #include <iostream>
+#include <string>
 
-class BackupSet;
+struct OrderedMapStorage;
+
+template <typename Storage>
+class BasicBackupSet;
 
 // A BackupSet may be serialized into a series of lines where each line
 // begins with a 40-character sha1hash followed by a single space character
 // followed by the filename and line terminator.
 // This utility class can serialize a BackupSet into a buffer in the format
-// as defined above.
-class BackupSetWriter {
+// as defined above or into the binary index format defined in
+// BackupSetIndex.h.
+template <typename Storage>
+class BasicBackupSetWriter {
  private:
-  const BackupSet& backup_set_;
+  const BasicBackupSet<Storage>& backup_set_;
+  bool use_write_thread_ = false;
+  size_t thread_count_ = 1;
 
  public:
-  BackupSetWriter() = delete;
-  explicit BackupSetWriter(const BackupSet& backup_set);
-  ~BackupSetWriter() = default;
+  BasicBackupSetWriter() = delete;
+  explicit BasicBackupSetWriter(const BasicBackupSet<Storage>& backup_set);
+  ~BasicBackupSetWriter() = default;
 
+  // Write the BackupSet into |os| as lines of text.
   void write(std::ostream& os);
+
+  // Write the BackupSet into |os| as a binary index. See BackupSetIndex.h for
+  // the format. |os| should be opened in binary mode.
+  void writeIndex(std::ostream& os);
+
+  // Format the files on |thread_count| threads. Each shard is formatted into
+  // a buffer of its own and the buffers are written in order, so the output
+  // is identical to writing on a single thread.
+  void setThreadCount(size_t thread_count);
+
+  // Write the BackupSet as lines of text to the file named |filename|
+  // through an OutputSink, which writes a few large buffers at a time.
+  // Returns false if the file could not be written.
+  bool writeFile(const std::string& filename);
+
+  // Write the BackupSet as a binary index to the file named |filename|
+  // through an OutputSink. Returns false if the file could not be written.
+  bool writeIndexFile(const std::string& filename);
+
+  // Have writeFile and writeIndexFile write buffers out on a thread of their
+  // own while the next ones are filled.
+  void enableWriteThread();
 };
 
+using BackupSetWriter = BasicBackupSetWriter<OrderedMapStorage>;
+
 #endif  // __BackupSetWriter_h__
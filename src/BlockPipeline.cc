@@ -0,0 +1,157 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "BlockPipeline.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "Trace.h"
+
+// static
+std::unique_ptr<FileBlockSource> FileBlockSource::open(const std::string& filename) {
+  std::unique_ptr<FileBlockSource> source(new FileBlockSource());
+  // Blocks are large, so reads go straight into them without the stream's
+  // own buffer.
+  source->ifs_.rdbuf()->pubsetbuf(nullptr, 0);
+  source->ifs_.open(filename, std::ifstream::in | std::ifstream::binary);
+  if (!source->ifs_) {
+    return nullptr;
+  }
+  return source;
+}
+
+bool FileBlockSource::read(char* data, size_t capacity, size_t& size) {
+  ifs_.read(data, static_cast<std::streamsize>(capacity));
+  size = static_cast<size_t>(ifs_.gcount());
+  // Reaching the end sets failbit along with eofbit. Only badbit is an error.
+  return !ifs_.bad();
+}
+
+BlockPipeline::BlockPipeline(BlockSource& source, size_t block_size, size_t buffer_count) :
+    source_(source), block_size_(std::max<size_t>(block_size, 1)), buffers_(std::max<size_t>(buffer_count, 2)) {}
+
+bool BlockPipeline::takeFreeBuffer(size_t& index) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return is_stopping_ || !free_buffers_.empty(); });
+  if (is_stopping_) {
+    return false;
+  }
+  index = free_buffers_.front();
+  free_buffers_.pop_front();
+  return true;
+}
+
+void BlockPipeline::queueFullBuffer(size_t index) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    full_buffers_.push_back(index);
+  }
+  changed_.notify_all();
+}
+
+void BlockPipeline::finish(bool is_failed) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_done_ = true;
+    is_failed_ = is_failed;
+  }
+  changed_.notify_all();
+}
+
+void BlockPipeline::produce() {
+  // The partial line at the end of the last block, which starts the next.
+  std::string carry;
+  size_t index;
+  if (!takeFreeBuffer(index)) {
+    finish(false);
+    return;
+  }
+
+  while (true) {
+    TRACE_SCOPE("read block");
+    auto& buffer = buffers_[index];
+    buffer.data.resize(carry.size() + block_size_);
+    std::memcpy(buffer.data.data(), carry.data(), carry.size());
+    size_t read_size = 0;
+    if (!source_.read(buffer.data.data() + carry.size(), block_size_, read_size)) {
+      finish(true);
+      return;
+    }
+
+    const auto size = carry.size() + read_size;
+    if (read_size == 0) {
+      // The last line need not be terminated.
+      if (size > 0) {
+        buffer.size = size;
+        queueFullBuffer(index);
+      }
+      finish(false);
+      return;
+    }
+
+    const std::string_view data(buffer.data.data(), size);
+    const auto last_newline = data.rfind('\n');
+    if (last_newline == std::string_view::npos) {
+      // A line longer than a block. Keep reading into the same buffer.
+      carry.assign(data);
+      continue;
+    }
+    carry.assign(data.substr(last_newline + 1));
+    buffer.size = last_newline + 1;
+    queueFullBuffer(index);
+    if (!takeFreeBuffer(index)) {
+      finish(false);
+      return;
+    }
+  }
+}
+
+bool BlockPipeline::run(const std::function<bool(std::string_view)>& consume) {
+  for (size_t i = 0; i < buffers_.size(); i++) {
+    free_buffers_.push_back(i);
+  }
+  std::thread producer(&BlockPipeline::produce, this);
+
+  bool is_failed = false;
+  while (true) {
+    size_t index;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      changed_.wait(lock, [this] { return is_done_ || !full_buffers_.empty(); });
+      if (full_buffers_.empty()) {
+        is_failed = is_failed_;
+        break;
+      }
+      index = full_buffers_.front();
+      full_buffers_.pop_front();
+    }
+
+    const auto& buffer = buffers_[index];
+    if (!consume(std::string_view(buffer.data.data(), buffer.size))) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      is_stopping_ = true;
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_buffers_.push_back(index);
+    }
+    changed_.notify_all();
+  }
+
+  changed_.notify_all();
+  producer.join();
+  return !is_failed;
+}
@@ -0,0 +1,99 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __BlockPipeline_h__
+#define __BlockPipeline_h__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Where a BlockPipeline reads its bytes from.
+class BlockSource {
+ public:
+  virtual ~BlockSource() = default;
+
+  // Read the next bytes, at most |capacity| of them, into |data| and set
+  // |size| to the number read. A |size| of 0 marks the end of the input.
+  // Returns false if the input could not be read.
+  virtual bool read(char* data, size_t capacity, size_t& size) = 0;
+};
+
+// Reads a file with plain reads through an ifstream.
+class FileBlockSource : public BlockSource {
+ private:
+  std::ifstream ifs_;
+
+  FileBlockSource() = default;
+
+ public:
+  // Open the file named |filename|. Returns nullptr if it cannot be opened.
+  static std::unique_ptr<FileBlockSource> open(const std::string& filename);
+
+  bool read(char* data, size_t capacity, size_t& size) override;
+};
+
+// Reads a BlockSource on a thread of its own into a ring of large buffers
+// while the calling thread consumes the buffers already filled, so reading
+// the input overlaps with processing it.
+// Every block handed to the consumer ends just after a newline, except the
+// last one if the input does not end in one, so no line spans two blocks.
+class BlockPipeline {
+ public:
+  static constexpr size_t DefaultBlockSize = 4 * 1024 * 1024;
+  static constexpr size_t DefaultBufferCount = 2;
+
+ private:
+  struct Buffer {
+    std::vector<char> data;
+    // Bytes of complete lines at the front of |data|.
+    size_t size = 0;
+  };
+
+  BlockSource& source_;
+  size_t block_size_;
+  std::vector<Buffer> buffers_;
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  // Indexes of buffers ready to be filled and ready to be consumed.
+  std::deque<size_t> free_buffers_;
+  std::deque<size_t> full_buffers_;
+  // Set by the producer when it has queued its last buffer.
+  bool is_done_ = false;
+  bool is_failed_ = false;
+  // Set by the consumer to stop the producer early.
+  bool is_stopping_ = false;
+
+  // Fill buffers from the source until it ends, fails or is stopped.
+  void produce();
+
+  // Wait for a free buffer. Returns false if the consumer has stopped.
+  bool takeFreeBuffer(size_t& index);
+
+  void queueFullBuffer(size_t index);
+
+  void finish(bool is_failed);
+
+ public:
+  explicit BlockPipeline(BlockSource& source, size_t block_size = DefaultBlockSize, size_t buffer_count = DefaultBufferCount);
+  BlockPipeline(const BlockPipeline&) = delete;
+  BlockPipeline& operator=(const BlockPipeline&) = delete;
+  ~BlockPipeline() = default;
+
+  // Call |consume| on the calling thread with each block in order until the
+  // input ends or |consume| returns false. Returns false if the input could
+  // not be read.
+  bool run(const std::function<bool(std::string_view)>& consume);
+};
+
+#endif  // __BlockPipeline_h__
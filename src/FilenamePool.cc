@@ -0,0 +1,105 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "FilenamePool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr size_t InitialSlotCount = 64;
+
+// The low bits of the hash pick the stripe so the rest pick the slot.
+size_t getSlotHash(size_t hash) {
+  return hash / FilenamePool::StripeCount;
+}
+
+}  // namespace
+
+// static
+std::string_view FilenamePool::getFilename(const Stripe& stripe, size_t index) {
+  const char* filename = stripe.filenames[index];
+  uint32_t size;
+  std::memcpy(&size, filename - sizeof(size), sizeof(size));
+  return std::string_view(filename, size);
+}
+
+// static
+void FilenamePool::grow(Stripe& stripe) {
+  std::vector<uint32_t> slots(std::max(stripe.slots.size() * 2, InitialSlotCount));
+  const auto mask = slots.size() - 1;
+  for (size_t i = 0; i < stripe.filenames.size(); i++) {
+    auto slot = getSlotHash(std::hash<std::string_view>()(getFilename(stripe, i))) & mask;
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    slots[slot] = static_cast<uint32_t>(i + 1);
+  }
+  stripe.slots = std::move(slots);
+}
+
+FilenamePool::Id FilenamePool::intern(std::string_view filename) {
+  const auto hash = std::hash<std::string_view>()(filename);
+  const auto stripe_index = hash % StripeCount;
+  auto& stripe = stripes_[stripe_index];
+  std::lock_guard<std::mutex> lock(stripe.mutex);
+
+  // Keep the table at most 70% full.
+  if ((stripe.filenames.size() + 1) * 10 > stripe.slots.size() * 7) {
+    grow(stripe);
+  }
+
+  const auto mask = stripe.slots.size() - 1;
+  auto slot = getSlotHash(hash) & mask;
+  for (; stripe.slots[slot] != 0; slot = (slot + 1) & mask) {
+    const auto index = stripe.slots[slot] - 1;
+    if (getFilename(stripe, index) == filename) {
+      return static_cast<Id>(index * StripeCount + stripe_index);
+    }
+  }
+
+  const auto index = stripe.filenames.size();
+  const auto size = static_cast<uint32_t>(filename.size());
+  auto* data = static_cast<char*>(stripe.arena.allocate(sizeof(size) + filename.size(), 1));
+  std::memcpy(data, &size, sizeof(size));
+  std::memcpy(data + sizeof(size), filename.data(), filename.size());
+  stripe.filenames.push_back(data + sizeof(size));
+  stripe.slots[slot] = static_cast<uint32_t>(index + 1);
+  return static_cast<Id>(index * StripeCount + stripe_index);
+}
+
+std::string_view FilenamePool::get(Id id) const {
+  const auto& stripe = stripes_[id % StripeCount];
+  std::lock_guard<std::mutex> lock(stripe.mutex);
+  return getFilename(stripe, id / StripeCount);
+}
+
+size_t FilenamePool::size() const {
+  size_t count = 0;
+  for (const auto& stripe : stripes_) {
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    count += stripe.filenames.size();
+  }
+  return count;
+}
+
+size_t FilenamePool::memoryUsage() const {
+  size_t bytes = 0;
+  for (const auto& stripe : stripes_) {
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    bytes += stripe.arena.reservedBytes();
+    bytes += stripe.filenames.capacity() * sizeof(const char*);
+    bytes += stripe.slots.capacity() * sizeof(uint32_t);
+  }
+  return bytes;
+}
@@ -0,0 +1,71 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __FilenamePool_h__
+#define __FilenamePool_h__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "Arena.h"
+
+// A pool of unique filenames which several backup sets can share.
+// Each filename is stored once and identified by a 4-byte id, so backup sets
+// holding mostly the same files, such as two generations being compared,
+// cost about as much as one.
+// The pool is split into stripes by the hash of the filename. Each stripe
+// has its own lock so backup sets can be filled concurrently.
+class FilenamePool {
+ public:
+  using Id = uint32_t;
+
+  static constexpr size_t StripeCount = 64;
+
+ private:
+  struct Stripe {
+    mutable std::mutex mutex;
+    Arena arena;
+    // Filenames in the order they were added. A filename's index here
+    // forms its id along with the index of the stripe. Each one points at
+    // the filename in |arena|, which is preceded by its length.
+    std::vector<const char*> filenames;
+    // Open addressing table of indexes into |filenames| plus one. Zero marks
+    // an empty slot.
+    std::vector<uint32_t> slots;
+  };
+
+  std::array<Stripe, StripeCount> stripes_;
+
+  // Returns the filename at |index| in |stripe|.
+  static std::string_view getFilename(const Stripe& stripe, size_t index);
+
+  // Double the number of slots in |stripe| and insert every filename again.
+  static void grow(Stripe& stripe);
+
+ public:
+  FilenamePool() = default;
+  FilenamePool(const FilenamePool&) = delete;
+  FilenamePool& operator=(const FilenamePool&) = delete;
+  ~FilenamePool() = default;
+
+  // Add |filename| to the pool if it is not there yet and return its id.
+  Id intern(std::string_view filename);
+
+  // Returns the filename with id |id|. The view is valid for the lifetime of
+  // the pool.
+  std::string_view get(Id id) const;
+
+  // Returns the number of unique filenames in the pool.
+  size_t size() const;
+
+  // Returns the number of bytes held by the pool.
+  size_t memoryUsage() const;
+};
+
+#endif  // __FilenamePool_h__
@@ -0,0 +1,74 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "FrontCodedStrings.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace {
+
+// Lengths are stored as variable-length integers, seven bits per byte with
+// the high bit set on every byte but the last. Most take a single byte.
+void appendVarint(std::string& data, size_t value) {
+  while (value >= 0x80) {
+    data.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  data.push_back(static_cast<char>(value));
+}
+
+size_t readVarint(const char*& p) {
+  size_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    const auto byte = static_cast<uint8_t>(*p++);
+    value |= static_cast<size_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return value;
+    }
+  }
+}
+
+}  // namespace
+
+size_t FrontCodedStrings::append(std::string_view str) {
+  size_t shared_size = 0;
+  if (size_ % BlockSize == 0) {
+    block_offsets_.push_back(data_.size());
+  } else {
+    const auto max_shared_size = std::min(last_.size(), str.size());
+    while (shared_size < max_shared_size && last_[shared_size] == str[shared_size]) {
+      shared_size++;
+    }
+    appendVarint(data_, shared_size);
+  }
+
+  appendVarint(data_, str.size() - shared_size);
+  data_.append(str.substr(shared_size));
+  last_.assign(str);
+  return size_++;
+}
+
+void FrontCodedStrings::shrinkToFit() {
+  data_.shrink_to_fit();
+  block_offsets_.shrink_to_fit();
+  last_.clear();
+  last_.shrink_to_fit();
+}
+
+void FrontCodedStrings::get(size_t index, std::string& str) const {
+  const char* p = data_.data() + block_offsets_[index / BlockSize];
+  str.clear();
+  for (size_t i = 0; i <= index % BlockSize; i++) {
+    const auto shared_size = i == 0 ? 0 : readVarint(p);
+    const auto suffix_size = readVarint(p);
+    str.resize(shared_size);
+    str.append(p, suffix_size);
+    p += suffix_size;
+  }
+}
@@ -0,0 +1,58 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __FrontCodedStrings_h__
+#define __FrontCodedStrings_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A compact list of strings stored with front coding.
+// Strings are grouped into blocks of BlockSize. The first string of a block
+// is stored whole and every other string is stored as the length of the
+// prefix it shares with the string before it followed by the rest of it.
+// Sorted strings with long common prefixes, such as paths under the same
+// directories, take a fraction of their original size.
+// Reading a string decodes at most one block.
+class FrontCodedStrings {
+ public:
+  static constexpr size_t BlockSize = 16;
+
+ private:
+  std::string data_;
+  std::vector<uint64_t> block_offsets_;
+  size_t size_ = 0;
+  // The last string appended, to share its prefix with the next one.
+  std::string last_;
+
+ public:
+  FrontCodedStrings() = default;
+  ~FrontCodedStrings() = default;
+
+  // Append |str| and return its index. Strings may be appended in any order
+  // but compress best when sorted.
+  size_t append(std::string_view str);
+
+  // Release memory only needed while appending.
+  void shrinkToFit();
+
+  // Decode string |index| into |str|.
+  void get(size_t index, std::string& str) const;
+
+  // Returns the number of strings.
+  size_t size() const {
+    return size_;
+  }
+
+  // Returns the number of bytes used to store the strings.
+  size_t memoryUsage() const {
+    return data_.capacity() + block_offsets_.capacity() * sizeof(uint64_t);
+  }
+};
+
+#endif  // __FrontCodedStrings_h__
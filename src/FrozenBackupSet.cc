@@ -0,0 +1,357 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "FrozenBackupSet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "BackupSetWriter.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+namespace {
+
+// Appends everything written to it to a string, so an index can be written
+// straight into the buffer which will hold it.
+class StringSink : public std::streambuf {
+ private:
+  std::string& out_;
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      out_.push_back(traits_type::to_char_type(ch));
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char* data, std::streamsize size) override {
+    out_.append(data, static_cast<size_t>(size));
+    return size;
+  }
+
+ public:
+  explicit StringSink(std::string& out) :
+      out_(out) {}
+};
+
+// Returns true if the |count| + 1 offsets at |offsets| are ascending and stay
+// within a blob of |blob_size| bytes.
+bool offsetsAscending(const char* offsets, uint64_t count, uint64_t blob_size) {
+  uint64_t previous = 0;
+  for (uint64_t i = 0; i <= count; i++) {
+    const auto offset = loadLittleEndian64(offsets + i * sizeof(uint64_t));
+    if (offset < previous || offset > blob_size) {
+      return false;
+    }
+    previous = offset;
+  }
+  return true;
+}
+
+// Walk the sorted ranges [lhs_begin, lhs_end) and [rhs_begin, rhs_end) in
+// lockstep, like the merge join of BackupSet. |compare| orders an element of
+// each side like memcmp.
+template <typename Compare, typename LhsFilename, typename RhsFilename>
+void mergeJoin(size_t lhs_begin, size_t lhs_end, size_t rhs_begin, size_t rhs_end, const Compare& compare, const LhsFilename& lhs_filename, const RhsFilename& rhs_filename, std::vector<std::string>* missing, std::vector<std::string>* extra) {
+  while (lhs_begin < lhs_end && rhs_begin < rhs_end) {
+    const auto order = compare(lhs_begin, rhs_begin);
+    if (order < 0) {
+      if (extra) {
+        extra->emplace_back(lhs_filename(lhs_begin));
+      }
+      lhs_begin++;
+    } else if (order > 0) {
+      if (missing) {
+        missing->emplace_back(rhs_filename(rhs_begin));
+      }
+      rhs_begin++;
+    } else {
+      lhs_begin++;
+      rhs_begin++;
+    }
+  }
+
+  // Whatever remains on either side has no match on the other side.
+  if (extra) {
+    for (; lhs_begin < lhs_end; lhs_begin++) {
+      extra->emplace_back(lhs_filename(lhs_begin));
+    }
+  }
+  if (missing) {
+    for (; rhs_begin < rhs_end; rhs_begin++) {
+      missing->emplace_back(rhs_filename(rhs_begin));
+    }
+  }
+}
+
+}  // namespace
+
+// static
+std::unique_ptr<FrozenBackupSet> FrozenBackupSet::freeze(const BackupSet& backup_set) {
+  auto buffer = std::make_shared<std::string>();
+  {
+    StringSink sink(*buffer);
+    std::ostream os(&sink);
+    BackupSetWriter(backup_set).writeIndex(os);
+  }
+
+  std::unique_ptr<FrozenBackupSet> frozen(new FrozenBackupSet());
+  const std::string_view index = *buffer;
+  frozen->attach(std::move(buffer), index);
+  frozen->owns_storage_ = true;
+  return frozen;
+}
+
+// static
+std::unique_ptr<FrozenBackupSet> FrozenBackupSet::open(const std::string& filename) {
+  TRACE_SCOPE("FrozenBackupSet::open");
+  auto mapped_file = MappedFile::open(filename);
+  if (!mapped_file) {
+    return nullptr;
+  }
+
+  std::unique_ptr<FrozenBackupSet> frozen(new FrozenBackupSet());
+  const auto index = mapped_file->view();
+  if (!frozen->attach(std::move(mapped_file), index)) {
+    return nullptr;
+  }
+  return frozen;
+}
+
+bool FrozenBackupSet::attach(std::shared_ptr<const void> storage, std::string_view index) {
+  BackupSetIndexHeader header;
+  if (!header.decode(index)) {
+    return false;
+  }
+
+  storage_ = std::move(storage);
+  index_ = index;
+  header_ = header;
+  digests_ = index.data() + header.digests_offset;
+  filename_offsets_ = index.data() + header.filename_offsets_offset;
+  string_hash_offsets_ = index.data() + header.string_hash_offsets_offset;
+  string_hashes_ = index.substr(header.string_hashes_offset, header.filenames_offset - std::min(header.filenames_offset, header.string_hashes_offset));
+  filenames_ = index.substr(header.filenames_offset, header.filenames_size);
+
+  // Check the offsets and the order of the hashes once so lookups can trust
+  // them.
+  if (!offsetsAscending(filename_offsets_, header.digest_count + header.string_hash_count, filenames_.size()) ||
+      !offsetsAscending(string_hash_offsets_, header.string_hash_count, string_hashes_.size())) {
+    return false;
+  }
+  for (uint64_t i = 1; i < header.string_hash_count; i++) {
+    if (!(getStringHash(i - 1) < getStringHash(i))) {
+      return false;
+    }
+  }
+
+  lookup_bits_ = header.hasLookupTable() ? header.lookup_bits : BackupSetIndexHeader::getLookupBits(header.digest_count);
+  const auto entry_count = static_cast<size_t>(1) << lookup_bits_;
+  lookup_.assign(entry_count + 1, 0);
+  if (header.hasLookupTable()) {
+    const char* const lookup = index.data() + header.lookup_offset;
+    for (size_t i = 0; i <= entry_count; i++) {
+      lookup_[i] = loadLittleEndian64(lookup + i * sizeof(uint64_t));
+      if ((i == 0 && lookup_[i] != 0) || (i > 0 && lookup_[i] < lookup_[i - 1])) {
+        return false;
+      }
+    }
+    if (lookup_[entry_count] != header.digest_count) {
+      return false;
+    }
+  }
+
+  // The digests must be sorted and unique. Every digest must also be found
+  // through the lookup table, or is counted towards it when the index has
+  // none.
+  Sha1Digest digest;
+  for (uint64_t i = 0; i < header.digest_count; i++) {
+    if (i > 0 && compareDigest(i, digest) <= 0) {
+      return false;
+    }
+    std::memcpy(digest.bytes.data(), digests_ + i * Sha1Digest::Size, Sha1Digest::Size);
+    const auto entry = BackupSetIndexHeader::getLookupEntry(digest, lookup_bits_);
+    if (header.hasLookupTable()) {
+      if (i < lookup_[entry] || i >= lookup_[entry + 1]) {
+        return false;
+      }
+    } else {
+      lookup_[entry + 1]++;
+    }
+  }
+  if (!header.hasLookupTable()) {
+    for (size_t i = 0; i < entry_count; i++) {
+      lookup_[i + 1] += lookup_[i];
+    }
+  }
+  return true;
+}
+
+int FrozenBackupSet::compareDigest(size_t index, const Sha1Digest& digest) const {
+  return std::memcmp(digests_ + index * Sha1Digest::Size, digest.bytes.data(), Sha1Digest::Size);
+}
+
+std::string_view FrozenBackupSet::getFilename(size_t index) const {
+  const auto begin = loadLittleEndian64(filename_offsets_ + index * sizeof(uint64_t));
+  const auto end = loadLittleEndian64(filename_offsets_ + (index + 1) * sizeof(uint64_t));
+  return filenames_.substr(begin, end - begin);
+}
+
+std::string_view FrozenBackupSet::getStringHash(size_t index) const {
+  const auto begin = loadLittleEndian64(string_hash_offsets_ + index * sizeof(uint64_t));
+  const auto end = loadLittleEndian64(string_hash_offsets_ + (index + 1) * sizeof(uint64_t));
+  return string_hashes_.substr(begin, end - begin);
+}
+
+size_t FrozenBackupSet::lowerBound(size_t leading_byte) const {
+  size_t first = 0;
+  size_t count = header_.digest_count;
+  while (count > 0) {
+    const auto step = count / 2;
+    const auto middle = first + step;
+    if (static_cast<unsigned char>(digests_[middle * Sha1Digest::Size]) < leading_byte) {
+      first = middle + 1;
+      count -= step + 1;
+    } else {
+      count = step;
+    }
+  }
+  return first;
+}
+
+bool FrozenBackupSet::find(const Sha1Digest& digest, std::string_view& filename) const {
+  // The digests for an entry are sorted, and there are only a few, so scan
+  // them in order.
+  const auto entry = BackupSetIndexHeader::getLookupEntry(digest, lookup_bits_);
+  for (auto i = lookup_[entry]; i < lookup_[entry + 1]; i++) {
+    const auto order = compareDigest(i, digest);
+    if (order == 0) {
+      filename = getFilename(i);
+      return true;
+    }
+    if (order > 0) {
+      break;
+    }
+  }
+  return false;
+}
+
+bool FrozenBackupSet::find(std::string_view sha1, std::string_view& filename) const {
+  Sha1Digest digest;
+  if (Sha1Digest::fromHex(sha1, digest)) {
+    return find(digest, filename);
+  }
+
+  // Files keyed by string hashes are rare. Binary search them.
+  size_t first = 0;
+  size_t count = header_.string_hash_count;
+  while (count > 0) {
+    const auto step = count / 2;
+    const auto middle = first + step;
+    if (getStringHash(middle) < sha1) {
+      first = middle + 1;
+      count -= step + 1;
+    } else {
+      count = step;
+    }
+  }
+  if (first == header_.string_hash_count || getStringHash(first) != sha1) {
+    return false;
+  }
+  filename = getFilename(header_.digest_count + first);
+  return true;
+}
+
+size_t FrozenBackupSet::size() const {
+  return header_.digest_count + header_.string_hash_count;
+}
+
+size_t FrozenBackupSet::memoryUsage() const {
+  return lookup_.capacity() * sizeof(uint64_t) + (owns_storage_ ? index_.size() : 0);
+}
+
+void FrozenBackupSet::write(std::ostream& os) const {
+  os.write(index_.data(), static_cast<std::streamsize>(index_.size()));
+}
+
+std::vector<std::string> FrozenBackupSet::getMissingFiles(const FrozenBackupSet& rhs) const {
+  return compare(rhs, false, nullptr).missing_files;
+}
+
+BackupSetDiff FrozenBackupSet::diff(const FrozenBackupSet& rhs, ThreadPool* pool) const {
+  return compare(rhs, true, pool);
+}
+
+BackupSetDiff FrozenBackupSet::compare(const FrozenBackupSet& rhs, bool extra, ThreadPool* pool) const {
+  TRACE_SCOPE("FrozenBackupSet::diff");
+  const auto lhs_filename = [this](size_t index) {
+    return getFilename(index);
+  };
+  const auto rhs_filename = [&rhs](size_t index) {
+    return rhs.getFilename(index);
+  };
+  const auto compare_digests = [this, &rhs](size_t lhs_index, size_t rhs_index) {
+    return std::memcmp(digests_ + lhs_index * Sha1Digest::Size, rhs.digests_ + rhs_index * Sha1Digest::Size, Sha1Digest::Size);
+  };
+
+  // Split the digests by leading byte, the same way BackupSet splits them
+  // into shards, and concatenate the results in order.
+  std::vector<BackupSetDiff> shard_diffs(BackupSet::ShardCount);
+  const auto diff_shard = [&](size_t shard_index) {
+    TRACE_SCOPE("diff shard");
+    auto& shard_diff = shard_diffs[shard_index];
+    mergeJoin(lowerBound(shard_index), lowerBound(shard_index + 1), rhs.lowerBound(shard_index), rhs.lowerBound(shard_index + 1),
+        compare_digests, lhs_filename, rhs_filename, &shard_diff.missing_files, extra ? &shard_diff.extra_files : nullptr);
+  };
+
+  if (pool) {
+    pool->parallelFor(BackupSet::ShardCount, diff_shard);
+  } else {
+    for (size_t i = 0; i < BackupSet::ShardCount; i++) {
+      diff_shard(i);
+    }
+  }
+
+  BackupSetDiff result;
+  size_t missing_count = 0;
+  size_t extra_count = 0;
+  for (const auto& shard_diff : shard_diffs) {
+    missing_count += shard_diff.missing_files.size();
+    extra_count += shard_diff.extra_files.size();
+  }
+  result.missing_files.reserve(missing_count);
+  result.extra_files.reserve(extra_count);
+  for (auto& shard_diff : shard_diffs) {
+    std::move(shard_diff.missing_files.begin(), shard_diff.missing_files.end(), std::back_inserter(result.missing_files));
+    std::move(shard_diff.extra_files.begin(), shard_diff.extra_files.end(), std::back_inserter(result.extra_files));
+  }
+
+  // Files keyed by string hashes follow the digests, as in BackupSet.
+  const auto compare_string_hashes = [this, &rhs](size_t lhs_index, size_t rhs_index) {
+    return getStringHash(lhs_index).compare(rhs.getStringHash(rhs_index));
+  };
+  const auto lhs_string_hash_filename = [this](size_t index) {
+    return getFilename(header_.digest_count + index);
+  };
+  const auto rhs_string_hash_filename = [&rhs](size_t index) {
+    return rhs.getFilename(rhs.header_.digest_count + index);
+  };
+  mergeJoin(0, header_.string_hash_count, 0, rhs.header_.string_hash_count, compare_string_hashes,
+      lhs_string_hash_filename, rhs_string_hash_filename, &result.missing_files, extra ? &result.extra_files : nullptr);
+  return result;
+}
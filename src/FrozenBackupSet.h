@@ -0,0 +1,121 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __FrozenBackupSet_h__
+#define __FrozenBackupSet_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BackupSet.h"
+#include "BackupSetIndex.h"
+#include "Sha1Digest.h"
+
+class ThreadPool;
+
+// An immutable backup set held in the flat layout of a binary index.
+// The digests are one sorted array and the lookup table of the index maps
+// the leading bits of a digest to the few digests which share them, so
+// finding a file touches one table entry and one or two cache lines of
+// digests. There are no map nodes or pointers, so a frozen set costs a
+// fraction of the memory of a BackupSet and is freed at once.
+//
+// A frozen set is built by freezing a loaded BackupSet, or opened from an
+// index file which is then used in place without copying. Either way it can
+// be written out as an index and opened again later. Indexes written before
+// the lookup table was added are still opened; their table is built when
+// they are.
+class FrozenBackupSet {
+ private:
+  // Keeps the index alive, either a mapped file or a buffer owned by the set.
+  std::shared_ptr<const void> storage_;
+  // Whether |storage_| is a buffer owned by the set rather than a file.
+  bool owns_storage_ = false;
+
+  std::string_view index_;
+  BackupSetIndexHeader header_;
+  const char* digests_ = nullptr;
+  const char* filename_offsets_ = nullptr;
+  const char* string_hash_offsets_ = nullptr;
+  std::string_view string_hashes_;
+  std::string_view filenames_;
+
+  // Where the digests for each entry of the lookup table start, followed by
+  // the number of digests. Taken from the index when it has a lookup table
+  // and built from the digests otherwise.
+  std::vector<uint64_t> lookup_;
+  uint32_t lookup_bits_ = 0;
+
+  FrozenBackupSet() = default;
+
+  // Use |index|, which is kept alive by |storage|, in place. Returns false if
+  // |index| is not a valid index.
+  bool attach(std::shared_ptr<const void> storage, std::string_view index);
+
+  // Compare the digest at |index| with |digest|, like memcmp.
+  int compareDigest(size_t index, const Sha1Digest& digest) const;
+
+  // Returns the filename of the file at |index|. Files keyed by digest come
+  // first, followed by files keyed by string hashes.
+  std::string_view getFilename(size_t index) const;
+
+  // Returns the string hash at |index|.
+  std::string_view getStringHash(size_t index) const;
+
+  // Returns the index of the first digest whose leading byte is at least
+  // |leading_byte|.
+  size_t lowerBound(size_t leading_byte) const;
+
+  // Compare this frozen set with |rhs|. Extra files are only gathered when
+  // |extra| is true.
+  BackupSetDiff compare(const FrozenBackupSet& rhs, bool extra, ThreadPool* pool) const;
+
+ public:
+  FrozenBackupSet(const FrozenBackupSet&) = delete;
+  FrozenBackupSet& operator=(const FrozenBackupSet&) = delete;
+  ~FrozenBackupSet() = default;
+
+  // Build a frozen copy of |backup_set|. The frozen set holds its own copy of
+  // every filename so |backup_set| can be destroyed afterwards.
+  static std::unique_ptr<FrozenBackupSet> freeze(const BackupSet& backup_set);
+
+  // Map the index file named |filename| and use it in place.
+  // Returns nullptr if the file cannot be mapped or is not a valid index.
+  // The whole index is checked once here so later lookups need not check.
+  static std::unique_ptr<FrozenBackupSet> open(const std::string& filename);
+
+  // Returns true if the file with |digest| is in the frozen set and sets
+  // |filename| to its name. The view is valid for the lifetime of the set.
+  bool find(const Sha1Digest& digest, std::string_view& filename) const;
+
+  // Like find(digest, filename), but |sha1| may also be a string hash which
+  // is not a valid digest.
+  bool find(std::string_view sha1, std::string_view& filename) const;
+
+  // Returns the number of files in the frozen set.
+  size_t size() const;
+
+  // Returns the number of bytes held by the frozen set. A mapped index is not
+  // included since its pages belong to the file.
+  size_t memoryUsage() const;
+
+  // Write the frozen set to |os| as a binary index, which may be opened
+  // again with open() or read into a BackupSet.
+  void write(std::ostream& os) const;
+
+  // Same as BackupSet::getMissingFiles.
+  std::vector<std::string> getMissingFiles(const FrozenBackupSet& rhs) const;
+
+  // Same as BackupSet::diff. When |pool| is not null, ranges of digests are
+  // compared in parallel on it.
+  BackupSetDiff diff(const FrozenBackupSet& rhs, ThreadPool* pool = nullptr) const;
+};
+
+#endif  // __FrozenBackupSet_h__
@@ -0,0 +1,165 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::~MappedFile() {
+  if (data_) {
+    UnmapViewOfFile(data_);
+  }
+  if (mapping_handle_) {
+    CloseHandle(mapping_handle_);
+  }
+  if (file_handle_) {
+    CloseHandle(file_handle_);
+  }
+}
+
+// static
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& filename) {
+  HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+
+  std::shared_ptr<MappedFile> mapped_file(new MappedFile());
+  mapped_file->file_handle_ = file;
+
+  LARGE_INTEGER size;
+  if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size)) {
+    return nullptr;
+  }
+
+  // Empty files cannot be mapped but there is nothing to read anyway.
+  if (size.QuadPart == 0) {
+    return mapped_file;
+  }
+
+  mapped_file->mapping_handle_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapped_file->mapping_handle_) {
+    return nullptr;
+  }
+
+  mapped_file->data_ = static_cast<const char*>(MapViewOfFile(mapped_file->mapping_handle_, FILE_MAP_READ, 0, 0, 0));
+  if (!mapped_file->data_) {
+    return nullptr;
+  }
+  mapped_file->size_ = static_cast<size_t>(size.QuadPart);
+  return mapped_file;
+}
+
+void MappedFile::evict() const {
+  // Unlocking pages which are not locked removes them from the working set.
+  if (data_) {
+    VirtualUnlock(const_cast<char*>(data_), size_);
+  }
+}
+
+bool MappedFile::read(size_t offset, size_t size, std::string& data) const {
+  data.resize(size);
+  size_t bytes_read = 0;
+  while (bytes_read < size) {
+    OVERLAPPED overlapped = {};
+    const auto position = static_cast<uint64_t>(offset + bytes_read);
+    overlapped.Offset = static_cast<DWORD>(position);
+    overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+    DWORD chunk_read;
+    const auto chunk_size = static_cast<DWORD>(std::min<size_t>(size - bytes_read, MAXDWORD));
+    if (!ReadFile(file_handle_, data.data() + bytes_read, chunk_size, &chunk_read, &overlapped) || chunk_read == 0) {
+      return false;
+    }
+    bytes_read += chunk_read;
+  }
+  return true;
+}
+
+#else
+
+MappedFile::~MappedFile() {
+  if (data_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+// static
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& filename) {
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return nullptr;
+  }
+
+  // The file stays open to read from it without the mapping.
+  std::shared_ptr<MappedFile> mapped_file(new MappedFile());
+  mapped_file->fd_ = fd;
+
+  // Empty files cannot be mapped but there is nothing to read anyway.
+  if (st.st_size == 0) {
+    return mapped_file;
+  }
+
+  const auto size = static_cast<size_t>(st.st_size);
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  // Backup sets are scanned front to back.
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  mapped_file->data_ = static_cast<const char*>(data);
+  mapped_file->size_ = size;
+  return mapped_file;
+}
+
+void MappedFile::evict() const {
+  if (data_) {
+    // The mapping is private and read-only so dropping its pages loses
+    // nothing.
+    madvise(const_cast<char*>(data_), size_, MADV_DONTNEED);
+  }
+}
+
+bool MappedFile::read(size_t offset, size_t size, std::string& data) const {
+  data.resize(size);
+  size_t bytes_read = 0;
+  while (bytes_read < size) {
+    const auto result = pread(fd_, data.data() + bytes_read, size - bytes_read, static_cast<off_t>(offset + bytes_read));
+    if (result <= 0) {
+      return false;
+    }
+    bytes_read += static_cast<size_t>(result);
+  }
+  return true;
+}
+
+#endif
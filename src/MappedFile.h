@@ -0,0 +1,61 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __MappedFile_h__
+#define __MappedFile_h__
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// A read-only view of the contents of a file mapped into memory.
+// The mapping is released when the MappedFile is destroyed.
+class MappedFile {
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+#if defined(_WIN32)
+  void* file_handle_ = nullptr;
+  void* mapping_handle_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+
+  MappedFile() = default;
+
+ public:
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  // Map the file named |filename| into memory.
+  // Returns nullptr if the file cannot be opened or is not a regular file
+  // which can be mapped (ie: a pipe). Callers should fall back to reading the
+  // file as a stream in that case.
+  static std::shared_ptr<MappedFile> open(const std::string& filename);
+
+  const char* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  std::string_view view() const {
+    return std::string_view(data_, size_);
+  }
+
+  // Drop the pages of the mapping from memory. The mapping stays valid and
+  // any page used again is read back from the file.
+  void evict() const;
+
+  // Read |size| bytes at |offset| in the file into |data| without touching
+  // the mapping. Returns false if the file could not be read.
+  bool read(size_t offset, size_t size, std::string& data) const;
+};
+
+#endif  // __MappedFile_h__
@@ -0,0 +1,243 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "OutputSink.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Trace.h"
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+OutputSink::OutputSink(int fd, bool owns_fd, bool use_thread, size_t buffer_size, size_t buffer_count) :
+    fd_(fd), owns_fd_(owns_fd), buffers_(std::max<size_t>(buffer_count, 2)) {
+  for (size_t i = 0; i < buffers_.size(); i++) {
+    buffers_[i].data.resize(std::max<size_t>(buffer_size, 1));
+    if (i != current_) {
+      free_buffers_.push_back(i);
+    }
+  }
+  useBuffer(current_);
+  if (use_thread) {
+    writer_ = std::thread(&OutputSink::runWriter, this);
+  }
+}
+
+OutputSink::~OutputSink() {
+  close();
+}
+
+// static
+std::unique_ptr<OutputSink> OutputSink::open(const std::string& filename, bool use_thread, size_t buffer_size, size_t buffer_count) {
+#if defined(_WIN32)
+  const int fd = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  const int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+#endif
+  if (fd < 0) {
+    return nullptr;
+  }
+  return std::unique_ptr<OutputSink>(new OutputSink(fd, true, use_thread, buffer_size, buffer_count));
+}
+
+// static
+std::unique_ptr<OutputSink> OutputSink::openStandardOutput(bool use_thread, size_t buffer_size, size_t buffer_count) {
+  return std::unique_ptr<OutputSink>(new OutputSink(1, false, use_thread, buffer_size, buffer_count));
+}
+
+bool OutputSink::writeBuffers(const std::vector<size_t>& indexes) {
+  TRACE_SCOPE("OutputSink::writeBuffers");
+#if defined(_WIN32)
+  for (const auto index : indexes) {
+    const auto& buffer = buffers_[index];
+    size_t written = 0;
+    while (written < buffer.size) {
+      const auto result = _write(fd_, buffer.data.data() + written, static_cast<unsigned>(std::min<size_t>(buffer.size - written, INT_MAX)));
+      if (result <= 0) {
+        return false;
+      }
+      written += static_cast<size_t>(result);
+    }
+  }
+  return true;
+#else
+  std::vector<iovec> iovecs;
+  iovecs.reserve(indexes.size());
+  for (const auto index : indexes) {
+    auto& buffer = buffers_[index];
+    if (buffer.size > 0) {
+      iovecs.push_back({buffer.data.data(), buffer.size});
+    }
+  }
+
+  // Keep going after partial writes, such as to a full pipe.
+  size_t first = 0;
+  while (first < iovecs.size()) {
+    const auto count = std::min<size_t>(iovecs.size() - first, IOV_MAX);
+    const auto result = writev(fd_, iovecs.data() + first, static_cast<int>(count));
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    auto written = static_cast<size_t>(result);
+    while (first < iovecs.size() && written >= iovecs[first].iov_len) {
+      written -= iovecs[first].iov_len;
+      first++;
+    }
+    if (written > 0) {
+      iovecs[first].iov_base = static_cast<char*>(iovecs[first].iov_base) + written;
+      iovecs[first].iov_len -= written;
+    }
+  }
+  return true;
+#endif
+}
+
+bool OutputSink::writeFullBuffers() {
+  const std::vector<size_t> indexes(full_buffers_.begin(), full_buffers_.end());
+  full_buffers_.clear();
+  const auto is_written = is_failed_ || writeBuffers(indexes);
+  for (const auto index : indexes) {
+    buffers_[index].size = 0;
+    free_buffers_.push_back(index);
+  }
+  is_failed_ = is_failed_ || !is_written;
+  return !is_failed_;
+}
+
+void OutputSink::runWriter() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    changed_.wait(lock, [this] { return is_stopping_ || !full_buffers_.empty(); });
+    if (full_buffers_.empty()) {
+      return;
+    }
+
+    // Take every full buffer so they go out in one call.
+    const std::vector<size_t> indexes(full_buffers_.begin(), full_buffers_.end());
+    full_buffers_.clear();
+    writing_count_ = indexes.size();
+    const auto is_failed = is_failed_;
+    lock.unlock();
+    const auto is_written = is_failed || writeBuffers(indexes);
+    lock.lock();
+    for (const auto index : indexes) {
+      buffers_[index].size = 0;
+      free_buffers_.push_back(index);
+    }
+    writing_count_ = 0;
+    is_failed_ = is_failed_ || !is_written;
+    changed_.notify_all();
+  }
+}
+
+void OutputSink::useBuffer(size_t index) {
+  current_ = index;
+  auto& buffer = buffers_[current_].data;
+  setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+bool OutputSink::rotate() {
+  buffers_[current_].size = static_cast<size_t>(pptr() - pbase());
+  std::unique_lock<std::mutex> lock(mutex_);
+  full_buffers_.push_back(current_);
+  if (writer_.joinable()) {
+    changed_.notify_all();
+    changed_.wait(lock, [this] { return is_failed_ || !free_buffers_.empty(); });
+  } else if (free_buffers_.empty()) {
+    writeFullBuffers();
+  }
+  if (is_failed_) {
+    // Leave no room so every later write fails too.
+    setp(nullptr, nullptr);
+    return false;
+  }
+  useBuffer(free_buffers_.front());
+  free_buffers_.pop_front();
+  return true;
+}
+
+OutputSink::int_type OutputSink::overflow(int_type ch) {
+  if (!pbase() || !rotate()) {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+int OutputSink::sync() {
+  if (!pbase()) {
+    return -1;
+  }
+  const auto size = static_cast<size_t>(pptr() - pbase());
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (size > 0) {
+    buffers_[current_].size = size;
+    full_buffers_.push_back(current_);
+  }
+  if (writer_.joinable()) {
+    changed_.notify_all();
+    changed_.wait(lock, [this] { return full_buffers_.empty() && writing_count_ == 0; });
+  } else {
+    writeFullBuffers();
+  }
+  if (is_failed_) {
+    setp(nullptr, nullptr);
+    return -1;
+  }
+  if (size > 0) {
+    useBuffer(free_buffers_.front());
+    free_buffers_.pop_front();
+  }
+  return 0;
+}
+
+bool OutputSink::close() {
+  if (fd_ < 0) {
+    return !is_failed_;
+  }
+  sync();
+  if (writer_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      is_stopping_ = true;
+    }
+    changed_.notify_all();
+    writer_.join();
+  }
+  if (owns_fd_) {
+#if defined(_WIN32)
+    const auto result = _close(fd_);
+#else
+    const auto result = ::close(fd_);
+#endif
+    is_failed_ = is_failed_ || result != 0;
+  }
+  fd_ = -1;
+  setp(nullptr, nullptr);
+  return !is_failed_;
+}
@@ -0,0 +1,103 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __OutputSink_h__
+#define __OutputSink_h__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A stream buffer which writes to a file descriptor through a few large
+// buffers. Full buffers are written together with one writev call, either
+// when every buffer is full or, with a writer thread, by a thread of its own
+// while the caller keeps filling the next buffer.
+// Use it behind a std::ostream:
+//   auto sink = OutputSink::open("out.txt");
+//   std::ostream os(sink.get());
+//   os << "line" << '\n';
+//   bool is_written = sink->close();
+// Writing std::endl or std::flush forces every buffer out, so end lines with
+// '\n' instead.
+class OutputSink : public std::streambuf {
+ public:
+  static constexpr size_t DefaultBufferSize = 1024 * 1024;
+  static constexpr size_t DefaultBufferCount = 4;
+
+ private:
+  struct Buffer {
+    std::vector<char> data;
+    size_t size = 0;
+  };
+
+  int fd_ = -1;
+  bool owns_fd_ = false;
+  std::vector<Buffer> buffers_;
+  // The buffer being filled through the put area.
+  size_t current_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  // Indexes of buffers ready to be filled and ready to be written.
+  std::deque<size_t> free_buffers_;
+  std::deque<size_t> full_buffers_;
+  // Buffers taken by the writer thread and not yet written.
+  size_t writing_count_ = 0;
+  bool is_failed_ = false;
+  bool is_stopping_ = false;
+  std::thread writer_;
+
+  OutputSink(int fd, bool owns_fd, bool use_thread, size_t buffer_size, size_t buffer_count);
+
+  // Queue the buffer being filled and start filling a free one. Returns false
+  // if a write has failed.
+  bool rotate();
+
+  // Write the buffers at |indexes| in order with one call. Returns false if
+  // they could not all be written.
+  bool writeBuffers(const std::vector<size_t>& indexes);
+
+  // Write every full buffer on the calling thread. Call with |mutex_| held.
+  bool writeFullBuffers();
+
+  // Fill the buffer at |index| next.
+  void useBuffer(size_t index);
+
+  void runWriter();
+
+ protected:
+  int_type overflow(int_type ch) override;
+  int sync() override;
+
+ public:
+  OutputSink(const OutputSink&) = delete;
+  OutputSink& operator=(const OutputSink&) = delete;
+  ~OutputSink() override;
+
+  // Create or truncate the file named |filename|. With |use_thread|, buffers
+  // are written by a thread of their own. Returns nullptr if the file cannot
+  // be created.
+  static std::unique_ptr<OutputSink> open(const std::string& filename, bool use_thread = false, size_t buffer_size = DefaultBufferSize,
+                                          size_t buffer_count = DefaultBufferCount);
+
+  // Write to the standard output of the process, which is left open. Flush
+  // std::cout before writing here and flush this before using std::cout
+  // again, so their output stays in order.
+  static std::unique_ptr<OutputSink> openStandardOutput(bool use_thread = false, size_t buffer_size = DefaultBufferSize,
+                                                        size_t buffer_count = DefaultBufferCount);
+
+  // Write everything buffered, stop the writer thread and close the file.
+  // Returns false if anything could not be written. Called by the destructor
+  // otherwise.
+  bool close();
+};
+
+#endif  // __OutputSink_h__
@@ -0,0 +1,377 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "ParseCache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "BackupSet.h"
+#include "BackupSetWriter.h"
+#include "Trace.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+namespace {
+
+constexpr auto SnapshotExtension = ".bsidx";
+constexpr auto RecordExtension = ".key";
+constexpr auto TemporaryExtension = ".tmp";
+constexpr auto RecordVersion = "backup_set parse cache 2";
+
+// Temporary files, and snapshots without a record, older than this were left
+// behind by a process which stopped while storing a snapshot.
+constexpr auto AbandonedTemporaryAge = std::chrono::hours(1);
+
+// Bytes hashed at each of the start, middle and end of a file for its
+// fingerprint. A change which keeps the size and modification time of a file
+// is only noticed if it touches one of these.
+constexpr size_t FingerprintSampleSize = 64 * 1024;
+
+// 64-bit FNV-1a, which unlike std::hash gives the same value in every build
+// so it can name files which outlive the process.
+constexpr uint64_t FnvOffsetBasis = 0xcbf29ce484222325ull;
+constexpr uint64_t FnvPrime = 0x100000001b3ull;
+
+uint64_t hashBytes(std::string_view bytes, uint64_t hash = FnvOffsetBasis) {
+  for (const auto c : bytes) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * FnvPrime;
+  }
+  return hash;
+}
+
+std::string toHex(uint64_t value) {
+  std::ostringstream oss;
+  oss << std::hex << std::setw(16) << std::setfill('0') << value;
+  return oss.str();
+}
+
+// Returns a name for a temporary file next to |path| which no other thread
+// or process writing the same path will use.
+std::filesystem::path getTemporaryPath(const std::filesystem::path& path) {
+  static std::atomic<uint64_t> counter{0};
+  const auto unique = hashBytes(std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + " " +
+      std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + " " + std::to_string(counter++));
+  auto temporary_path = path;
+  temporary_path += "." + toHex(unique) + TemporaryExtension;
+  return temporary_path;
+}
+
+// Set |device|, |inode| and |change_time| to those of the file named
+// |filename|. Returns false if they cannot be read.
+bool getFileIdentity(const std::string& filename, uint64_t& device, uint64_t& inode, int64_t& change_time) {
+#if defined(_WIN32)
+  const auto handle = CreateFileA(filename.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  BY_HANDLE_FILE_INFORMATION information;
+  FILE_BASIC_INFO basic_information;
+  const auto is_read = GetFileInformationByHandle(handle, &information) &&
+      GetFileInformationByHandleEx(handle, FileBasicInfo, &basic_information, sizeof(basic_information));
+  CloseHandle(handle);
+  if (!is_read) {
+    return false;
+  }
+  device = information.dwVolumeSerialNumber;
+  inode = (static_cast<uint64_t>(information.nFileIndexHigh) << 32) | information.nFileIndexLow;
+  // ChangeTime counts 100 nanosecond intervals.
+  change_time = basic_information.ChangeTime.QuadPart * 100;
+  return true;
+#else
+  struct stat status;
+  if (stat(filename.c_str(), &status) != 0) {
+    return false;
+  }
+  device = static_cast<uint64_t>(status.st_dev);
+  inode = static_cast<uint64_t>(status.st_ino);
+#if defined(__APPLE__)
+  const auto& change_timespec = status.st_ctimespec;
+#else
+  const auto& change_timespec = status.st_ctim;
+#endif
+  change_time = static_cast<int64_t>(change_timespec.tv_sec) * 1000000000 + change_timespec.tv_nsec;
+  return true;
+#endif
+}
+
+bool readRecord(const std::filesystem::path& path, ParseCacheKey& key) {
+  std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+  std::string version;
+  std::string fingerprint;
+  int is_validated = 0;
+  if (!std::getline(ifs, version) || version != RecordVersion) {
+    return false;
+  }
+  ifs >> key.size >> key.modified_time >> key.device >> key.inode >> key.change_time >> fingerprint >> is_validated;
+  // The path is last so it may hold spaces.
+  ifs.ignore(1);
+  if (!ifs || !std::getline(ifs, key.path)) {
+    return false;
+  }
+  const auto result = std::from_chars(fingerprint.data(), fingerprint.data() + fingerprint.size(), key.fingerprint, 16);
+  if (result.ec != std::errc() || result.ptr != fingerprint.data() + fingerprint.size()) {
+    return false;
+  }
+  key.is_validated = is_validated != 0;
+  return true;
+}
+
+bool writeRecord(const std::filesystem::path& path, const ParseCacheKey& key) {
+  std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+  ofs << RecordVersion << '\n'
+      << key.size << ' ' << key.modified_time << ' ' << key.device << ' ' << key.inode << ' ' << key.change_time << ' ' << toHex(key.fingerprint)
+      << ' ' << (key.is_validated ? 1 : 0) << '\n'
+      << key.path << '\n';
+  return static_cast<bool>(ofs.flush());
+}
+
+}  // namespace
+
+ParseCache::ParseCache(std::filesystem::path directory, uint64_t max_bytes) :
+    directory_(std::move(directory)), max_bytes_(max_bytes) {}
+
+// static
+std::unique_ptr<ParseCache> ParseCache::open(const std::string& directory, uint64_t max_bytes) {
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  if (!std::filesystem::is_directory(directory, error)) {
+    return nullptr;
+  }
+  return std::unique_ptr<ParseCache>(new ParseCache(directory, max_bytes));
+}
+
+// static
+bool ParseCache::makeKey(const std::string& filename, bool is_validated, ParseCacheKey& key) {
+  TRACE_SCOPE("ParseCache::makeKey");
+  std::error_code error;
+  if (!std::filesystem::is_regular_file(filename, error)) {
+    return false;
+  }
+  auto path = std::filesystem::weakly_canonical(filename, error);
+  if (error) {
+    path = std::filesystem::absolute(filename, error);
+  }
+  std::error_code size_error;
+  const auto size = std::filesystem::file_size(filename, size_error);
+  std::error_code time_error;
+  const auto modified_time = std::filesystem::last_write_time(filename, time_error);
+  if (error || size_error || time_error || !getFileIdentity(filename, key.device, key.inode, key.change_time)) {
+    return false;
+  }
+
+  std::ifstream ifs(filename, std::ifstream::in | std::ifstream::binary);
+  std::string sample(FingerprintSampleSize, '\0');
+  uint64_t fingerprint = FnvOffsetBasis;
+  const auto sample_offsets = size <= 3 * FingerprintSampleSize
+      ? std::vector<uint64_t>{0}
+      : std::vector<uint64_t>{0, size / 2 - FingerprintSampleSize / 2, size - FingerprintSampleSize};
+  for (const auto offset : sample_offsets) {
+    ifs.seekg(static_cast<std::streamoff>(offset));
+    // Small files are hashed whole.
+    const auto sample_size = size <= 3 * FingerprintSampleSize ? static_cast<size_t>(size) : FingerprintSampleSize;
+    sample.resize(sample_size);
+    if (!ifs.read(sample.data(), static_cast<std::streamsize>(sample_size))) {
+      return false;
+    }
+    fingerprint = hashBytes(sample, fingerprint);
+  }
+
+  key.path = path.string();
+  key.size = size;
+  key.modified_time = static_cast<int64_t>(modified_time.time_since_epoch().count());
+  key.fingerprint = fingerprint;
+  key.is_validated = is_validated;
+  return true;
+}
+
+std::filesystem::path ParseCache::getSnapshotPath(const ParseCacheKey& key) const {
+  // Each version of a file has a name of its own, so a store of one version
+  // never replaces the snapshot a record of another version names.
+  std::ostringstream oss;
+  oss << key.path << '\n'
+      << key.size << ' ' << key.modified_time << ' ' << key.device << ' ' << key.inode << ' ' << key.change_time << ' ' << key.fingerprint << ' '
+      << (key.is_validated ? 1 : 0);
+  return directory_ / (toHex(hashBytes(oss.str())) + SnapshotExtension);
+}
+
+std::filesystem::path ParseCache::getRecordPath(const ParseCacheKey& key) const {
+  // One record per file and validation mode.
+  return directory_ / (toHex(hashBytes(key.path + (key.is_validated ? "\n1" : "\n0"))) + RecordExtension);
+}
+
+void ParseCache::removeRecord(const std::filesystem::path& record_path) const {
+  std::error_code error;
+  ParseCacheKey cached_key;
+  if (readRecord(record_path, cached_key)) {
+    std::filesystem::remove(getSnapshotPath(cached_key), error);
+  }
+  std::filesystem::remove(record_path, error);
+}
+
+std::string ParseCache::find(const ParseCacheKey& key) const {
+  TRACE_SCOPE("ParseCache::find");
+  const auto record_path = getRecordPath(key);
+  const auto snapshot_path = getSnapshotPath(key);
+  std::error_code error;
+  if (!std::filesystem::exists(record_path, error)) {
+    return "";
+  }
+
+  ParseCacheKey cached_key;
+  if (!readRecord(record_path, cached_key) || cached_key != key || !std::filesystem::is_regular_file(snapshot_path, error)) {
+    removeRecord(record_path);
+    return "";
+  }
+
+  // Mark the snapshot as used for eviction.
+  std::filesystem::last_write_time(record_path, std::filesystem::file_time_type::clock::now(), error);
+  return snapshot_path.string();
+}
+
+bool ParseCache::store(const ParseCacheKey& key, const BackupSet& backup_set) {
+  TRACE_SCOPE("ParseCache::store");
+  const auto snapshot_path = getSnapshotPath(key);
+  const auto record_path = getRecordPath(key);
+  const auto temporary_snapshot_path = getTemporaryPath(snapshot_path);
+  const auto temporary_record_path = getTemporaryPath(record_path);
+  std::error_code error;
+
+  // Write both files aside and move them into place, so a reader never finds
+  // a partial snapshot. The snapshot goes first so a record never names a
+  // snapshot which is not there yet.
+  if (!BackupSetWriter(backup_set).writeIndexFile(temporary_snapshot_path.string()) || !writeRecord(temporary_record_path, key)) {
+    std::filesystem::remove(temporary_snapshot_path, error);
+    std::filesystem::remove(temporary_record_path, error);
+    return false;
+  }
+  std::filesystem::rename(temporary_snapshot_path, snapshot_path, error);
+  if (error) {
+    std::filesystem::remove(temporary_snapshot_path, error);
+    std::filesystem::remove(temporary_record_path, error);
+    return false;
+  }
+  ParseCacheKey replaced_key;
+  const auto is_replacing = readRecord(record_path, replaced_key) && replaced_key != key;
+  std::filesystem::rename(temporary_record_path, record_path, error);
+  if (error) {
+    std::filesystem::remove(temporary_record_path, error);
+    std::filesystem::remove(snapshot_path, error);
+    return false;
+  }
+  // Nothing names the snapshot of the version replaced any more.
+  if (is_replacing) {
+    std::filesystem::remove(getSnapshotPath(replaced_key), error);
+  }
+
+  evict(key);
+  return true;
+}
+
+void ParseCache::remove(const ParseCacheKey& key) const {
+  std::error_code error;
+  const auto record_path = getRecordPath(key);
+  ParseCacheKey cached_key;
+  if (readRecord(record_path, cached_key) && cached_key == key) {
+    std::filesystem::remove(record_path, error);
+  }
+  std::filesystem::remove(getSnapshotPath(key), error);
+}
+
+void ParseCache::evict(const ParseCacheKey& keep) {
+  TRACE_SCOPE("ParseCache::evict");
+  struct Snapshot {
+    std::filesystem::path record_path;
+    std::filesystem::path path;
+    std::filesystem::file_time_type last_used;
+    uint64_t size;
+  };
+  std::vector<Snapshot> snapshots;
+  std::vector<std::filesystem::path> unnamed_snapshot_paths;
+  std::unordered_set<std::string> named_snapshot_paths;
+  uint64_t total_size = 0;
+  std::error_code error;
+  const auto now = std::filesystem::file_time_type::clock::now();
+  const auto keep_path = getSnapshotPath(keep);
+  const auto is_abandoned = [&](const std::filesystem::path& path) {
+    std::error_code time_error;
+    const auto last_written = std::filesystem::last_write_time(path, time_error);
+    return !time_error && now - last_written > AbandonedTemporaryAge;
+  };
+
+  for (const auto& entry : std::filesystem::directory_iterator(directory_, error)) {
+    const auto& path = entry.path();
+    if (path.extension() == TemporaryExtension) {
+      if (is_abandoned(path)) {
+        std::filesystem::remove(path, error);
+      }
+    } else if (path.extension() == SnapshotExtension) {
+      unnamed_snapshot_paths.push_back(path);
+    } else if (path.extension() == RecordExtension) {
+      ParseCacheKey key;
+      std::error_code time_error;
+      std::error_code size_error;
+      if (!readRecord(path, key)) {
+        // Records are moved into place whole, so this one is from another
+        // version of the cache.
+        std::filesystem::remove(path, error);
+        continue;
+      }
+      Snapshot snapshot{path, getSnapshotPath(key), std::filesystem::last_write_time(path, time_error), 0};
+      snapshot.size = std::filesystem::file_size(snapshot.path, size_error);
+      if (time_error || size_error) {
+        continue;
+      }
+      named_snapshot_paths.insert(snapshot.path.string());
+      total_size += snapshot.size;
+      if (snapshot.path != keep_path) {
+        snapshots.push_back(std::move(snapshot));
+      }
+    }
+  }
+
+  // A snapshot is moved into place before the record which names it, so only
+  // remove snapshots which have had no record for a while.
+  for (const auto& path : unnamed_snapshot_paths) {
+    if (named_snapshot_paths.count(path.string()) == 0 && is_abandoned(path)) {
+      std::filesystem::remove(path, error);
+    }
+  }
+
+  std::sort(snapshots.begin(), snapshots.end(), [](const Snapshot& lhs, const Snapshot& rhs) {
+    return lhs.last_used < rhs.last_used;
+  });
+  for (const auto& snapshot : snapshots) {
+    if (total_size <= max_bytes_) {
+      break;
+    }
+    std::filesystem::remove(snapshot.record_path, error);
+    std::filesystem::remove(snapshot.path, error);
+    total_size -= snapshot.size;
+  }
+}
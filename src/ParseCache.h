@@ -0,0 +1,106 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __ParseCache_h__
+#define __ParseCache_h__
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+struct OrderedMapStorage;
+
+template <typename Storage>
+class BasicBackupSet;
+
+// What a backup set text file looked like when it was parsed.
+struct ParseCacheKey {
+  // Absolute path of the file.
+  std::string path;
+  uint64_t size = 0;
+  // Modification time in ticks of the filesystem clock.
+  int64_t modified_time = 0;
+  // Device and inode, or volume and file index, of the file. A file replaced
+  // by another one gets new ones.
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  // Time of the last change to the file or its metadata, in nanoseconds.
+  // Unlike the modification time, nothing can set it back, so it changes on
+  // every write even when the size and modification time are kept.
+  int64_t change_time = 0;
+  // Hash of the start, middle and end of the file.
+  uint64_t fingerprint = 0;
+  // Whether the file was parsed with validation, which rejects more lines.
+  bool is_validated = false;
+
+  bool operator==(const ParseCacheKey& rhs) const {
+    return path == rhs.path && size == rhs.size && modified_time == rhs.modified_time && device == rhs.device && inode == rhs.inode &&
+        change_time == rhs.change_time && fingerprint == rhs.fingerprint && is_validated == rhs.is_validated;
+  }
+
+  bool operator!=(const ParseCacheKey& rhs) const {
+    return !(*this == rhs);
+  }
+};
+
+// A directory of binary index snapshots of parsed backup set text files, so
+// a file which has not changed since it was last parsed is attached from its
+// snapshot without parsing it again.
+// Each file has a record of the ParseCacheKey it had when it was parsed, and
+// the snapshot is named after that whole key, so every version of a file has
+// a snapshot of its own. A record whose file no longer matches it is stale
+// and is removed with its snapshot when it is looked up. Once the snapshots
+// take more than the size limit, the least recently used ones are removed.
+// Safe to use from several threads and processes at once. When two of them
+// store different versions of the same file, the record stored last wins and
+// always names its own snapshot.
+class ParseCache {
+ public:
+  static constexpr uint64_t DefaultMaxBytes = static_cast<uint64_t>(4) << 30;
+
+ private:
+  std::filesystem::path directory_;
+  uint64_t max_bytes_;
+
+  ParseCache(std::filesystem::path directory, uint64_t max_bytes);
+
+  // Returns the path of the snapshot of the version of the file described by
+  // |key|, or of the record for the file.
+  std::filesystem::path getSnapshotPath(const ParseCacheKey& key) const;
+  std::filesystem::path getRecordPath(const ParseCacheKey& key) const;
+
+  // Remove the record at |record_path| and the snapshot it names.
+  void removeRecord(const std::filesystem::path& record_path) const;
+
+  // Remove the least recently used snapshots, other than the one for
+  // |keep|, until the rest fit within the size limit.
+  void evict(const ParseCacheKey& keep);
+
+ public:
+  // Use the directory named |directory|, which is created if needed, to hold
+  // at most |max_bytes| of snapshots. Returns nullptr if the directory
+  // cannot be created.
+  static std::unique_ptr<ParseCache> open(const std::string& directory, uint64_t max_bytes = DefaultMaxBytes);
+
+  // Describe the regular file named |filename| as it is now, parsed with or
+  // without |is_validated|. Returns false if it is not a regular file or
+  // cannot be read.
+  static bool makeKey(const std::string& filename, bool is_validated, ParseCacheKey& key);
+
+  // Returns the path of the snapshot for |key|, or an empty string if there
+  // is none. A snapshot of another version of the same file is removed.
+  std::string find(const ParseCacheKey& key) const;
+
+  // Store |backup_set|, parsed from the file described by |key|, as its
+  // snapshot and evict old snapshots. Returns false if the snapshot could
+  // not be written.
+  bool store(const ParseCacheKey& key, const BasicBackupSet<OrderedMapStorage>& backup_set);
+
+  // Remove the snapshot for |key|, such as one which could not be read.
+  void remove(const ParseCacheKey& key) const;
+};
+
+#endif  // __ParseCache_h__
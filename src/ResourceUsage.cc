@@ -0,0 +1,134 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "ResourceUsage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <ctime>
+
+#include <sys/resource.h>
+#endif
+
+#if defined(_WIN32)
+
+size_t getPeakResidentBytes() {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize;
+}
+
+bool resetPeakResidentBytes() {
+  return false;
+}
+
+double getProcessCpuSeconds() {
+  FILETIME creation_time;
+  FILETIME exit_time;
+  FILETIME kernel_time;
+  FILETIME user_time;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+    return 0;
+  }
+  // FILETIME counts 100 nanosecond intervals.
+  const auto toSeconds = [](const FILETIME& time) {
+    return static_cast<double>((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+  };
+  return toSeconds(kernel_time) + toSeconds(user_time);
+}
+
+double getThreadCpuSeconds() {
+  FILETIME creation_time;
+  FILETIME exit_time;
+  FILETIME kernel_time;
+  FILETIME user_time;
+  if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+    return 0;
+  }
+  const auto toSeconds = [](const FILETIME& time) {
+    return static_cast<double>((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+  };
+  return toSeconds(kernel_time) + toSeconds(user_time);
+}
+
+#elif defined(__linux__)
+
+size_t getPeakResidentBytes() {
+  // The high water mark in /proc can be reset, unlike the one getrusage
+  // reports.
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return static_cast<size_t>(std::stoull(line.substr(6))) * 1024;
+    }
+  }
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+}
+
+bool resetPeakResidentBytes() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  return static_cast<bool>(clear_refs << "5" << std::flush);
+}
+
+#else
+
+size_t getPeakResidentBytes() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  // MacOS reports bytes rather than kilobytes.
+  return static_cast<size_t>(usage.ru_maxrss);
+#else
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+bool resetPeakResidentBytes() {
+  return false;
+}
+
+#endif
+
+#if !defined(_WIN32)
+
+double getProcessCpuSeconds() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  const auto toSeconds = [](const timeval& time) {
+    return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_usec) / 1e6;
+  };
+  return toSeconds(usage.ru_utime) + toSeconds(usage.ru_stime);
+}
+
+double getThreadCpuSeconds() {
+  timespec time;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0) {
+    return 0;
+  }
+  return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_nsec) / 1e9;
+}
+
+#endif
@@ -0,0 +1,29 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __ResourceUsage_h__
+#define __ResourceUsage_h__
+
+#include <cstddef>
+
+// Returns the most memory the process has had resident at once, in bytes,
+// since it started or since resetPeakResidentBytes. Returns 0 if the
+// platform does not report it.
+size_t getPeakResidentBytes();
+
+// Start measuring the peak from the memory resident now, so the peak of one
+// phase of work can be measured on its own. Returns false if the platform
+// cannot, in which case the peak still covers the whole process.
+bool resetPeakResidentBytes();
+
+// Returns the user and system CPU time used by every thread of the process
+// so far, in seconds. Returns 0 if the platform does not report it.
+double getProcessCpuSeconds();
+
+// Returns the user and system CPU time used by the calling thread so far, in
+// seconds. Returns 0 if the platform does not report it.
+double getThreadCpuSeconds();
+
+#endif  // __ResourceUsage_h__
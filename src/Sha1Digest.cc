@@ -0,0 +1,207 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "Sha1Digest.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SHA1_DIGEST_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SHA1_DIGEST_TARGET_AVX2
+#else
+#define SHA1_DIGEST_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace {
+
+constexpr const char HexDigits[] = "0123456789abcdef";
+
+// Bit set in a HexTable entry for characters which are not hex digits.
+constexpr uint8_t InvalidHexBit = 0x80;
+
+// Maps every character to its hex value or InvalidHexBit.
+constexpr std::array<uint8_t, 256> makeHexTable() {
+  std::array<uint8_t, 256> table = {};
+  for (size_t c = 0; c < table.size(); c++) {
+    if (c >= '0' && c <= '9') {
+      table[c] = static_cast<uint8_t>(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      table[c] = static_cast<uint8_t>(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      table[c] = static_cast<uint8_t>(c - 'A' + 10);
+    } else {
+      table[c] = InvalidHexBit;
+    }
+  }
+  return table;
+}
+
+constexpr std::array<uint8_t, 256> HexTable = makeHexTable();
+
+// Each decoder reads exactly Sha1Digest::HexLength characters from |hex| and
+// writes Sha1Digest::Size bytes into |out|. Returns false if any character
+// is not a hex digit. None of them branch on the input characters.
+using DecodeFunction = bool (*)(const char* hex, uint8_t* out);
+
+bool decodeScalar(const char* hex, uint8_t* out) {
+  uint8_t invalid = 0;
+  for (size_t i = 0; i < Sha1Digest::Size; i++) {
+    const uint8_t high = HexTable[static_cast<uint8_t>(hex[i * 2])];
+    const uint8_t low = HexTable[static_cast<uint8_t>(hex[i * 2 + 1])];
+    invalid |= high | low;
+    out[i] = static_cast<uint8_t>((high << 4) | (low & 0xf));
+  }
+  return (invalid & InvalidHexBit) == 0;
+}
+
+#if defined(SHA1_DIGEST_X86)
+
+// Validate 16 hex characters in |chars| and convert them into 8 bytes held in
+// the low half of the result. |valid_mask| receives one bit per valid
+// character.
+inline __m128i decode16(__m128i chars, int& valid_mask) {
+  // Signed compares reject characters >= 0x80 in both ranges.
+  const __m128i digit = _mm_and_si128(
+      _mm_cmpgt_epi8(chars, _mm_set1_epi8('0' - 1)),
+      _mm_cmplt_epi8(chars, _mm_set1_epi8('9' + 1)));
+  // Setting 0x20 folds uppercase letters into lowercase ones.
+  const __m128i lower = _mm_or_si128(chars, _mm_set1_epi8(0x20));
+  const __m128i alpha = _mm_and_si128(
+      _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+  valid_mask = _mm_movemask_epi8(_mm_or_si128(digit, alpha));
+
+  const __m128i digit_values = _mm_and_si128(digit, _mm_sub_epi8(chars, _mm_set1_epi8('0')));
+  const __m128i alpha_values = _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+  const __m128i nibbles = _mm_or_si128(digit_values, alpha_values);
+
+  // Each 16-bit lane holds the high nibble in its low byte and the low nibble
+  // in its high byte. Combine them and pack the lanes down to bytes.
+  const __m128i high = _mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4);
+  const __m128i low = _mm_srli_epi16(nibbles, 8);
+  return _mm_packus_epi16(_mm_or_si128(high, low), _mm_setzero_si128());
+}
+
+bool decodeSse2(const char* hex, uint8_t* out) {
+  int mask0;
+  int mask1;
+  int mask2;
+  // The last load overlaps the second one so no load goes past the end of
+  // the hash. Bytes 12..15 are written twice with the same values.
+  const __m128i bytes0 = decode16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex)), mask0);
+  const __m128i bytes1 = decode16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + 16)), mask1);
+  const __m128i bytes2 = decode16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + 24)), mask2);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out), bytes0);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 8), bytes1);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 12), bytes2);
+  return (mask0 & mask1 & mask2) == 0xffff;
+}
+
+SHA1_DIGEST_TARGET_AVX2
+bool decodeAvx2(const char* hex, uint8_t* out) {
+  // Same steps as decode16 on the first 32 characters at once.
+  const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hex));
+  const __m256i digit = _mm256_and_si256(
+      _mm256_cmpgt_epi8(chars, _mm256_set1_epi8('0' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), chars));
+  const __m256i lower = _mm256_or_si256(chars, _mm256_set1_epi8(0x20));
+  const __m256i alpha = _mm256_and_si256(
+      _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+  const auto mask0 = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)));
+
+  const __m256i digit_values = _mm256_and_si256(digit, _mm256_sub_epi8(chars, _mm256_set1_epi8('0')));
+  const __m256i alpha_values = _mm256_and_si256(alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)));
+  const __m256i nibbles = _mm256_or_si256(digit_values, alpha_values);
+  const __m256i high = _mm256_slli_epi16(_mm256_and_si256(nibbles, _mm256_set1_epi16(0x00ff)), 4);
+  const __m256i low = _mm256_srli_epi16(nibbles, 8);
+  // Packing works within each 128-bit lane. Gather the two 8-byte halves
+  // into the low 16 bytes.
+  const __m256i packed = _mm256_packus_epi16(_mm256_or_si256(high, low), _mm256_setzero_si256());
+  const __m256i ordered = _mm256_permute4x64_epi64(packed, 0x08);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(ordered));
+
+  // The final 8 characters overlap the first 32 as in decodeSse2.
+  int mask1;
+  const __m128i bytes1 = decode16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + 24)), mask1);
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 12), bytes1);
+  return mask0 == 0xffffffffu && mask1 == 0xffff;
+}
+
+bool cpuSupportsAvx2() {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  __cpuid(info, 1);
+  // The OS must save the AVX registers (OSXSAVE and XCR0 bits 1 and 2).
+  const bool os_saves_avx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+  __cpuidex(info, 7, 0);
+  return os_saves_avx && (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool cpuSupportsSse2() {
+#if defined(__x86_64__) || defined(_M_X64)
+  return true;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#else
+  return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif  // SHA1_DIGEST_X86
+
+DecodeFunction selectDecodeFunction() {
+#if defined(SHA1_DIGEST_X86)
+  if (cpuSupportsAvx2()) {
+    return decodeAvx2;
+  }
+  if (cpuSupportsSse2()) {
+    return decodeSse2;
+  }
+#endif
+  return decodeScalar;
+}
+
+}  // namespace
+
+// static
+bool Sha1Digest::fromHex(std::string_view hex, Sha1Digest& digest) {
+  if (hex.size() != HexLength) {
+    return false;
+  }
+  // Pick the fastest decoder this CPU supports the first time through.
+  static const DecodeFunction decode = selectDecodeFunction();
+  return decode(hex.data(), digest.bytes.data());
+}
+
+void Sha1Digest::toHex(char* out) const {
+  for (size_t i = 0; i < Size; i++) {
+    out[i * 2] = HexDigits[bytes[i] >> 4];
+    out[i * 2 + 1] = HexDigits[bytes[i] & 0xf];
+  }
+}
+
+std::string Sha1Digest::toHex() const {
+  std::string hex(HexLength, '\0');
+  toHex(hex.data());
+  return hex;
+}
@@ -0,0 +1,48 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __Sha1Digest_h__
+#define __Sha1Digest_h__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// A sha1 hash stored as its packed 20-byte binary digest.
+// Ordering of digests matches the ordering of their lowercase hex-strings.
+struct Sha1Digest {
+  static constexpr size_t Size = 20;
+  static constexpr size_t HexLength = Size * 2;
+
+  std::array<uint8_t, Size> bytes;
+
+  // Decode the 40-character hex-string |hex| into |digest|.
+  // Hex characters are accepted in either case.
+  // Returns false if |hex| is not a valid sha1 hash. In that case |digest| is
+  // left in an unspecified state.
+  static bool fromHex(std::string_view hex, Sha1Digest& digest);
+
+  // Write the lowercase 40-character hex encoding of this digest into |out|.
+  void toHex(char* out) const;
+
+  // Return the lowercase 40-character hex encoding of this digest.
+  std::string toHex() const;
+
+  bool operator==(const Sha1Digest& rhs) const {
+    return bytes == rhs.bytes;
+  }
+
+  bool operator!=(const Sha1Digest& rhs) const {
+    return bytes != rhs.bytes;
+  }
+
+  bool operator<(const Sha1Digest& rhs) const {
+    return bytes < rhs.bytes;
+  }
+};
+
+#endif  // __Sha1Digest_h__
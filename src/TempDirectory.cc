@@ -0,0 +1,36 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "TempDirectory.h"
+
+#include <filesystem>
+#include <random>
+#include <string>
+#include <system_error>
+
+TempDirectory::TempDirectory(const std::string& prefix) {
+  std::random_device random;
+  std::error_code error;
+  const auto parent = std::filesystem::temp_directory_path(error);
+  if (error) {
+    return;
+  }
+  // Creating the directory fails if anything is already there, so a name
+  // picked by someone else is never used.
+  for (int attempt = 0; attempt < 16; attempt++) {
+    const auto path = parent / (prefix + std::to_string(random()));
+    if (std::filesystem::create_directory(path, error)) {
+      path_ = path;
+      return;
+    }
+  }
+}
+
+TempDirectory::~TempDirectory() {
+  if (!path_.empty()) {
+    std::error_code error;
+    std::filesystem::remove_all(path_, error);
+  }
+}
@@ -0,0 +1,32 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __TempDirectory_h__
+#define __TempDirectory_h__
+
+#include <filesystem>
+#include <string>
+
+// A new directory with a random name in the temporary directory, removed with
+// everything in it when destroyed. Files made inside it can't collide with
+// those of other processes, even when they use fixed names.
+class TempDirectory {
+ private:
+  std::filesystem::path path_;
+
+ public:
+  // Create a directory whose name starts with |prefix|.
+  explicit TempDirectory(const std::string& prefix);
+  TempDirectory(const TempDirectory&) = delete;
+  TempDirectory& operator=(const TempDirectory&) = delete;
+  ~TempDirectory();
+
+  // Returns an empty path if the directory could not be created.
+  const std::filesystem::path& path() const {
+    return path_;
+  }
+};
+
+#endif  // __TempDirectory_h__
@@ -0,0 +1,80 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+  thread_count = std::max<size_t>(thread_count, 1);
+  threads_.reserve(thread_count);
+  for (size_t i = 0; i < thread_count; i++) {
+    threads_.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_stopping_ = true;
+  }
+  task_available_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::workerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_available_.wait(lock, [this] { return is_stopping_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+
+    task();
+
+    bool is_done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      is_done = --pending_task_count_ == 0;
+    }
+    if (is_done) {
+      tasks_done_.notify_all();
+    }
+  }
+}
+
+void ThreadPool::parallelFor(size_t task_count, const std::function<void(size_t)>& task) {
+  if (task_count == 0) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < task_count; i++) {
+      tasks_.emplace_back([&task, i] { task(i); });
+    }
+    pending_task_count_ += task_count;
+  }
+  task_available_.notify_all();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  tasks_done_.wait(lock, [this] { return pending_task_count_ == 0; });
+}
+
+// static
+size_t ThreadPool::hardwareThreadCount() {
+  return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
@@ -0,0 +1,52 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __ThreadPool_h__
+#define __ThreadPool_h__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads which run batches of indexed tasks.
+class ThreadPool {
+ private:
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable task_available_;
+  std::condition_variable tasks_done_;
+  size_t pending_task_count_ = 0;
+  bool is_stopping_ = false;
+
+  void workerLoop();
+
+ public:
+  ThreadPool() = delete;
+  // Start |thread_count| worker threads. At least one thread is started.
+  explicit ThreadPool(size_t thread_count);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  // Returns the number of worker threads.
+  size_t size() const {
+    return threads_.size();
+  }
+
+  // Run |task(i)| for each i in [0, |task_count|) on the worker threads and
+  // wait for all of them to complete. Tasks may run in any order and must not
+  // call parallelFor on the same pool.
+  void parallelFor(size_t task_count, const std::function<void(size_t)>& task);
+
+  // Returns the number of hardware threads, or 1 if that is unknown.
+  static size_t hardwareThreadCount();
+};
+
+#endif  // __ThreadPool_h__
@@ -0,0 +1,163 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "Trace.h"
+
+#include <string>
+
+#if defined(BACKUP_SET_TRACING)
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Spans kept per thread. Older spans are overwritten once a thread has
+// recorded more than this.
+constexpr size_t RingBufferCapacity = 64 * 1024;
+
+struct TraceEvent {
+  const char* name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+};
+
+// The spans recorded by one thread. Only the owning thread writes to it.
+struct ThreadBuffer {
+  uint32_t thread_id;
+  std::vector<TraceEvent> events;
+  // Number of spans ever recorded, including overwritten ones.
+  std::atomic<uint64_t> event_count{0};
+
+  explicit ThreadBuffer(uint32_t id) :
+      thread_id(id), events(RingBufferCapacity) {}
+};
+
+// Buffers outlive their threads, which may be gone by the time the trace is
+// written, so they are owned here rather than by the threads.
+struct TraceRegistry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+};
+
+std::atomic<bool> is_enabled{false};
+thread_local ThreadBuffer* thread_buffer = nullptr;
+
+TraceRegistry& getRegistry() {
+  // Never destroyed so threads still running at exit can't outlive it.
+  static auto* registry = new TraceRegistry;
+  return *registry;
+}
+
+std::chrono::steady_clock::time_point getEpoch() {
+  static const auto epoch = std::chrono::steady_clock::now();
+  return epoch;
+}
+
+uint64_t nowNs() {
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - getEpoch()).count());
+}
+
+ThreadBuffer& getThreadBuffer() {
+  if (!thread_buffer) {
+    auto& registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.buffers.push_back(std::make_unique<ThreadBuffer>(static_cast<uint32_t>(registry.buffers.size())));
+    thread_buffer = registry.buffers.back().get();
+  }
+  return *thread_buffer;
+}
+
+}  // namespace
+
+TraceScope::TraceScope(const char* name) :
+    name_(is_enabled.load(std::memory_order_relaxed) ? name : nullptr), start_ns_(name_ ? nowNs() : 0) {}
+
+TraceScope::~TraceScope() {
+  if (!name_) {
+    return;
+  }
+  const auto end_ns = nowNs();
+  auto& buffer = getThreadBuffer();
+  const auto count = buffer.event_count.load(std::memory_order_relaxed);
+  buffer.events[count % RingBufferCapacity] = {name_, start_ns_, end_ns - start_ns_};
+  buffer.event_count.store(count + 1, std::memory_order_release);
+}
+
+// static
+bool Trace::isAvailable() {
+  return true;
+}
+
+// static
+void Trace::enable() {
+  // Register the calling thread first so it gets id 0.
+  getEpoch();
+  getThreadBuffer();
+  is_enabled.store(true, std::memory_order_relaxed);
+}
+
+// static
+bool Trace::writeChromeJson(const std::string& filename) {
+  std::ofstream ofs(filename, std::ofstream::out | std::ofstream::binary);
+  if (!ofs) {
+    return false;
+  }
+
+  auto& registry = getRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  bool is_first = true;
+  const auto separator = [&]() {
+    const auto* str = is_first ? "\n" : ",\n";
+    is_first = false;
+    return str;
+  };
+
+  // Chrome trace timestamps are in microseconds.
+  ofs << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  for (const auto& buffer : registry.buffers) {
+    ofs << separator() << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->thread_id
+        << ", \"args\": {\"name\": \"";
+    if (buffer->thread_id == 0) {
+      ofs << "main";
+    } else {
+      ofs << "thread " << buffer->thread_id;
+    }
+    ofs << "\"}}";
+    const auto count = buffer->event_count.load(std::memory_order_acquire);
+    const auto first = count > RingBufferCapacity ? count - RingBufferCapacity : 0;
+    for (auto i = first; i < count; i++) {
+      const auto& event = buffer->events[i % RingBufferCapacity];
+      ofs << separator() << "  {\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->thread_id
+          << ", \"ts\": " << static_cast<double>(event.start_ns) / 1000 << ", \"dur\": " << static_cast<double>(event.duration_ns) / 1000 << "}";
+    }
+  }
+  ofs << "\n]}\n";
+  return static_cast<bool>(ofs.flush());
+}
+
+#else
+
+// static
+bool Trace::isAvailable() {
+  return false;
+}
+
+// static
+void Trace::enable() {}
+
+// static
+bool Trace::writeChromeJson(const std::string&) {
+  return false;
+}
+
+#endif  // defined(BACKUP_SET_TRACING)
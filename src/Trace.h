@@ -0,0 +1,65 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __Trace_h__
+#define __Trace_h__
+
+#include <string>
+
+// Event tracing of the reader, diff and writer in Chrome trace format, which
+// chrome://tracing and Perfetto open. Tracing is compiled in only when
+// BACKUP_SET_TRACING is defined by the BACKUP_SET_TRACING cmake option.
+// Otherwise TRACE_SCOPE expands to nothing and the functions below do
+// nothing.
+//
+// Usage:
+//   Trace::enable();
+//   { TRACE_SCOPE("read"); ... }
+//   Trace::writeChromeJson("trace.json");
+class Trace {
+ public:
+  // Returns true if tracing was compiled in.
+  static bool isAvailable();
+
+  // Start recording spans on every thread. Until then, a TRACE_SCOPE costs
+  // one relaxed load.
+  static void enable();
+
+  // Write every span recorded so far as Chrome trace JSON to |filename|.
+  // Spans still open are not written. Call when no spans are being recorded.
+  // Returns false if the file could not be written.
+  static bool writeChromeJson(const std::string& filename);
+};
+
+#if defined(BACKUP_SET_TRACING)
+
+#include <cstdint>
+
+// Records the time from its construction to its destruction as a span named
+// |name| on the current thread. |name| must be a string literal or otherwise
+// outlive the trace.
+class TraceScope {
+ private:
+  const char* name_;
+  uint64_t start_ns_;
+
+ public:
+  explicit TraceScope(const char* name);
+  ~TraceScope();
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#else
+
+#define TRACE_SCOPE(name) static_cast<void>(0)
+
+#endif  // defined(BACKUP_SET_TRACING)
+
+#endif  // __Trace_h__
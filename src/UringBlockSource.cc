@@ -0,0 +1,382 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "UringBlockSource.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "Trace.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BACKUP_SET_HAS_URING
+#endif
+#endif
+
+#if defined(BACKUP_SET_HAS_URING)
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// O_DIRECT needs buffers, offsets and lengths aligned to the logical block
+// size of the device, which is at most a page.
+constexpr size_t DirectAlignment = 4096;
+
+size_t alignUp(size_t size) {
+  return (size + DirectAlignment - 1) / DirectAlignment * DirectAlignment;
+}
+
+UringBlockSource::DirectOpener direct_opener;
+
+int openDirect(const std::string& filename) {
+  if (direct_opener) {
+    return direct_opener(filename);
+  }
+  return ::open(filename.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+}
+
+int setUpRing(unsigned entries, io_uring_params& params) {
+  std::memset(&params, 0, sizeof(params));
+  const auto fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  // Plain reads need IORING_OP_READ, which arrived along with this feature.
+  if (fd >= 0 && !(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Submit |to_submit| queued reads and wait for |min_complete| completions.
+bool enterRing(int ring_fd, unsigned to_submit, unsigned min_complete) {
+  const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    const auto result = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+    if (result >= 0) {
+      return static_cast<unsigned>(result) == to_submit;
+    }
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+}  // namespace
+
+UringBlockSource::~UringBlockSource() {
+  // The kernel writes into the buffers until each read completes.
+  is_failed_ = true;
+  while (pending_count_ > 0 && reap()) {
+  }
+
+  for (auto& slot : slots_) {
+    std::free(slot.data);
+  }
+  if (sqes_) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+  if (direct_fd_ >= 0) {
+    close(direct_fd_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+// static
+bool UringBlockSource::isAvailable() {
+  static const bool is_available = [] {
+    io_uring_params params;
+    const auto fd = setUpRing(1, params);
+    if (fd < 0) {
+      return false;
+    }
+    close(fd);
+    return true;
+  }();
+  return is_available;
+}
+
+// static
+void UringBlockSource::setDirectOpener(DirectOpener opener) {
+  direct_opener = std::move(opener);
+}
+
+// static
+std::unique_ptr<UringBlockSource> UringBlockSource::open(const std::string& filename, size_t read_size, size_t queue_depth) {
+  if (!isAvailable()) {
+    return nullptr;
+  }
+  std::unique_ptr<UringBlockSource> source(new UringBlockSource());
+  if (!source->setUp(filename, read_size, queue_depth)) {
+    return nullptr;
+  }
+  return source;
+}
+
+bool UringBlockSource::setUp(const std::string& filename, size_t read_size, size_t queue_depth) {
+  fd_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  file_size_ = static_cast<uint64_t>(st.st_size);
+  // Filesystems without O_DIRECT, such as tmpfs, refuse it here. Others only
+  // refuse it once a read is made, which is handled in reap.
+  direct_fd_ = openDirect(filename);
+
+  io_uring_params params;
+  ring_fd_ = setUpRing(static_cast<unsigned>(std::max<size_t>(queue_depth, 1)), params);
+  if (ring_fd_ < 0) {
+    return false;
+  }
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    return false;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = nullptr;
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = nullptr;
+    return false;
+  }
+
+  auto* sq = static_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+  auto* cq = static_cast<char*>(cq_ring_);
+  cq_head_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+
+  read_size_ = alignUp(std::max<size_t>(read_size, 1));
+  slots_.resize(std::max<size_t>(queue_depth, 1));
+  for (auto& slot : slots_) {
+    slot.data = static_cast<char*>(std::aligned_alloc(DirectAlignment, read_size_));
+    if (!slot.data) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < slots_.size(); i++) {
+    if (!start(i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool UringBlockSource::isDirect() const {
+  return direct_fd_ >= 0;
+}
+
+bool UringBlockSource::submit(size_t slot_index) {
+  auto& slot = slots_[slot_index];
+  const auto remaining = slot.size - slot.filled;
+  // Direct reads must cover whole blocks. The buffer always has room as
+  // |read_size_| is aligned, and any bytes past the end are dropped.
+  slot.is_direct = isDirect();
+  const auto length = slot.is_direct ? std::min(alignUp(remaining), read_size_ - slot.filled) : remaining;
+
+  const auto tail = *sq_tail_;
+  const auto index = tail & sq_mask_;
+  auto& sqe = static_cast<io_uring_sqe*>(sqes_)[index];
+  std::memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_READ;
+  sqe.fd = slot.is_direct ? direct_fd_ : fd_;
+  sqe.off = slot.offset + slot.filled;
+  sqe.addr = reinterpret_cast<uint64_t>(slot.data + slot.filled);
+  sqe.len = static_cast<uint32_t>(length);
+  sqe.user_data = slot_index;
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+  slot.is_pending = true;
+  pending_count_++;
+  return enterRing(ring_fd_, 1, 0);
+}
+
+bool UringBlockSource::start(size_t slot_index) {
+  auto& slot = slots_[slot_index];
+  slot.filled = 0;
+  slot.consumed = 0;
+  slot.is_complete = false;
+  if (next_offset_ >= file_size_) {
+    slot.size = 0;
+    return true;
+  }
+  slot.offset = next_offset_;
+  slot.size = static_cast<size_t>(std::min<uint64_t>(read_size_, file_size_ - next_offset_));
+  next_offset_ += slot.size;
+  return submit(slot_index);
+}
+
+bool UringBlockSource::reap() {
+  TRACE_SCOPE("reap reads");
+  auto head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) && !enterRing(ring_fd_, 0, 1)) {
+    return false;
+  }
+
+  const auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const auto& cqe = static_cast<io_uring_cqe*>(cqes_)[head & cq_mask_];
+    auto& slot = slots_[static_cast<size_t>(cqe.user_data)];
+    const auto result = cqe.res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    slot.is_pending = false;
+    pending_count_--;
+    if (is_failed_) {
+      continue;
+    }
+
+    if (result < 0) {
+      if (result == -EINVAL && slot.is_direct) {
+        // The filesystem does not support direct reads after all. The other
+        // direct reads in flight fail the same way and are each resubmitted
+        // on |fd_| below, from where they left off.
+        if (isDirect()) {
+          close(direct_fd_);
+          direct_fd_ = -1;
+        }
+      } else if (result != -EAGAIN && result != -EINTR) {
+        is_failed_ = true;
+        continue;
+      }
+    } else if (result == 0) {
+      // The file was truncated while it was read.
+      slot.size = slot.filled;
+    } else {
+      slot.filled = std::min(slot.filled + static_cast<size_t>(result), slot.size);
+    }
+
+    if (slot.filled == slot.size) {
+      slot.is_complete = true;
+    } else if (!submit(static_cast<size_t>(cqe.user_data))) {
+      is_failed_ = true;
+    }
+  }
+  return true;
+}
+
+bool UringBlockSource::read(char* data, size_t capacity, size_t& size) {
+  size = 0;
+  while (size < capacity) {
+    auto& slot = slots_[next_slot_];
+    // Slots are started in file order, so an idle slot means the file ended.
+    if (!slot.is_pending && !slot.is_complete) {
+      break;
+    }
+    while (!slot.is_complete) {
+      if (is_failed_ || !reap()) {
+        return false;
+      }
+    }
+    if (is_failed_) {
+      return false;
+    }
+
+    const auto count = std::min(capacity - size, slot.filled - slot.consumed);
+    std::memcpy(data + size, slot.data + slot.consumed, count);
+    slot.consumed += count;
+    size += count;
+    if (slot.consumed == slot.filled) {
+      if (!start(next_slot_)) {
+        return false;
+      }
+      next_slot_ = (next_slot_ + 1) % slots_.size();
+    }
+  }
+  return true;
+}
+
+#else
+
+UringBlockSource::~UringBlockSource() = default;
+
+// static
+bool UringBlockSource::isAvailable() {
+  return false;
+}
+
+// static
+void UringBlockSource::setDirectOpener(DirectOpener) {
+}
+
+// static
+std::unique_ptr<UringBlockSource> UringBlockSource::open(const std::string&, size_t, size_t) {
+  return nullptr;
+}
+
+bool UringBlockSource::setUp(const std::string&, size_t, size_t) {
+  return false;
+}
+
+bool UringBlockSource::isDirect() const {
+  return false;
+}
+
+bool UringBlockSource::submit(size_t) {
+  return false;
+}
+
+bool UringBlockSource::start(size_t) {
+  return false;
+}
+
+bool UringBlockSource::reap() {
+  return false;
+}
+
+bool UringBlockSource::read(char*, size_t, size_t& size) {
+  size = 0;
+  return false;
+}
+
+#endif  // defined(BACKUP_SET_HAS_URING)
@@ -0,0 +1,120 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __UringBlockSource_h__
+#define __UringBlockSource_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BlockPipeline.h"
+
+// Reads a regular file through a Linux io_uring, keeping several large reads
+// in flight at once so a high latency volume, such as a network share, is
+// always busy. Reads go into aligned buffers and bypass the page cache with
+// O_DIRECT where the filesystem allows it, otherwise they are buffered.
+// Completed reads are handed out in file order.
+// The ring is driven with raw system calls, so no liburing is needed. On
+// other platforms, or kernels without io_uring, open returns nullptr and
+// callers should fall back to FileBlockSource.
+class UringBlockSource : public BlockSource {
+ public:
+  static constexpr size_t DefaultReadSize = 1024 * 1024;
+  static constexpr size_t DefaultQueueDepth = 4;
+
+  // Opens |filename| for direct reads, returning the descriptor or -1.
+  using DirectOpener = std::function<int(const std::string& filename)>;
+
+ private:
+  // One read and the buffer it fills.
+  struct Slot {
+    char* data = nullptr;
+    // Position of the read in the file and the bytes wanted from there.
+    uint64_t offset = 0;
+    size_t size = 0;
+    // Bytes read so far, and how many of those were handed out.
+    size_t filled = 0;
+    size_t consumed = 0;
+    // Whether the read in flight went to |direct_fd_|.
+    bool is_direct = false;
+    bool is_pending = false;
+    bool is_complete = false;
+  };
+
+  int ring_fd_ = -1;
+  // The file opened with and without O_DIRECT. Reads use |direct_fd_| until
+  // the filesystem rejects it.
+  int direct_fd_ = -1;
+  int fd_ = -1;
+  uint64_t file_size_ = 0;
+  size_t read_size_ = 0;
+
+  // The shared submission and completion rings.
+  void* sq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = nullptr;
+  size_t cq_ring_size_ = 0;
+  void* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  uint32_t* sq_head_ = nullptr;
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t sq_mask_ = 0;
+  uint32_t* sq_array_ = nullptr;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  uint32_t cq_mask_ = 0;
+  void* cqes_ = nullptr;
+
+  std::vector<Slot> slots_;
+  // The slot to hand out next. Slots are read in rotation.
+  size_t next_slot_ = 0;
+  // Where the next slot to be submitted starts in the file.
+  uint64_t next_offset_ = 0;
+  size_t pending_count_ = 0;
+  bool is_failed_ = false;
+
+  UringBlockSource() = default;
+
+  bool setUp(const std::string& filename, size_t read_size, size_t queue_depth);
+
+  // Queue the rest of the read for |slot| and submit it.
+  bool submit(size_t slot);
+
+  // Start reading the next part of the file into |slot|, if any is left.
+  bool start(size_t slot);
+
+  // Wait for at least one read to complete and process every completion.
+  bool reap();
+
+ public:
+  UringBlockSource(const UringBlockSource&) = delete;
+  UringBlockSource& operator=(const UringBlockSource&) = delete;
+  ~UringBlockSource() override;
+
+  // Returns true if the kernel supports io_uring and lets this process use it.
+  static bool isAvailable();
+
+  // Open the regular file named |filename| and start reading it with
+  // |queue_depth| reads of |read_size| bytes in flight. Returns nullptr if
+  // io_uring is unavailable or the file is not a regular file which can be
+  // opened.
+  static std::unique_ptr<UringBlockSource> open(const std::string& filename, size_t read_size = DefaultReadSize, size_t queue_depth = DefaultQueueDepth);
+
+  // Replace how files are opened for direct reads. Tests use this to stand in
+  // a descriptor whose reads fail the way an unsupported filesystem's do.
+  // An empty opener restores the O_DIRECT open.
+  static void setDirectOpener(DirectOpener opener);
+
+  // Returns true while reads bypass the page cache.
+  bool isDirect() const;
+
+  bool read(char* data, size_t capacity, size_t& size) override;
+};
+
+#endif  // __UringBlockSource_h__
@@ -0,0 +1,290 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BackupSet.h"
+#include "BackupSetReader.h"
+#include "BackupSetWriter.h"
+#include "ResourceUsage.h"
+#include "ThreadPool.h"
+#include "bench/BackupSetGenerator.h"
+#include "bench/BenchArgs.h"
+
+namespace {
+
+using Args = std::vector<std::string>;
+
+constexpr const auto OldFilename = "backup_set_bench_old.sha1.txt";
+constexpr const auto NewFilename = "backup_set_bench_new.sha1.txt";
+constexpr const auto TextOutputFilename = "backup_set_bench_out.sha1.txt";
+constexpr const auto IndexOutputFilename = "backup_set_bench_out.bsidx";
+constexpr const size_t DefaultThreadCount = 1;
+
+struct Options {
+  BackupSetGeneratorOptions generator;
+  size_t thread_count = DefaultThreadCount;
+  std::string directory = std::filesystem::temp_directory_path().string();
+  bool keep_files = false;
+  std::string generate_old_filename;
+  std::string generate_new_filename;
+};
+
+void printHelp() {
+  const BackupSetGeneratorOptions defaults;
+  std::cout << "Usage: backup_set_bench [--entries count] [--seed value] [--min-depth count] [--max-depth count] [--name-length mean] [--name-length-stddev value]" << std::endl;
+  std::cout << "                        [--files-per-directory count] [--churn percent] [--duplicates percent] [--threads count] [--directory path] [--keep]" << std::endl;
+  std::cout << "       backup_set_bench --generate old new [generator options]" << std::endl << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--entries count";
+  std::cout << "Number of files in the old backup set. Accepts K and M suffixes (Default: " << defaults.entry_count << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--seed value";
+  std::cout << "Seed for the generated backup sets (Default: " << defaults.seed << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--min-depth count";
+  std::cout << "Fewest directories above each file (Default: " << defaults.min_depth << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--max-depth count";
+  std::cout << "Most directories above each file (Default: " << defaults.max_depth << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--name-length mean";
+  std::cout << "Mean length of directory and file names (Default: " << defaults.mean_name_length << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--name-length-stddev value";
+  std::cout << "Standard deviation of the length of names (Default: " << defaults.name_length_stddev << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--files-per-directory count";
+  std::cout << "Number of files in each directory (Default: " << defaults.files_per_directory << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--churn percent";
+  std::cout << "Percentage of old files replaced in the new backup set (Default: " << defaults.churn_percent << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--duplicates percent";
+  std::cout << "Percentage of files with the same hash as an earlier file (Default: " << defaults.duplicate_percent << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--threads count";
+  std::cout << "Read, compare and write on count threads, 0 for one per hardware thread (Default: " << DefaultThreadCount << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--directory path";
+  std::cout << "Write the generated and output files into path (Default: the temporary directory)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--keep";
+  std::cout << "Keep the generated and output files (Default: off)." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--generate old new";
+  std::cout << "Only write the old and new backup sets to files old and new." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(30) << "--help";
+  std::cout << "Display this usage information" << std::endl;
+}
+
+// Parse |str| as a non-negative number into |value|.
+bool parseNumber(const std::string& str, double& value) {
+  char* end = nullptr;
+  value = std::strtod(str.c_str(), &end);
+  return !str.empty() && end == str.c_str() + str.size() && value >= 0;
+}
+
+void parseArgs(const Args& args, Options& options) {
+  auto& generator = options.generator;
+  for (auto iter = args.cbegin() + 1; iter != args.cend(); iter++) {
+    const auto& arg = *iter;
+    if (arg == "--keep") {
+      options.keep_files = true;
+      continue;
+    }
+    if (arg == "--help") {
+      printHelp();
+      exit(0);
+    }
+
+    // Every other option takes a value.
+    if (++iter == args.cend()) {
+      break;
+    }
+    const auto& value = *iter;
+    size_t count = 0;
+    bool is_valid = true;
+    if (arg == "--entries") {
+      is_valid = parseCount(value, generator.entry_count);
+    } else if (arg == "--seed") {
+      is_valid = parseCount(value, count);
+      generator.seed = count;
+    } else if (arg == "--min-depth") {
+      is_valid = parseCount(value, generator.min_depth);
+    } else if (arg == "--max-depth") {
+      is_valid = parseCount(value, generator.max_depth);
+    } else if (arg == "--name-length") {
+      is_valid = parseNumber(value, generator.mean_name_length);
+    } else if (arg == "--name-length-stddev") {
+      is_valid = parseNumber(value, generator.name_length_stddev);
+    } else if (arg == "--files-per-directory") {
+      is_valid = parseCount(value, generator.files_per_directory);
+    } else if (arg == "--churn") {
+      is_valid = parseNumber(value, generator.churn_percent);
+    } else if (arg == "--duplicates") {
+      is_valid = parseNumber(value, generator.duplicate_percent);
+    } else if (arg == "--threads") {
+      is_valid = parseCount(value, options.thread_count);
+      if (options.thread_count == 0) {
+        options.thread_count = ThreadPool::hardwareThreadCount();
+      }
+    } else if (arg == "--directory") {
+      options.directory = value;
+    } else if (arg == "--generate") {
+      options.generate_old_filename = value;
+      // If there is not another argument, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      options.generate_new_filename = *iter;
+    } else {
+      std::cout << "Unknown option: " << std::quoted(arg) << std::endl;
+      printHelp();
+      exit(-1);
+    }
+    if (!is_valid) {
+      std::cout << "Invalid value for " << arg << ": " << std::quoted(value) << std::endl;
+      printHelp();
+      exit(-1);
+    }
+  }
+}
+
+// Times one phase of the benchmark and prints its row when it ends.
+class Phase {
+ private:
+  std::string name_;
+  std::chrono::steady_clock::time_point start_;
+
+ public:
+  explicit Phase(std::string name) :
+      name_(std::move(name)) {
+    resetPeakResidentBytes();
+    start_ = std::chrono::steady_clock::now();
+  }
+
+  // Print the row for the phase, which processed |bytes| bytes making up
+  // |entries| files.
+  void end(uint64_t bytes, uint64_t entries) {
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    const auto megabytes = static_cast<double>(bytes) / (1024 * 1024);
+    std::cout << std::left << std::setw(14) << name_ << std::right << std::fixed << std::setprecision(3) << std::setw(10) << seconds
+              << std::setprecision(1) << std::setw(12) << megabytes / seconds << std::setprecision(0) << std::setw(14) << static_cast<double>(entries) / seconds
+              << std::setprecision(1) << std::setw(14) << static_cast<double>(getPeakResidentBytes()) / (1024 * 1024) << std::endl;
+  }
+
+  static void printHeader() {
+    std::cout << std::left << std::setw(14) << "phase" << std::right << std::setw(10) << "seconds" << std::setw(12) << "MB/s"
+              << std::setw(14) << "entries/s" << std::setw(14) << "peak RSS MB" << std::endl;
+  }
+};
+
+void generateFiles(const BackupSetGenerator& generator, const std::string& old_filename, const std::string& new_filename) {
+  std::ofstream old_file(old_filename, std::ofstream::out | std::ofstream::binary);
+  generator.writeOld(old_file);
+  std::ofstream new_file(new_filename, std::ofstream::out | std::ofstream::binary);
+  generator.writeNew(new_file);
+}
+
+// Read the file named |filename| into |backup_set| in place.
+void readFile(BackupSet& backup_set, const std::string& filename, const Options& options, bool validate) {
+  BackupSetReader reader(backup_set);
+  reader.setThreadCount(options.thread_count);
+  if (validate) {
+    reader.enableValidation();
+  }
+  if (!reader.readFile(filename)) {
+    std::cout << "Failed to read " << std::quoted(filename) << std::endl;
+    exit(-1);
+  }
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  Args args;
+  for (int i = 0; i < argc; i++) {
+    args.emplace_back(argv[i]);
+  }
+
+  Options options;
+  parseArgs(args, options);
+  const BackupSetGenerator generator(options.generator);
+
+  if (!options.generate_old_filename.empty()) {
+    if (options.generate_new_filename.empty()) {
+      std::cout << "--generate needs both an old and a new filename." << std::endl;
+      printHelp();
+      exit(-1);
+    }
+    generateFiles(generator, options.generate_old_filename, options.generate_new_filename);
+    return 0;
+  }
+
+  std::cout << "Backup set benchmark. Read, validate, compare and write generated backup sets of " << options.generator.entry_count
+            << " files with seed " << options.generator.seed << "." << std::endl << std::endl;
+  Phase::printHeader();
+
+  const auto directory = std::filesystem::path(options.directory);
+  const auto old_filename = (directory / OldFilename).string();
+  const auto new_filename = (directory / NewFilename).string();
+  const auto text_output_filename = (directory / TextOutputFilename).string();
+  const auto index_output_filename = (directory / IndexOutputFilename).string();
+  const uint64_t entry_count = options.generator.entry_count;
+
+  Phase generate("generate");
+  generateFiles(generator, old_filename, new_filename);
+  const auto old_bytes = std::filesystem::file_size(old_filename);
+  const auto new_bytes = std::filesystem::file_size(new_filename);
+  generate.end(old_bytes + new_bytes, entry_count * 2);
+
+  // Validation is timed on its own, on sets which are thrown away.
+  {
+    Phase validate("validate");
+    BackupSet old_set;
+    readFile(old_set, old_filename, options, true);
+    BackupSet new_set;
+    readFile(new_set, new_filename, options, true);
+    validate.end(old_bytes + new_bytes, entry_count * 2);
+  }
+
+  BackupSet old_set;
+  Phase read_old("read old");
+  readFile(old_set, old_filename, options, false);
+  read_old.end(old_bytes, entry_count);
+
+  BackupSet new_set;
+  Phase read_new("read new");
+  readFile(new_set, new_filename, options, false);
+  read_new.end(new_bytes, entry_count);
+
+  std::unique_ptr<ThreadPool> pool;
+  if (options.thread_count > 1) {
+    pool = std::make_unique<ThreadPool>(options.thread_count);
+  }
+  Phase diff_phase("diff");
+  const auto diff = old_set.diff(new_set, pool.get());
+  diff_phase.end(old_bytes + new_bytes, old_set.size() + new_set.size());
+
+  BackupSetWriter writer(new_set);
+  writer.setThreadCount(options.thread_count);
+  Phase write_text("write text");
+  writer.writeFile(text_output_filename);
+  write_text.end(std::filesystem::file_size(text_output_filename), new_set.size());
+
+  Phase write_index("write index");
+  writer.writeIndexFile(index_output_filename);
+  write_index.end(std::filesystem::file_size(index_output_filename), new_set.size());
+
+  std::cout << std::endl << "Found " << diff.missing_files.size() << " files in new but not in old and " << diff.extra_files.size()
+            << " files in old but not in new." << std::endl;
+
+  if (!options.keep_files) {
+    for (const auto& filename : {old_filename, new_filename, text_output_filename, index_output_filename}) {
+      std::filesystem::remove(filename);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "bench/BackupSetGenerator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+namespace {
+
+// Flush generated lines to the stream in chunks of about this size.
+constexpr size_t ChunkSize = 1024 * 1024;
+
+// Each choice made for a file draws from its own stream of random values.
+enum Stream : uint64_t {
+  DigestStream = 1,
+  DuplicateStream = 4,
+  DuplicateOfStream,
+  ChurnStream,
+  DepthStream,
+  DirectoryStream,
+  FileStream,
+  ExtensionStream,
+};
+
+constexpr const char* Extensions[] = {".jpg", ".png", ".txt", ".docx", ".pdf", ".mp4", ".cr2", ".xlsx"};
+
+// Each directory has about this many subdirectories.
+constexpr size_t DirectoryFanoutBits = 3;
+
+constexpr char HexDigits[] = "0123456789abcdef";
+
+uint64_t splitMix64(uint64_t value) {
+  value += 0x9e3779b97f4a7c15ull;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+  return value ^ (value >> 31);
+}
+
+// Returns a uniform value in [0, 1) taken from |value|.
+double toUnit(uint64_t value) {
+  return static_cast<double>(value >> 11) * (1.0 / 9007199254740992.0);
+}
+
+}  // namespace
+
+BackupSetGenerator::BackupSetGenerator(const BackupSetGeneratorOptions& options) :
+    options_(options) {
+  options_.max_depth = std::max(options_.min_depth, options_.max_depth);
+  options_.files_per_directory = std::max<size_t>(options_.files_per_directory, 1);
+  for (uint64_t id = 0; id < options_.entry_count; id++) {
+    if (isChurned(id)) {
+      churned_count_++;
+    }
+  }
+}
+
+uint64_t BackupSetGenerator::random(uint64_t stream, uint64_t value) const {
+  return splitMix64(splitMix64(options_.seed ^ (stream << 56)) ^ value);
+}
+
+bool BackupSetGenerator::isChurned(uint64_t id) const {
+  return toUnit(random(ChurnStream, id)) * 100 < options_.churn_percent;
+}
+
+void BackupSetGenerator::appendName(uint64_t value, std::string& out) const {
+  // The sum of four uniform values is close enough to normal and, unlike
+  // std::normal_distribution, is the same on every platform.
+  double sum = 0;
+  for (size_t i = 0; i < 4; i++) {
+    value = splitMix64(value);
+    sum += toUnit(value);
+  }
+  const auto normal = (sum - 2) * std::sqrt(3.0);
+  const auto length = static_cast<size_t>(std::clamp(options_.mean_name_length + normal * options_.name_length_stddev, 1.0, 64.0));
+  for (size_t i = 0; i < length; i++) {
+    value = splitMix64(value);
+    out.push_back(static_cast<char>((i == 0 ? 'A' : 'a') + value % 26));
+  }
+}
+
+void BackupSetGenerator::appendLine(uint64_t id, std::string& out) const {
+  // A duplicate has the hash of a file before it.
+  auto digest_id = id;
+  if (id > 0 && toUnit(random(DuplicateStream, id)) * 100 < options_.duplicate_percent) {
+    digest_id = random(DuplicateOfStream, id) % id;
+  }
+  for (uint64_t part = 0; part < 3; part++) {
+    auto bits = random(DigestStream + part, digest_id);
+    for (size_t i = 0; i < (part < 2 ? 16 : 8); i++) {
+      out.push_back(HexDigits[bits & 0xf]);
+      bits >>= 4;
+    }
+  }
+
+  // Directories at the same level share a name when they share a parent, so
+  // nearby directories share most of their path.
+  const auto directory = id / options_.files_per_directory;
+  const auto depth = options_.min_depth + random(DepthStream, directory) % (options_.max_depth - options_.min_depth + 1);
+  out += " c:";
+  for (size_t level = 0; level < depth; level++) {
+    const auto shift = (options_.max_depth - 1 - level) * DirectoryFanoutBits;
+    const auto ancestor = shift < 64 ? directory >> shift : 0;
+    out.push_back('\\');
+    appendName(random(DirectoryStream, (ancestor << 8) | level), out);
+  }
+  out.push_back('\\');
+  appendName(random(FileStream, id), out);
+  out += Extensions[random(ExtensionStream, id) % (sizeof(Extensions) / sizeof(Extensions[0]))];
+  out.push_back('\n');
+}
+
+void BackupSetGenerator::writeOld(std::ostream& os) const {
+  std::string chunk;
+  for (uint64_t id = 0; id < options_.entry_count; id++) {
+    appendLine(id, chunk);
+    if (chunk.size() >= ChunkSize) {
+      os.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+      chunk.clear();
+    }
+  }
+  os.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+}
+
+void BackupSetGenerator::writeNew(std::ostream& os) const {
+  // Churned files are dropped and as many new ones follow the rest.
+  std::string chunk;
+  for (uint64_t id = 0; id < options_.entry_count + churned_count_; id++) {
+    if (id < options_.entry_count && isChurned(id)) {
+      continue;
+    }
+    appendLine(id, chunk);
+    if (chunk.size() >= ChunkSize) {
+      os.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+      chunk.clear();
+    }
+  }
+  os.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+}
@@ -0,0 +1,77 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __bench_BackupSetGenerator_h__
+#define __bench_BackupSetGenerator_h__
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Shape of the backup sets made by BackupSetGenerator.
+struct BackupSetGeneratorOptions {
+  // Every file is derived from the seed and its position alone, so the same
+  // options always make the same backup sets on every platform.
+  uint64_t seed = 1;
+  // Number of files in the old backup set.
+  size_t entry_count = 1000000;
+  // Number of directories between the root and each file, picked uniformly
+  // for each directory.
+  size_t min_depth = 2;
+  size_t max_depth = 8;
+  // Length of each directory and file name, roughly normally distributed.
+  double mean_name_length = 10;
+  double name_length_stddev = 4;
+  // Number of consecutive files in each directory.
+  size_t files_per_directory = 20;
+  // Percentage of the old files missing from the new backup set. As many
+  // other files are added to it in their place.
+  double churn_percent = 10;
+  // Percentage of files with the same contents, and so the same hash, as
+  // some file before them.
+  double duplicate_percent = 2;
+};
+
+// Makes realistic old and new backup sets for benchmarks. Neighboring files
+// share directories and neighboring directories share parents, as in a real
+// file system, and the new backup set is the old one with some files
+// replaced. Backup sets are written out a line at a time so sets far larger
+// than memory can be made.
+class BackupSetGenerator {
+ private:
+  BackupSetGeneratorOptions options_;
+  // Number of old files missing from the new backup set.
+  size_t churned_count_ = 0;
+
+  // Returns a well mixed 64-bit value for |value| in the stream |stream|.
+  uint64_t random(uint64_t stream, uint64_t value) const;
+
+  // Returns true if the old file |id| is missing from the new backup set.
+  bool isChurned(uint64_t id) const;
+
+  // Append a name made of letters, picked by |value|, to |out|.
+  void appendName(uint64_t value, std::string& out) const;
+
+  // Append the line for file |id| to |out|.
+  void appendLine(uint64_t id, std::string& out) const;
+
+ public:
+  explicit BackupSetGenerator(const BackupSetGeneratorOptions& options);
+
+  // Write the old backup set to |os|.
+  void writeOld(std::ostream& os) const;
+
+  // Write the new backup set to |os|.
+  void writeNew(std::ostream& os) const;
+
+  // Returns the number of old files replaced by others in the new backup
+  // set.
+  size_t churnedCount() const {
+    return churned_count_;
+  }
+};
+
+#endif  // __bench_BackupSetGenerator_h__
@@ -0,0 +1,242 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BackupSet.h"
+#include "BackupSetReader.h"
+#include "BackupSetStorage.h"
+#include "BackupSetWriter.h"
+#include "ThreadPool.h"
+#include "bench/BackupSetGenerator.h"
+#include "bench/BenchArgs.h"
+
+namespace {
+
+using Args = std::vector<std::string>;
+
+constexpr const auto DefaultSizes = "1M,10M,50M";
+constexpr const auto DefaultStorages = "map,hash,vector,swiss";
+constexpr const size_t DefaultThreadCount = 1;
+
+struct Options {
+  std::vector<size_t> sizes;
+  std::vector<std::string> storages;
+  size_t thread_count = DefaultThreadCount;
+};
+
+void printHelp() {
+  std::cout << "Usage: backup_set_storage_bench [--sizes list] [--storage list] [--threads count]" << std::endl << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--sizes list";
+  std::cout << "Comma separated entry counts to run with. Accepts K and M suffixes (Default: " << DefaultSizes << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--storage list";
+  std::cout << "Comma separated storage policies from map, hash, vector and swiss (Default: " << DefaultStorages << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--threads count";
+  std::cout << "Load, compare and write on count threads, 0 for one per hardware thread (Default: " << DefaultThreadCount << ")." << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(20) << "--help";
+  std::cout << "Display this usage information" << std::endl;
+}
+
+// Split |str| at each comma.
+std::vector<std::string> splitList(const std::string& str) {
+  std::vector<std::string> items;
+  size_t start = 0;
+  while (start <= str.size()) {
+    auto end = str.find(',', start);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    items.push_back(str.substr(start, end - start));
+    start = end + 1;
+  }
+  return items;
+}
+
+void parseArgs(const Args& args, Options& options) {
+  std::string sizes = DefaultSizes;
+  std::string storages = DefaultStorages;
+  for (auto iter = args.cbegin() + 1; iter != args.cend(); iter++) {
+    const auto& arg = *iter;
+    if (arg == "--sizes") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      sizes = *iter;
+    } else if (arg == "--storage") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      storages = *iter;
+    } else if (arg == "--threads") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      if (!parseCount(*iter, options.thread_count)) {
+        std::cout << "Invalid thread count: " << std::quoted(*iter) << std::endl;
+        printHelp();
+        exit(-1);
+      }
+      if (options.thread_count == 0) {
+        options.thread_count = ThreadPool::hardwareThreadCount();
+      }
+    } else if (arg == "--help") {
+      printHelp();
+      exit(0);
+    } else {
+      std::cout << "Unknown option: " << std::quoted(arg) << std::endl;
+      printHelp();
+      exit(-1);
+    }
+  }
+
+  for (const auto& size : splitList(sizes)) {
+    size_t count;
+    if (!parseCount(size, count)) {
+      std::cout << "Invalid size: " << std::quoted(size) << std::endl;
+      printHelp();
+      exit(-1);
+    }
+    options.sizes.push_back(count);
+  }
+  for (const auto& storage : splitList(storages)) {
+    if (storage != "map" && storage != "hash" && storage != "vector" && storage != "swiss") {
+      std::cout << "Unknown storage: " << std::quoted(storage) << std::endl;
+      printHelp();
+      exit(-1);
+    }
+    options.storages.push_back(storage);
+  }
+}
+
+// Discards everything written to it, counting the bytes.
+class NullBuffer : public std::streambuf {
+ private:
+  size_t size_ = 0;
+
+ protected:
+  int_type overflow(int_type ch) override {
+    size_++;
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char*, std::streamsize size) override {
+    size_ += static_cast<size_t>(size);
+    return size;
+  }
+
+ public:
+  size_t size() const {
+    return size_;
+  }
+};
+
+// Make the old and new backup sets of |size| files each with the default
+// shape of BackupSetGenerator.
+void makeBackupSets(size_t size, std::string& old_buffer, std::string& new_buffer) {
+  BackupSetGeneratorOptions generator_options;
+  generator_options.entry_count = size;
+  const BackupSetGenerator generator(generator_options);
+  std::ostringstream old_stream;
+  generator.writeOld(old_stream);
+  old_buffer = old_stream.str();
+  std::ostringstream new_stream;
+  generator.writeNew(new_stream);
+  new_buffer = new_stream.str();
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Load, compare and write the backup sets in |Storage|, and print a row of
+// timings.
+template <typename Storage>
+void runStorage(const std::string& name, const std::string& old_buffer, const std::string& new_buffer, const Options& options) {
+  std::unique_ptr<ThreadPool> pool;
+  if (options.thread_count > 1) {
+    pool = std::make_unique<ThreadPool>(options.thread_count);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  BasicBackupSet<Storage> old_set;
+  BasicBackupSet<Storage> new_set;
+  {
+    BasicBackupSetReader<Storage> old_reader(old_set);
+    old_reader.setThreadCount(options.thread_count);
+    old_reader.read(std::string_view(old_buffer));
+    BasicBackupSetReader<Storage> new_reader(new_set);
+    new_reader.setThreadCount(options.thread_count);
+    new_reader.read(std::string_view(new_buffer));
+  }
+  const auto load_seconds = secondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  const auto diff = old_set.diff(new_set, pool.get());
+  const auto diff_seconds = secondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  NullBuffer null_buffer;
+  std::ostream os(&null_buffer);
+  BasicBackupSetWriter<Storage> writer(new_set);
+  writer.setThreadCount(options.thread_count);
+  writer.write(os);
+  writer.writeIndex(os);
+  const auto write_seconds = secondsSince(start);
+
+  const auto usage = new_set.memoryUsage();
+  const auto bytes_per_file = static_cast<double>(usage.node_bytes) / static_cast<double>(usage.file_count);
+
+  std::cout << std::left << std::setw(8) << name << std::right << std::setw(12) << old_set.size() << std::fixed << std::setprecision(3)
+            << std::setw(10) << load_seconds << std::setw(10) << diff_seconds << std::setw(10) << write_seconds
+            << std::setprecision(1) << std::setw(14) << bytes_per_file << std::setw(10) << diff.missing_files.size() << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, const char** argv) {
+  Args args;
+  for (int i = 0; i < argc; i++) {
+    args.emplace_back(argv[i]);
+  }
+
+  Options options;
+  parseArgs(args, options);
+
+  std::cout << "Backup set storage benchmark. Load both sets, compare them and write the new one as text and as an index." << std::endl << std::endl;
+  std::cout << std::left << std::setw(8) << "storage" << std::right << std::setw(12) << "files" << std::setw(10) << "load s"
+            << std::setw(10) << "diff s" << std::setw(10) << "write s" << std::setw(14) << "bytes/file" << std::setw(10) << "missing" << std::endl;
+
+  std::string old_buffer;
+  std::string new_buffer;
+  for (const auto size : options.sizes) {
+    makeBackupSets(size, old_buffer, new_buffer);
+    for (const auto& storage : options.storages) {
+      if (storage == "map") {
+        runStorage<OrderedMapStorage>(storage, old_buffer, new_buffer, options);
+      } else if (storage == "hash") {
+        runStorage<HashMapStorage>(storage, old_buffer, new_buffer, options);
+      } else if (storage == "vector") {
+        runStorage<SortedVectorStorage>(storage, old_buffer, new_buffer, options);
+      } else {
+        runStorage<SwissTableStorage>(storage, old_buffer, new_buffer, options);
+      }
+    }
+  }
+  return 0;
+}
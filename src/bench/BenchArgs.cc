@@ -0,0 +1,29 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include "bench/BenchArgs.h"
+
+#include <charconv>
+#include <cstddef>
+#include <string>
+#include <system_error>
+
+bool parseCount(std::string str, size_t& count) {
+  size_t multiplier = 1;
+  if (!str.empty() && (str.back() == 'K' || str.back() == 'k')) {
+    multiplier = 1000;
+    str.pop_back();
+  } else if (!str.empty() && (str.back() == 'M' || str.back() == 'm')) {
+    multiplier = 1000 * 1000;
+    str.pop_back();
+  }
+  const char* end = str.data() + str.size();
+  const auto result = std::from_chars(str.data(), end, count);
+  if (result.ec != std::errc() || result.ptr != end) {
+    return false;
+  }
+  count *= multiplier;
+  return true;
+}
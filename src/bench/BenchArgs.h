@@ -0,0 +1,15 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __bench_BenchArgs_h__
+#define __bench_BenchArgs_h__
+
+#include <cstddef>
+#include <string>
+
+// Parse |str| as a count with an optional K or M suffix into |count|.
+bool parseCount(std::string str, size_t& count);
+
+#endif  // __bench_BenchArgs_h__
@@ -0,0 +1,161 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include "test/AllocationTracker.h"
+
+namespace {
+
+// Relaxed counters are enough: totals are only read between pieces of work
+// which have already been joined.
+std::atomic<size_t> allocation_count{0};
+std::atomic<size_t> deallocation_count{0};
+std::atomic<size_t> allocated_bytes{0};
+
+void* allocate(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void* allocateAligned(size_t size, std::align_val_t alignment) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  const auto align = static_cast<size_t>(alignment);
+#if defined(_WIN32)
+  return _aligned_malloc(size == 0 ? 1 : size, align);
+#else
+  // aligned_alloc needs the size to be a non-zero multiple of the alignment.
+  return std::aligned_alloc(align, ((size == 0 ? 1 : size) + align - 1) / align * align);
+#endif
+}
+
+void deallocate(void* ptr) {
+  if (ptr != nullptr) {
+    deallocation_count.fetch_add(1, std::memory_order_relaxed);
+    std::free(ptr);
+  }
+}
+
+void deallocateAligned(void* ptr) {
+  if (ptr != nullptr) {
+    deallocation_count.fetch_add(1, std::memory_order_relaxed);
+#if defined(_WIN32)
+    _aligned_free(ptr);
+#else
+    std::free(ptr);
+#endif
+  }
+}
+
+}  // namespace
+
+// static
+AllocationStats AllocationTracker::get() {
+  AllocationStats stats;
+  stats.allocation_count = allocation_count.load(std::memory_order_relaxed);
+  stats.deallocation_count = deallocation_count.load(std::memory_order_relaxed);
+  stats.allocated_bytes = allocated_bytes.load(std::memory_order_relaxed);
+  return stats;
+}
+
+// The replaceable global allocation functions. Operator new must report
+// failure with std::bad_alloc, unlike the rest of the code base.
+
+void* operator new(size_t size) {
+  if (auto* ptr = allocate(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+  if (auto* ptr = allocate(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return allocate(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  if (auto* ptr = allocateAligned(size, alignment)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  if (auto* ptr = allocateAligned(size, alignment)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return allocateAligned(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return allocateAligned(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  deallocateAligned(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  deallocateAligned(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+  deallocateAligned(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+  deallocateAligned(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  deallocateAligned(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+  deallocateAligned(ptr);
+}
@@ -0,0 +1,48 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __test_AllocationTracker_h__
+#define __test_AllocationTracker_h__
+
+#include <cstddef>
+
+struct AllocationStats {
+  size_t allocation_count = 0;
+  size_t deallocation_count = 0;
+  // Total bytes requested by the allocations.
+  size_t allocated_bytes = 0;
+};
+
+// Counts every call to the global operator new and delete on any thread.
+// AllocationTracker.cc replaces the global operators, so only binaries which
+// link it, like test_runner, are instrumented.
+class AllocationTracker {
+ public:
+  // Returns the totals since the process started.
+  static AllocationStats get();
+};
+
+// Counts the allocations made while it is alive, like AutostartStopwatch
+// does for time.
+class AllocationCounter {
+ private:
+  AllocationStats start_ = AllocationTracker::get();
+
+ public:
+  AllocationStats elapsed() const {
+    const auto now = AllocationTracker::get();
+    AllocationStats stats;
+    stats.allocation_count = now.allocation_count - start_.allocation_count;
+    stats.deallocation_count = now.deallocation_count - start_.deallocation_count;
+    stats.allocated_bytes = now.allocated_bytes - start_.allocated_bytes;
+    return stats;
+  }
+
+  size_t allocationCount() const {
+    return elapsed().allocation_count;
+  }
+};
+
+#endif  // __test_AllocationTracker_h__
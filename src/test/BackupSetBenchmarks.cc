@@ -0,0 +1,163 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BackupSet.h"
+#include "BackupSetReader.h"
+#include "BackupSetWriter.h"
+#include "TempDirectory.h"
+#include "UringBlockSource.h"
+#include "bench/BackupSetGenerator.h"
+#include "test/TestCase.h"
+#include "test/TestCaseData.h"
+
+struct BackupSetBenchmarkData : TestCaseData {
+  size_t entry_count;
+
+  BackupSetBenchmarkData(size_t entry_count) : entry_count(entry_count) {}
+};
+
+std::vector<BackupSetBenchmarkData> backup_set_benchmarks = {
+  {10000},
+  {100000},
+};
+
+class BackupSetBenchmark : public TestCase {
+ protected:
+  // Returns the generated old or new backup set of |entry_count| files as
+  // text.
+  std::string generate(size_t entry_count, bool is_new) {
+    BackupSetGeneratorOptions options;
+    options.entry_count = entry_count;
+    const BackupSetGenerator generator(options);
+    std::ostringstream oss;
+    if (is_new) {
+      generator.writeNew(oss);
+    } else {
+      generator.writeOld(oss);
+    }
+    return oss.str();
+  }
+
+  void read(BackupSet& backup_set, const std::string& text) {
+    BackupSetReader reader(backup_set);
+    reader.read(std::string_view(text));
+  }
+};
+
+BENCHMARK_CASE_WITH_DATA(BackupSetBenchmark, reader, BackupSetBenchmarkData, backup_set_benchmarks) {
+  const auto text = generate(data.entry_count, false);
+  size_t file_count = 0;
+  benchmark.setBytesPerIteration(text.size());
+  benchmark.setItemsPerIteration(data.entry_count);
+  benchmark.run(std::to_string(data.entry_count), [&] {
+    BackupSet backup_set;
+    read(backup_set, text);
+    file_count = backup_set.size();
+  });
+  assert.equal(file_count > 0, true);
+}
+
+// Reads the same file with each input backend. The file is written once so
+// it is in the page cache, except for direct io_uring reads which bypass it.
+BENCHMARK_CASE_WITH_DATA(BackupSetBenchmark, reader_file, BackupSetBenchmarkData, backup_set_benchmarks) {
+  const auto text = generate(data.entry_count, false);
+  const TempDirectory directory("backup_set_benchmark_");
+  const auto path = (directory.path() / (std::to_string(data.entry_count) + ".sha1.txt")).string();
+  {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << text;
+  }
+  const auto run = [&](const std::string& backend, const auto& function) {
+    benchmark.setBytesPerIteration(text.size());
+    benchmark.setItemsPerIteration(data.entry_count);
+    benchmark.run(std::to_string(data.entry_count) + " " + backend, function);
+  };
+
+  size_t file_count = 0;
+  run("istream", [&] {
+    BackupSet backup_set;
+    std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+    BackupSetReader(backup_set).read(ifs);
+    file_count = backup_set.size();
+  });
+  run("mmap", [&] {
+    BackupSet backup_set;
+    BackupSetReader(backup_set).readFile(path);
+    file_count = backup_set.size();
+  });
+  run("pipelined", [&] {
+    BackupSet backup_set;
+    BackupSetReader(backup_set).readFilePipelined(path);
+    file_count = backup_set.size();
+  });
+  if (UringBlockSource::isAvailable()) {
+    run("io_uring", [&] {
+      BackupSet backup_set;
+      BackupSetReader reader(backup_set);
+      reader.enableUring();
+      reader.readFilePipelined(path);
+      file_count = backup_set.size();
+    });
+  }
+  std::filesystem::remove(path);
+  assert.equal(file_count > 0, true);
+}
+
+BENCHMARK_CASE_WITH_DATA(BackupSetBenchmark, writer, BackupSetBenchmarkData, backup_set_benchmarks) {
+  BackupSet backup_set;
+  read(backup_set, generate(data.entry_count, false));
+  std::ostringstream oss;
+  BackupSetWriter(backup_set).write(oss);
+  const auto size = oss.str().size();
+  for (const size_t thread_count : {1, 4}) {
+    BackupSetWriter writer(backup_set);
+    writer.setThreadCount(thread_count);
+    benchmark.setBytesPerIteration(size);
+    benchmark.setItemsPerIteration(backup_set.size());
+    benchmark.run(std::to_string(data.entry_count) + " " + std::to_string(thread_count) + (thread_count == 1 ? " thread" : " threads"), [&] {
+      oss.str("");
+      writer.write(oss);
+    });
+  }
+}
+
+BENCHMARK_CASE_WITH_DATA(BackupSetBenchmark, writer_index, BackupSetBenchmarkData, backup_set_benchmarks) {
+  BackupSet backup_set;
+  read(backup_set, generate(data.entry_count, false));
+  std::ostringstream oss;
+  BackupSetWriter(backup_set).writeIndex(oss);
+  const auto size = oss.str().size();
+  for (const size_t thread_count : {1, 4}) {
+    BackupSetWriter writer(backup_set);
+    writer.setThreadCount(thread_count);
+    benchmark.setBytesPerIteration(size);
+    benchmark.setItemsPerIteration(backup_set.size());
+    benchmark.run(std::to_string(data.entry_count) + " " + std::to_string(thread_count) + (thread_count == 1 ? " thread" : " threads"), [&] {
+      oss.str("");
+      writer.writeIndex(oss);
+    });
+  }
+}
+
+BENCHMARK_CASE_WITH_DATA(BackupSetBenchmark, get_missing_files, BackupSetBenchmarkData, backup_set_benchmarks) {
+  BackupSet old_set;
+  read(old_set, generate(data.entry_count, false));
+  BackupSet new_set;
+  read(new_set, generate(data.entry_count, true));
+  size_t missing_count = 0;
+  benchmark.setItemsPerIteration(old_set.size() + new_set.size());
+  benchmark.run(std::to_string(data.entry_count), [&] {
+    missing_count = old_set.getMissingFiles(new_set).size();
+  });
+  assert.equal(missing_count > 0, true);
+}
@@ -3,18 +3,45 @@
 // Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <sstream>
 #include <stack>
+#include <thread>
 #include <unordered_set>
 #include <vector>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
 #include "BackupSet.h"
+#include "BackupSetExternalDiff.h"
+#include "BackupSetIndex.h"
 #include "BackupSetReader.h"
 #include "BackupSetWriter.h"
+#include "BlockPipeline.h"
+#include "FilenamePool.h"
+#include "FrozenBackupSet.h"
+#include "OutputSink.h"
+#include "ParseCache.h"
+#include "Sha1Digest.h"
+#include "TempDirectory.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+#include "UringBlockSource.h"
+#include "test/AllocationTracker.h"
 #include "test/TestCase.h"
 #include "test/TestCaseData.h"
 
@@ -50,6 +77,15 @@ std::vector<BackupSetTestData> backup_set_tests = {
   {{"33333", "c:\\temp\\another thing.pdf"},{"11111", "c:\\temp\\not the same something.pdf"}},
   {"c:\\temp\\something else.pdf"},
   {"c:\\temp\\another thing.pdf"}},
+  {{{"1111111111111111111111111111111111111111", "c:\\file 1.txt"},
+    {"2222222222222222222222222222222222222222", "c:\\file 2.txt"},
+    {"5555555555555555555555555555555555555555", "c:\\file 5.txt"},
+    {"99999", "c:\\file 9.txt"}},
+  {{"3333333333333333333333333333333333333333", "c:\\file 3.txt"},
+    {"2222222222222222222222222222222222222222", "c:\\file 2.txt"},
+    {"6666666666666666666666666666666666666666", "c:\\file 6.txt"}},
+  {"c:\\file 1.txt", "c:\\file 5.txt", "c:\\file 9.txt"},
+  {"c:\\file 3.txt", "c:\\file 6.txt"}},
 };
 
 class BackupSetTest : public TestCase {
@@ -77,6 +113,75 @@ class BackupSetTest : public TestCase {
     trace << "Expected: " << std::endl << expected << std::endl;
     assert.equal(ostr.str(), expected);
   }
+
+  // Load |old_buffer| and |new_buffer| into backup sets held in |Storage|
+  // and check they compare and write the same as the default storage.
+  template <typename Storage>
+  void expectSameAsDefaultStorage(const std::string& old_buffer, const std::string& new_buffer) {
+    BackupSet expected_old_set;
+    BackupSetReader(expected_old_set).read(std::string_view(old_buffer));
+    BackupSet expected_new_set;
+    BackupSetReader(expected_new_set).read(std::string_view(new_buffer));
+    const auto expected = expected_old_set.diff(expected_new_set);
+    std::stringstream expected_text;
+    BackupSetWriter(expected_new_set).write(expected_text);
+    std::stringstream expected_index(std::ios::in | std::ios::out | std::ios::binary);
+    BackupSetWriter(expected_new_set).writeIndex(expected_index);
+
+    // The old set is read in sorted chunks and the new one a line at a time.
+    BasicBackupSet<Storage> old_set;
+    BasicBackupSetReader<Storage> old_reader(old_set);
+    old_reader.setThreadCount(4);
+    old_reader.read(std::string_view(old_buffer));
+    BasicBackupSet<Storage> new_set;
+    std::istringstream new_stream(new_buffer);
+    BasicBackupSetReader<Storage>(new_set).read(new_stream);
+    assert.equal(old_set.size(), expected_old_set.size());
+    assert.equal(new_set.size(), expected_new_set.size());
+    assert.equal(new_set.memoryUsage().file_count, new_set.size());
+
+    ThreadPool pool(4);
+    for (const bool compressed : {false, true}) {
+      if (compressed) {
+        old_set.compressFilenames();
+        new_set.compressFilenames();
+      }
+      for (auto* diff_pool : {static_cast<ThreadPool*>(nullptr), &pool}) {
+        const auto diff = old_set.diff(new_set, diff_pool);
+        assert.equal(diff.missing_files, expected.missing_files);
+        assert.equal(diff.extra_files, expected.extra_files);
+      }
+      assert.equal(old_set.getMissingFiles(new_set), expected.missing_files);
+
+      std::stringstream text;
+      BasicBackupSetWriter<Storage>(new_set).write(text);
+      assert.equal(text.str(), expected_text.str());
+      std::stringstream index(std::ios::in | std::ios::out | std::ios::binary);
+      BasicBackupSetWriter<Storage>(new_set).writeIndex(index);
+      assert.equal(index.str() == expected_index.str(), true);
+    }
+  }
+
+  // Verify |backup_set| holds exactly the files in |expected_files|.
+  void expectBackupSet(const BackupSet& backup_set, const std::vector<FileDescriptor>& expected_files) {
+    BackupSet expected;
+    for (const auto& fd : expected_files) {
+      expected.addFile(fd.sha1hash, fd.filename);
+    }
+
+    trace << "Expected BackupSet:" << std::endl;
+    trace.vector(expected_files);
+
+    const auto expected_not_found = backup_set.getMissingFiles(expected);
+    trace << "Missing files expected:" << std::endl;
+    trace.vector(expected_not_found);
+    assert.equal(expected_not_found, {});
+
+    const auto unexpected_found = expected.getMissingFiles(backup_set);
+    trace << "Unexpected files found:" << std::endl;
+    trace.vector(unexpected_found);
+    assert.equal(unexpected_found, {});
+  }
 };
 
 TEST_CASE_WITH_DATA(BackupSetTest, tests, BackupSetTestData, backup_set_tests) {
@@ -107,6 +212,29 @@ TEST_CASE_WITH_DATA(BackupSetTest, tests, BackupSetTestData, backup_set_tests) {
   assert.equal(old_not_in_new, data.old_not_in_new);
 }
 
+TEST_CASE_WITH_DATA(BackupSetTest, diff, BackupSetTestData, backup_set_tests) {
+  trace << std::endl << "Diffing old and new backup sets in a single pass." << std::endl;
+
+  BackupSet old_set;
+  for (const auto& fd : data.old_set) {
+    old_set.addFile(fd.sha1hash, fd.filename);
+  }
+
+  BackupSet new_set;
+  for (const auto& fd : data.new_set) {
+    new_set.addFile(fd.sha1hash, fd.filename);
+  }
+
+  const auto diff = old_set.diff(new_set);
+  trace << "Files found in new but not present in old (NewNotInOld):" << std::endl;
+  trace.vector(diff.missing_files);
+  assert.equal(diff.missing_files, data.new_not_in_old);
+
+  trace << "Files found in old but not present in new (OldNotInNew):" << std::endl;
+  trace.vector(diff.extra_files);
+  assert.equal(diff.extra_files, data.old_not_in_new);
+}
+
 struct BackupSetWriterTestData : TestCaseDataWithExpectedResult<std::string> {
   std::vector<FileDescriptor> backup_set;
 };
@@ -153,6 +281,13 @@ std::vector<BackupSetReaderTestData> backup_set_reader_tests = {
       "2222222222222222222222222222222222222222 c:\\file 2.txt\n"
       "3333333333333333333333333333333333333333 c:\\file 3.txt\n"
       "4444444444444444444444444444444444444444 c:\\file 4.txt\n"},
+  {std::vector<FileDescriptor>({
+      {"1111111111111111111111111111111111111111", "c:\\file 1.txt "},
+      {"3333333333333333333333333333333333333333", "c:\\file 3.txt"}}),
+      "  1111111111111111111111111111111111111111  c:\\file 1.txt \n"
+      "\n"
+      "2222222222222222222222222222222222222222 \n"
+      "3333333333333333333333333333333333333333\tc:\\file 3.txt"},
 };
 
 TEST_CASE_WITH_DATA(BackupSetTest, reader_buffer, BackupSetReaderTestData, backup_set_reader_tests) {
@@ -164,23 +299,37 @@ TEST_CASE_WITH_DATA(BackupSetTest, reader_buffer, BackupSetReaderTestData, backu
   std::istringstream str(data.str);
   reader.read(str);
 
-  BackupSet expected;
-  for (const auto& fd : data.expected) {
-    expected.addFile(fd.sha1hash, fd.filename);
-  }
+  expectBackupSet(backup_set, data.expected);
+}
+
+TEST_CASE_WITH_DATA(BackupSetTest, reader_string_view, BackupSetReaderTestData, backup_set_reader_tests) {
+  trace << std::endl << "Attempting to read a BackupSet in place from this buffer:" << std::endl;
+  trace << data.str << std::endl;
 
-  trace << "Expected BackupSet:" << std::endl;
-  trace.vector(data.expected);
+  BackupSet backup_set;
+  BackupSetReader reader(backup_set);
+  reader.read(std::string_view(data.str));
+  expectBackupSet(backup_set, data.expected);
+}
 
-  const auto expected_not_found = backup_set.getMissingFiles(expected);
-  trace << "Missing files expected:" << std::endl;
-  trace.vector(expected_not_found);
-  assert.equal(expected_not_found, {});
+TEST_CASE_WITH_DATA(BackupSetTest, reader_mapped_file, BackupSetReaderTestData, backup_set_reader_tests) {
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "reader_mapped_file.sha1.txt").string();
+  trace << std::endl << "Attempting to read a BackupSet from mapped file " << path << ":" << std::endl;
+  trace << data.str << std::endl;
+  {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << data.str;
+  }
 
-  const auto unexpected_found = expected.getMissingFiles(backup_set);
-  trace << "Unexpected files found:" << std::endl;
-  trace.vector(unexpected_found);
-  assert.equal(unexpected_found, {});
+  BackupSet backup_set;
+  {
+    BackupSetReader reader(backup_set);
+    assert.equal(reader.readFile(path), true);
+  }
+  std::filesystem::remove(path);
+
+  expectBackupSet(backup_set, data.expected);
 }
 
 struct BackupSetRoundtripTestData : TestCaseDataWithExpectedResult<std::string> {
@@ -199,9 +348,11 @@ TEST_CASE_WITH_DATA(BackupSetTest, roundtrip_buffer, BackupSetRoundtripTestData,
   roundtrip<false>(data.str, data.str);
 }
 
+// Valid sha1 hashes are stored as binary digests and written back as
+// lowercase hex-strings.
 std::vector<BackupSetRoundtripTestData> backup_set_roundtrip_validate_tests = {
   {"1111111111111111111111111111111111111111 c:\\file 1.txt\n"
-      "4444f444F44444444a4444444444A44444e44E44 c:\\file 4.txt\n",
+      "4444f444f44444444a4444444444a44444e44e44 c:\\file 4.txt\n",
       "1111111111111111111111111111111111111111 c:\\file 1.txt\n"
       "222222222222222222222222222222222222222 c:\\file 2.txt\n"
       "3333333333333333333333333333333333333z33 c:\\file 3.txt\n"
@@ -211,3 +362,1125 @@ std::vector<BackupSetRoundtripTestData> backup_set_roundtrip_validate_tests = {
 TEST_CASE_WITH_DATA(BackupSetTest, roundtrip_buffer_validate, BackupSetRoundtripTestData, backup_set_roundtrip_validate_tests) {
   roundtrip<true>(data.str, data.expected);
 }
+
+// Hashes which differ only in case identify the same file. The last one read
+// wins, like any other duplicate hash. Hashes which are not valid sha1
+// hashes remain case-sensitive.
+std::vector<BackupSetRoundtripTestData> backup_set_roundtrip_case_tests = {
+  {"abcdef0123456789abcdef0123456789abcdef01 c:\\file 2.txt\n"
+      "SHORT c:\\file 4.txt\n"
+      "short c:\\file 3.txt\n",
+      "ABCDEF0123456789ABCDEF0123456789ABCDEF01 c:\\file 1.txt\n"
+      "abcdef0123456789abcdef0123456789abcdef01 c:\\file 2.txt\n"
+      "short c:\\file 3.txt\n"
+      "SHORT c:\\file 4.txt\n"},
+};
+
+TEST_CASE_WITH_DATA(BackupSetTest, roundtrip_buffer_case, BackupSetRoundtripTestData, backup_set_roundtrip_case_tests) {
+  roundtrip<false>(data.str, data.expected);
+}
+
+// Every character which is not a hex digit must be rejected wherever it is
+// found in the hash.
+TEST_CASE(BackupSetTest, sha1_digest_from_hex) {
+  const std::string valid = "0123456789abcdefABCDEF0123456789abcdef01";
+  Sha1Digest digest;
+  assert.equal(Sha1Digest::fromHex(valid, digest), true);
+  assert.equal(digest.toHex(), std::string("0123456789abcdefabcdef0123456789abcdef01"));
+  assert.equal(Sha1Digest::fromHex(valid.substr(1), digest), false);
+  assert.equal(Sha1Digest::fromHex(valid + "0", digest), false);
+
+  const std::string hex_digits = "0123456789abcdefABCDEF";
+  for (const size_t position : {0, 15, 16, 23, 24, 31, 32, 39}) {
+    for (int c = 0; c < 256; c++) {
+      std::string hash = valid;
+      hash[position] = static_cast<char>(c);
+      const bool expected = c != 0 && hex_digits.find(static_cast<char>(c)) != std::string::npos;
+      if (Sha1Digest::fromHex(hash, digest) != expected) {
+        trace << "Unexpected result for character " << c << " at position " << position << std::endl;
+        assert.fail();
+      }
+    }
+  }
+}
+
+// Build a serialized backup set large enough to be split into several chunks.
+// It holds duplicate digests in both the same and different chunks, hashes
+// which differ only in case, string hashes and invalid lines.
+std::string makeLargeBackupSetBuffer() {
+  std::stringstream str;
+  for (size_t i = 0; i < 20000; i++) {
+    std::stringstream hash;
+    hash << std::hex << std::setw(40) << std::setfill('0') << (i * 7919 % 5000);
+    auto sha1hash = hash.str();
+    if (i % 3 == 0) {
+      std::transform(sha1hash.begin(), sha1hash.end(), sha1hash.begin(), ::toupper);
+    }
+    str << sha1hash << " c:\\dir " << (i % 17) << "\\file " << i << ".txt\n";
+    if (i % 1000 == 0) {
+      str << "hash" << (i % 3) << " c:\\string hash " << i << ".txt\n";
+      str << "not a valid line\n\n";
+    }
+  }
+  return str.str();
+}
+
+TEST_CASE(BackupSetTest, reader_parallel) {
+  const auto buffer = makeLargeBackupSetBuffer();
+  trace << std::endl << "Reading a " << buffer.size() << " byte buffer on one and several threads." << std::endl;
+
+  for (const bool should_validate : {false, true}) {
+    BackupSet serial_set;
+    BackupSetReader serial_reader(serial_set);
+    BackupSet parallel_set;
+    BackupSetReader parallel_reader(parallel_set);
+    parallel_reader.setThreadCount(7);
+    if (should_validate) {
+      serial_reader.enableValidation();
+      parallel_reader.enableValidation();
+    }
+    serial_reader.read(std::string_view(buffer));
+    parallel_reader.read(std::string_view(buffer));
+
+    std::stringstream serial_str;
+    BackupSetWriter(serial_set).write(serial_str);
+    std::stringstream parallel_str;
+    BackupSetWriter(parallel_set).write(parallel_str);
+    assert.equal(parallel_str.str(), serial_str.str());
+  }
+}
+
+TEST_CASE(BackupSetTest, diff_parallel) {
+  const auto buffer = makeLargeBackupSetBuffer();
+  const auto new_buffer = std::string_view(buffer).substr(buffer.find('\n', buffer.size() / 2) + 1);
+  trace << std::endl << "Diffing large backup sets with and without a thread pool." << std::endl;
+
+  BackupSet old_set;
+  BackupSetReader(old_set).read(std::string_view(buffer));
+  BackupSet new_set;
+  BackupSetReader new_reader(new_set);
+  new_reader.read(new_buffer);
+  new_reader.read("ffffffffffffffffffffffffffffffffffffffff c:\\only in new.txt\nstring c:\\only in new 2.txt\n");
+
+  ThreadPool pool(4);
+  const auto serial_diff = old_set.diff(new_set);
+  const auto parallel_diff = old_set.diff(new_set, &pool);
+  trace << "Found " << serial_diff.missing_files.size() << " missing and " << serial_diff.extra_files.size() << " extra files." << std::endl;
+  assert.equal(serial_diff.missing_files.size(), static_cast<size_t>(2));
+  assert.equal(parallel_diff.missing_files, serial_diff.missing_files);
+  assert.equal(parallel_diff.extra_files, serial_diff.extra_files);
+  assert.equal(serial_diff.missing_files, old_set.getMissingFiles(new_set));
+  assert.equal(serial_diff.extra_files, new_set.getMissingFiles(old_set));
+}
+
+TEST_CASE(BackupSetTest, writer_parallel) {
+  const auto buffer = makeLargeBackupSetBuffer();
+  trace << std::endl << "Writing a large BackupSet on one and several threads." << std::endl;
+
+  BackupSet backup_set;
+  BackupSetReader(backup_set).read(std::string_view(buffer));
+  for (const bool should_compress : {false, true}) {
+    if (should_compress) {
+      backup_set.compressFilenames();
+    }
+    std::stringstream serial_str;
+    BackupSetWriter(backup_set).write(serial_str);
+    std::stringstream serial_index(std::ios::in | std::ios::out | std::ios::binary);
+    BackupSetWriter(backup_set).writeIndex(serial_index);
+
+    for (const size_t thread_count : {2, 7}) {
+      trace << "Writing on " << thread_count << " threads" << (should_compress ? " with compressed filenames." : ".") << std::endl;
+      BackupSetWriter writer(backup_set);
+      writer.setThreadCount(thread_count);
+      std::stringstream parallel_str;
+      writer.write(parallel_str);
+      assert.equal(parallel_str.str(), serial_str.str());
+      std::stringstream parallel_index(std::ios::in | std::ios::out | std::ios::binary);
+      writer.writeIndex(parallel_index);
+      assert.equal(parallel_index.str() == serial_index.str(), true);
+    }
+  }
+
+  // An empty set writes nothing but the index structure.
+  BackupSet empty_set;
+  BackupSetWriter empty_writer(empty_set);
+  empty_writer.setThreadCount(3);
+  std::stringstream empty_str;
+  empty_writer.write(empty_str);
+  assert.equal(empty_str.str().empty(), true);
+}
+
+TEST_CASE(BackupSetTest, index_roundtrip) {
+  const auto buffer = makeLargeBackupSetBuffer();
+  trace << std::endl << "Roundtripping a large BackupSet through the binary index format." << std::endl;
+
+  BackupSet text_set;
+  BackupSetReader(text_set).read(std::string_view(buffer));
+  std::stringstream text_str;
+  BackupSetWriter(text_set).write(text_str);
+
+  std::stringstream index_str(std::ios::in | std::ios::out | std::ios::binary);
+  BackupSetWriter(text_set).writeIndex(index_str);
+  const auto index = index_str.str();
+  assert.equal(BackupSetIndexHeader::hasMagic(index), true);
+
+  for (const size_t thread_count : {1, 4}) {
+    BackupSet index_set;
+    BackupSetReader reader(index_set);
+    reader.setThreadCount(thread_count);
+    reader.read(std::string_view(index));
+    std::stringstream roundtrip_str;
+    BackupSetWriter(index_set).write(roundtrip_str);
+    assert.equal(roundtrip_str.str(), text_str.str());
+  }
+
+  // Truncated or corrupted indexes are rejected without reading anything.
+  BackupSet empty_set;
+  const auto file_count = empty_set.getMissingFiles(text_set).size();
+  auto corrupt_offset = index;
+  BackupSetIndexHeader header;
+  header.decode(index);
+  corrupt_offset[header.filename_offsets_offset + sizeof(uint64_t) * 10 + 7] = '\x7f';
+  auto unsorted_digests = index;
+  std::swap_ranges(unsorted_digests.begin() + header.digests_offset,
+      unsorted_digests.begin() + header.digests_offset + Sha1Digest::Size,
+      unsorted_digests.begin() + header.digests_offset + Sha1Digest::Size * 100);
+
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "index_roundtrip.bsidx").string();
+  const std::vector<std::string> corrupt_indexes = {
+      index.substr(0, index.size() - 1),
+      index.substr(0, BackupSetIndexHeader::EncodedSize),
+      corrupt_offset,
+      unsorted_digests};
+  for (const auto& corrupt_index : corrupt_indexes) {
+    {
+      std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+      ofs << corrupt_index;
+    }
+    BackupSet index_set;
+    assert.equal(BackupSetReader(index_set).readFile(path), false);
+    assert.equal(BackupSetReader(index_set).read(std::string_view(corrupt_index)), false);
+    assert.equal(empty_set.getMissingFiles(index_set).size(), static_cast<size_t>(0));
+  }
+
+  // Validation rejects the string hashes of an index like those of the text.
+  BackupSet validated_text_set;
+  BackupSetReader validated_text_reader(validated_text_set);
+  validated_text_reader.enableValidation();
+  validated_text_reader.read(std::string_view(buffer));
+  BackupSet validated_index_set;
+  BackupSetReader validated_index_reader(validated_index_set);
+  validated_index_reader.enableValidation();
+  assert.equal(validated_index_reader.read(std::string_view(index)), true);
+  assert.equal(validated_index_set.size(), validated_text_set.size());
+  assert.equal(validated_index_set.size() < text_set.size(), true);
+  assert.equal(validated_index_reader.getStats().rejected_line_count, static_cast<uint64_t>(text_set.size() - validated_text_set.size()));
+  assert.equal(validated_index_set.getMissingFiles(validated_text_set).size(), static_cast<size_t>(0));
+
+  {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << index;
+  }
+  BackupSet index_set;
+  assert.equal(BackupSetReader(index_set).readFile(path), true);
+  assert.equal(empty_set.getMissingFiles(index_set).size(), file_count);
+  assert.equal(index_set.getMissingFiles(text_set).size(), static_cast<size_t>(0));
+  std::filesystem::remove(path);
+}
+
+TEST_CASE(BackupSetTest, external_diff) {
+  const auto old_buffer = makeLargeBackupSetBuffer();
+  auto new_buffer = old_buffer.substr(old_buffer.find('\n', old_buffer.size() / 3) + 1);
+  new_buffer += "ffffffffffffffffffffffffffffffffffffffff c:\\only in new.txt\nstring c:\\only in new 2.txt\n";
+  trace << std::endl << "Comparing large backup sets with an external sort in small runs." << std::endl;
+
+  const TempDirectory directory("backup_set_test_");
+  const auto old_path = (directory.path() / "external_diff_old.sha1.txt").string();
+  const auto new_path = (directory.path() / "external_diff_new.sha1.txt").string();
+  const auto new_index_path = (directory.path() / "external_diff_new.bsidx").string();
+  {
+    std::ofstream(old_path, std::ofstream::out | std::ofstream::binary) << old_buffer;
+    std::ofstream(new_path, std::ofstream::out | std::ofstream::binary) << new_buffer;
+  }
+
+  BackupSet old_set;
+  BackupSetReader(old_set).read(std::string_view(old_buffer));
+  BackupSet new_set;
+  BackupSetReader(new_set).read(std::string_view(new_buffer));
+  {
+    std::ofstream ofs(new_index_path, std::ofstream::out | std::ofstream::binary);
+    BackupSetWriter(new_set).writeIndex(ofs);
+  }
+  const auto expected = old_set.diff(new_set);
+  std::stringstream expected_new_not_in_old;
+  std::stringstream expected_old_not_in_new;
+  for (const auto& filename : expected.missing_files) {
+    expected_new_not_in_old << filename << "\n";
+  }
+  for (const auto& filename : expected.extra_files) {
+    expected_old_not_in_new << filename << "\n";
+  }
+
+  for (const auto& new_input_path : {new_path, new_index_path}) {
+    // Each run holds only a few hundred files.
+    BackupSetExternalDiff external_diff(32 * 1024);
+    std::stringstream new_not_in_old;
+    std::stringstream old_not_in_new;
+    assert.equal(external_diff.diff(old_path, new_input_path, new_not_in_old, old_not_in_new), true);
+    assert.equal(new_not_in_old.str(), expected_new_not_in_old.str());
+    assert.equal(old_not_in_new.str(), expected_old_not_in_new.str());
+  }
+
+  // Validation skips the string hashes of an index like those of the text.
+  std::vector<std::string> validated_results;
+  for (const auto& new_input_path : {new_path, new_index_path}) {
+    BackupSetExternalDiff external_diff(32 * 1024);
+    external_diff.enableValidation();
+    std::stringstream new_not_in_old;
+    std::stringstream old_not_in_new;
+    assert.equal(external_diff.diff(old_path, new_input_path, new_not_in_old, old_not_in_new), true);
+    validated_results.push_back(new_not_in_old.str() + old_not_in_new.str());
+  }
+  assert.equal(validated_results[0], validated_results[1]);
+
+  std::filesystem::remove(old_path);
+  std::filesystem::remove(new_path);
+  std::filesystem::remove(new_index_path);
+}
+
+TEST_CASE(BackupSetTest, external_diff_merge_passes) {
+  // Every 100th file is missing from new and each copy of a file in old is
+  // renamed by the copies after it, so the merge must keep the runs in order.
+  std::stringstream old_stream;
+  std::stringstream new_stream;
+  for (size_t i = 0; i < 20000; i++) {
+    std::stringstream hash;
+    hash << std::hex << std::setw(40) << std::setfill('0') << (i * 7919 % 12000);
+    old_stream << hash.str() << " c:\\file " << i << ".txt\n";
+    if (i % 100 != 0) {
+      new_stream << hash.str() << " c:\\file " << i << ".txt\n";
+    }
+  }
+  const auto old_buffer = old_stream.str();
+  const auto new_buffer = new_stream.str();
+
+  const TempDirectory directory("backup_set_test_");
+  const auto old_path = (directory.path() / "merge_passes_old.sha1.txt").string();
+  const auto new_path = (directory.path() / "merge_passes_new.sha1.txt").string();
+  {
+    std::ofstream(old_path, std::ofstream::out | std::ofstream::binary) << old_buffer;
+    std::ofstream(new_path, std::ofstream::out | std::ofstream::binary) << new_buffer;
+  }
+
+  BackupSet old_set;
+  BackupSetReader(old_set).read(std::string_view(old_buffer));
+  BackupSet new_set;
+  BackupSetReader(new_set).read(std::string_view(new_buffer));
+  const auto expected = old_set.diff(new_set);
+  std::stringstream expected_new_not_in_old;
+  std::stringstream expected_old_not_in_new;
+  for (const auto& filename : expected.missing_files) {
+    expected_new_not_in_old << filename << "\n";
+  }
+  for (const auto& filename : expected.extra_files) {
+    expected_old_not_in_new << filename << "\n";
+  }
+
+  // Runs of a couple of kilobytes hold only a few dozen files, so each input
+  // has hundreds of runs and takes several passes to merge.
+  constexpr size_t MaxMemory = 4 * 1024;
+  assert.equal(BackupSetExternalDiff::getMergeWidth(MaxMemory), static_cast<size_t>(2));
+  assert.equal(BackupSetExternalDiff::getMergeWidth(static_cast<size_t>(1) << 30) < 64, true);
+  BackupSetExternalDiff external_diff(MaxMemory);
+  std::stringstream new_not_in_old;
+  std::stringstream old_not_in_new;
+  assert.equal(external_diff.diff(old_path, new_path, new_not_in_old, old_not_in_new), true);
+  assert.equal(new_not_in_old.str(), expected_new_not_in_old.str());
+  assert.equal(old_not_in_new.str(), expected_old_not_in_new.str());
+  assert.equal(expected.extra_files.empty(), false);
+
+  std::filesystem::remove(old_path);
+  std::filesystem::remove(new_path);
+}
+
+TEST_CASE(BackupSetTest, sorted_diff) {
+  auto old_buffer = makeLargeBackupSetBuffer();
+  auto new_buffer = old_buffer.substr(old_buffer.find('\n', old_buffer.size() / 3) + 1);
+  new_buffer += "ffffffffffffffffffffffffffffffffffffffff c:\\only in new.txt\nstring c:\\only in new 2.txt\n";
+  old_buffer += "eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee c:\\only in old.txt\n";
+  trace << std::endl << "Comparing sorted backup sets while streaming them." << std::endl;
+
+  BackupSet old_set;
+  BackupSetReader(old_set).read(std::string_view(old_buffer));
+  BackupSet new_set;
+  BackupSetReader(new_set).read(std::string_view(new_buffer));
+  const auto expected = old_set.diff(new_set);
+
+  // The writer sorts each set. Repeat the line of a file only found in old
+  // with another filename to check the last duplicate wins like it does when
+  // reading into a BackupSet.
+  std::stringstream old_sorted;
+  BackupSetWriter(old_set).write(old_sorted);
+  std::stringstream new_sorted;
+  BackupSetWriter(new_set).write(new_sorted);
+  auto old_text = old_sorted.str();
+  const auto line_end = old_text.find(" " + expected.extra_files.front() + "\n") + expected.extra_files.front().size() + 2;
+  const auto line_begin = old_text.rfind('\n', line_end - 2) + 1;
+  old_text.insert(line_end, old_text.substr(line_begin, Sha1Digest::HexLength) + " c:\\duplicate.txt\n");
+
+  std::stringstream expected_new_not_in_old;
+  std::stringstream expected_old_not_in_new;
+  for (const auto& filename : expected.missing_files) {
+    expected_new_not_in_old << filename << "\n";
+  }
+  expected_old_not_in_new << "c:\\duplicate.txt\n";
+  for (size_t i = 1; i < expected.extra_files.size(); i++) {
+    expected_old_not_in_new << expected.extra_files[i] << "\n";
+  }
+
+  const TempDirectory directory("backup_set_test_");
+  const auto old_path = (directory.path() / "sorted_diff_old.sha1.txt").string();
+  const auto new_path = (directory.path() / "sorted_diff_new.sha1.txt").string();
+  const auto unsorted_path = (directory.path() / "sorted_diff_unsorted.sha1.txt").string();
+  {
+    std::ofstream(old_path, std::ofstream::out | std::ofstream::binary) << old_text;
+    std::ofstream(new_path, std::ofstream::out | std::ofstream::binary) << new_sorted.str();
+    std::ofstream(unsorted_path, std::ofstream::out | std::ofstream::binary) << old_buffer;
+  }
+
+  BackupSetExternalDiff external_diff(0);
+  std::stringstream new_not_in_old;
+  std::stringstream old_not_in_new;
+  assert.equal(external_diff.diffSorted(old_path, new_path, new_not_in_old, old_not_in_new), true);
+  assert.equal(new_not_in_old.str(), expected_new_not_in_old.str());
+  assert.equal(old_not_in_new.str(), expected_old_not_in_new.str());
+
+  // Unsorted input is detected rather than producing a wrong result.
+  std::stringstream unused;
+  assert.equal(external_diff.diffSorted(unsorted_path, new_path, unused, unused), false);
+  assert.equal(external_diff.diffSorted(old_path, unsorted_path, unused, unused), false);
+
+  std::filesystem::remove(old_path);
+  std::filesystem::remove(new_path);
+  std::filesystem::remove(unsorted_path);
+}
+
+TEST_CASE(BackupSetTest, memory_usage) {
+  const auto buffer = makeLargeBackupSetBuffer();
+
+  BackupSet copied_set;
+  BackupSetReader(copied_set).read(std::string_view(buffer));
+  const auto usage = copied_set.memoryUsage();
+  trace << std::endl << "Backup set of " << usage.file_count << " files holds " << usage.string_bytes << " bytes of strings and " << usage.node_bytes << " bytes of nodes in " << usage.block_count << " blocks of " << usage.reserved_bytes << " bytes." << std::endl;
+  assert.equal(usage.file_count, copied_set.size());
+  assert.equal(usage.node_bytes >= usage.file_count * (sizeof(Sha1Digest) + sizeof(std::string_view)), true);
+  assert.equal(usage.string_bytes + usage.node_bytes <= usage.reserved_bytes, true);
+  // Without an arena every file would be at least one allocation.
+  assert.equal(usage.block_count < usage.file_count / 10, true);
+
+  // Filenames held by reference are not copied into the arenas.
+  BackupSet referenced_set;
+  referenced_set.addFileReference(Sha1Digest(), "c:\\referenced.txt");
+  assert.equal(referenced_set.memoryUsage().string_bytes, static_cast<size_t>(0));
+  referenced_set.addFile(std::string_view("hash"), "c:\\copied.txt");
+  assert.equal(referenced_set.memoryUsage().string_bytes, std::string_view("hashc:\\copied.txt").size());
+
+  // Moving a backup set moves its arenas along with the nodes in them.
+  std::stringstream expected;
+  BackupSetWriter(copied_set).write(expected);
+  referenced_set = std::move(copied_set);
+  std::stringstream actual;
+  BackupSetWriter(referenced_set).write(actual);
+  assert.equal(actual.str(), expected.str());
+  assert.equal(referenced_set.memoryUsage().reserved_bytes, usage.reserved_bytes);
+}
+
+TEST_CASE(BackupSetTest, compress_filenames) {
+  std::string buffer = makeLargeBackupSetBuffer();
+  buffer += "\ndddddddddddddddddddddddddddddddddddddddd \nstring hash with empty filename \n";
+  trace << std::endl << "Compressing the filenames of a backup set." << std::endl;
+
+  BackupSet old_set;
+  BackupSetReader(old_set).read(std::string_view(buffer));
+  BackupSet new_set;
+  BackupSetReader(new_set).read(std::string_view(buffer).substr(buffer.size() / 2));
+  new_set.addFile(std::string_view("ffffffffffffffffffffffffffffffffffffffff"), "c:\\only in new.txt");
+
+  std::stringstream expected_text;
+  BackupSetWriter(old_set).write(expected_text);
+  std::stringstream expected_index;
+  BackupSetWriter(old_set).writeIndex(expected_index);
+  const auto expected_diff = old_set.diff(new_set);
+  const auto usage = old_set.memoryUsage();
+
+  old_set.compressFilenames();
+  new_set.compressFilenames();
+  const auto compressed_usage = old_set.memoryUsage();
+  trace << "Compressed " << usage.string_bytes << " bytes of strings into " << compressed_usage.compressed_filename_bytes << " bytes." << std::endl;
+  assert.equal(compressed_usage.compressed_filename_bytes < usage.string_bytes / 4, true);
+  assert.equal(compressed_usage.string_bytes < usage.string_bytes / 100, true);
+
+  // Output is the same as before compressing.
+  std::stringstream text;
+  BackupSetWriter(old_set).write(text);
+  assert.equal(text.str(), expected_text.str());
+  std::stringstream index;
+  BackupSetWriter(old_set).writeIndex(index);
+  assert.equal(index.str(), expected_index.str());
+  const auto diff = old_set.diff(new_set);
+  assert.equal(diff.missing_files, expected_diff.missing_files);
+  assert.equal(diff.extra_files, expected_diff.extra_files);
+  assert.equal(old_set.getMissingFiles(new_set), expected_diff.missing_files);
+
+  // Files added after compressing sit alongside the compressed ones and are
+  // compressed with them next time.
+  old_set.addFile(std::string_view("ffffffffffffffffffffffffffffffffffffffff"), "c:\\only in new.txt");
+  old_set.addFile(std::string_view("new string hash"), "c:\\added later.txt");
+  assert.equal(old_set.getMissingFiles(new_set).size(), expected_diff.missing_files.size() - 1);
+  std::stringstream added_text;
+  BackupSetWriter(old_set).write(added_text);
+  old_set.compressFilenames();
+  std::stringstream recompressed_text;
+  BackupSetWriter(old_set).write(recompressed_text);
+  assert.equal(recompressed_text.str(), added_text.str());
+}
+
+TEST_CASE(BackupSetTest, filename_pool) {
+  const auto buffer = makeLargeBackupSetBuffer();
+  auto new_buffer = buffer.substr(buffer.find('\n', buffer.size() / 3) + 1);
+  new_buffer += "ffffffffffffffffffffffffffffffffffffffff c:\\only in new.txt\nstring c:\\only in new 2.txt\n";
+  trace << std::endl << "Sharing one pool of filenames between two backup sets." << std::endl;
+
+  BackupSet expected_old_set;
+  BackupSetReader(expected_old_set).read(std::string_view(buffer));
+  BackupSet expected_new_set;
+  BackupSetReader(expected_new_set).read(std::string_view(new_buffer));
+  const auto expected = expected_old_set.diff(expected_new_set);
+  std::stringstream expected_text;
+  BackupSetWriter(expected_old_set).write(expected_text);
+
+  // Read on several threads to fill the pool concurrently.
+  auto filename_pool = std::make_shared<FilenamePool>();
+  BackupSet old_set(filename_pool);
+  BackupSetReader old_reader(old_set);
+  old_reader.setThreadCount(4);
+  old_reader.read(std::string_view(buffer));
+  const auto old_pool_size = filename_pool->size();
+  BackupSet new_set(filename_pool);
+  BackupSetReader new_reader(new_set);
+  new_reader.setThreadCount(4);
+  new_reader.read(std::string_view(new_buffer));
+  // Filenames added by reference are still pooled.
+  new_set.addFileReference(Sha1Digest(), "c:\\referenced.txt");
+  expected_new_set.addFileReference(Sha1Digest(), "c:\\referenced.txt");
+
+  // The second set only adds the filenames the first one does not have.
+  assert.equal(filename_pool->size(), old_pool_size + 3);
+  // Only the string hashes themselves are copied into the backup set.
+  assert.equal(old_set.memoryUsage().string_bytes, std::string_view("hash0hash1hash2not").size());
+  assert.equal(filename_pool->get(filename_pool->intern("c:\\only in new.txt")), std::string_view("c:\\only in new.txt"));
+
+  const auto diff = old_set.diff(new_set);
+  assert.equal(diff.missing_files, expected.missing_files);
+  assert.equal(diff.extra_files, expected.extra_files);
+  std::stringstream text;
+  BackupSetWriter(old_set).write(text);
+  assert.equal(text.str(), expected_text.str());
+}
+
+TEST_CASE_WITH_DATA(BackupSetTest, reader_lazy_file, BackupSetReaderTestData, backup_set_reader_tests) {
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "reader_lazy_file.sha1.txt").string();
+  trace << std::endl << "Attempting to read a BackupSet lazily from file " << path << ":" << std::endl;
+  trace << data.str << std::endl;
+  {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << data.str;
+  }
+
+  {
+    BackupSet backup_set;
+    BackupSetReader reader(backup_set);
+    reader.enableLazyFilenames();
+    assert.equal(reader.readFile(path), true);
+    expectBackupSet(backup_set, data.expected);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE_WITH_DATA(BackupSetTest, reader_pipelined_file, BackupSetReaderTestData, backup_set_reader_tests) {
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "reader_pipelined_file.sha1.txt").string();
+  trace << std::endl << "Attempting to read a BackupSet through a pipeline from file " << path << ":" << std::endl;
+  trace << data.str << std::endl;
+  {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << data.str;
+  }
+
+  {
+    BackupSet backup_set;
+    BackupSetReader reader(backup_set);
+    assert.equal(reader.readFilePipelined(path), true);
+    expectBackupSet(backup_set, data.expected);
+  }
+  std::filesystem::remove(path);
+}
+
+// Hands out a string a few bytes at a time.
+class StringBlockSource : public BlockSource {
+ private:
+  std::string_view str_;
+  size_t read_size_;
+
+ public:
+  StringBlockSource(std::string_view str, size_t read_size) : str_(str), read_size_(read_size) {}
+
+  bool read(char* data, size_t capacity, size_t& size) override {
+    size = std::min({capacity, read_size_, str_.size()});
+    std::memcpy(data, str_.data(), size);
+    str_.remove_prefix(size);
+    return true;
+  }
+};
+
+TEST_CASE(BackupSetTest, block_pipeline) {
+  std::string input = makeLargeBackupSetBuffer();
+  input += std::string(1000, 'x') + "\nno newline at the end";
+
+  for (const size_t block_size : {7, 64, 4096}) {
+    for (const size_t read_size : {3, 100, 100000}) {
+      trace << std::endl << "Splitting input into " << block_size << " byte blocks read " << read_size << " bytes at a time." << std::endl;
+      StringBlockSource source(input, read_size);
+      BlockPipeline pipeline(source, block_size);
+      std::string output;
+      size_t unterminated_count = 0;
+      assert.equal(pipeline.run([&](std::string_view block) {
+        output.append(block);
+        unterminated_count += block.empty() || block.back() != '\n' ? 1 : 0;
+        return true;
+      }), true);
+      assert.equal(output == input, true);
+      assert.equal(unterminated_count, static_cast<size_t>(1));
+    }
+  }
+
+  // Stopping early stops the reading thread too.
+  StringBlockSource source(input, 100);
+  BlockPipeline pipeline(source, 64);
+  size_t block_count = 0;
+  assert.equal(pipeline.run([&](std::string_view) {
+    return ++block_count < 3;
+  }), true);
+  assert.equal(block_count, static_cast<size_t>(3));
+
+  // A binary index is left to readFile.
+  BackupSet backup_set;
+  BackupSetReader(backup_set).read(std::string_view(input));
+  std::stringstream index;
+  BackupSetWriter(backup_set).writeIndex(index);
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "pipelined.bsidx").string();
+  {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << index.str();
+  }
+  BackupSet index_set;
+  BackupSetReader index_reader(index_set);
+  assert.equal(index_reader.readFilePipelined(path), false);
+  assert.equal(index_set.size(), static_cast<size_t>(0));
+  assert.equal(index_reader.readFile(path), true);
+  assert.equal(index_set.size(), backup_set.size());
+  std::filesystem::remove(path);
+  assert.equal(index_reader.readFilePipelined(path), false);
+}
+
+TEST_CASE(BackupSetTest, uring_block_source) {
+  const auto input = makeLargeBackupSetBuffer() + "no newline at the end";
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "uring.sha1.txt").string();
+  {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << input;
+  }
+
+  trace << std::endl << "io_uring is " << (UringBlockSource::isAvailable() ? "available." : "unavailable.") << std::endl;
+  if (UringBlockSource::isAvailable()) {
+    for (const size_t capacity : {100, 4096, 1000000}) {
+      trace << "Reading " << capacity << " bytes at a time." << std::endl;
+      auto source = UringBlockSource::open(path, 4096, 3);
+      assert.equal(source != nullptr, true);
+      trace << "Reads are " << (source->isDirect() ? "direct." : "buffered.") << std::endl;
+      std::string output;
+      std::vector<char> block(capacity);
+      size_t size = 0;
+      while (source->read(block.data(), block.size(), size) && size > 0) {
+        output.append(block.data(), size);
+      }
+      assert.equal(output == input, true);
+    }
+
+#if defined(__linux__)
+    // Reads from an epoll descriptor fail with EINVAL once it is ready, like
+    // direct reads on a filesystem which only refuses O_DIRECT once it is
+    // used. Every read in flight fails and is read again without it.
+    const auto event_fd = eventfd(1, EFD_CLOEXEC);
+    const auto epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    assert.equal(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event), 0);
+    UringBlockSource::setDirectOpener([epoll_fd](const std::string&) { return dup(epoll_fd); });
+    auto source = UringBlockSource::open(path, 4096, 4);
+    UringBlockSource::setDirectOpener(nullptr);
+    assert.equal(source != nullptr, true);
+    assert.equal(source->isDirect(), true);
+    std::string output;
+    std::vector<char> block(1000);
+    size_t size = 0;
+    while (source->read(block.data(), block.size(), size) && size > 0) {
+      output.append(block.data(), size);
+    }
+    assert.equal(source->isDirect(), false);
+    assert.equal(output == input, true);
+    close(epoll_fd);
+    close(event_fd);
+#endif
+  } else {
+    assert.equal(UringBlockSource::open(path) == nullptr, true);
+  }
+
+  // Pipes and missing files are left to the other readers.
+  assert.equal(UringBlockSource::open(directory.path().string()) == nullptr, true);
+
+  // Falls back to plain reads when io_uring is unavailable.
+  BackupSet expected_set;
+  BackupSetReader(expected_set).read(std::string_view(input));
+  BackupSet backup_set;
+  BackupSetReader reader(backup_set);
+  reader.enableUring();
+  assert.equal(reader.readFilePipelined(path), true);
+  assert.equal(reader.getStats().bytes, static_cast<uint64_t>(input.size()));
+  assert.equal(backup_set.size(), expected_set.size());
+  assert.equal(backup_set.getMissingFiles(expected_set).empty(), true);
+  assert.equal(expected_set.getMissingFiles(backup_set).empty(), true);
+  std::filesystem::remove(path);
+
+  std::ofstream(path, std::ofstream::out | std::ofstream::binary).close();
+  auto empty = UringBlockSource::open(path);
+  if (empty) {
+    char byte;
+    size_t size = 1;
+    assert.equal(empty->read(&byte, 1, size), true);
+    assert.equal(size, static_cast<size_t>(0));
+  }
+}
+
+TEST_CASE(BackupSetTest, output_sink) {
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "output_sink.txt").string();
+  const auto read_back = [&path]() {
+    std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+    std::stringstream contents;
+    contents << ifs.rdbuf();
+    return contents.str();
+  };
+
+  std::string expected;
+  for (size_t i = 0; i < 1000; i++) {
+    expected += "c:\\file " + std::to_string(i) + ".txt\n";
+  }
+  expected += std::string(100, 'x');
+
+  for (const bool use_thread : {false, true}) {
+    for (const size_t buffer_size : {1, 16, 4096, 1024 * 1024}) {
+      trace << std::endl << "Writing through " << buffer_size << " byte buffers" << (use_thread ? " on a writer thread." : ".") << std::endl;
+      auto sink = OutputSink::open(path, use_thread, buffer_size, 3);
+      assert.equal(sink != nullptr, true);
+      std::ostream os(sink.get());
+      for (size_t i = 0; i < 1000; i++) {
+        os << "c:\\file " << i << ".txt" << '\n';
+        // Flushing part way writes what is buffered and carries on.
+        if (i == 500) {
+          os << std::flush;
+          assert.equal(read_back().size() > 0, true);
+        }
+      }
+      os.write(expected.data() + expected.size() - 100, 100);
+      assert.equal(os.good(), true);
+      assert.equal(sink->close(), true);
+      assert.equal(read_back() == expected, true);
+    }
+  }
+
+  // BackupSetWriter writes whole files through a sink.
+  BackupSet backup_set;
+  BackupSetReader(backup_set).read(std::string_view(makeLargeBackupSetBuffer()));
+  std::stringstream text;
+  BackupSetWriter(backup_set).write(text);
+  std::stringstream index(std::ios::in | std::ios::out | std::ios::binary);
+  BackupSetWriter(backup_set).writeIndex(index);
+  for (const bool use_thread : {false, true}) {
+    BackupSetWriter writer(backup_set);
+    if (use_thread) {
+      writer.enableWriteThread();
+    }
+    assert.equal(writer.writeFile(path), true);
+    assert.equal(read_back() == text.str(), true);
+    assert.equal(writer.writeIndexFile(path), true);
+    assert.equal(read_back() == index.str(), true);
+  }
+  std::filesystem::remove(path);
+
+  const auto missing_path = (directory.path() / "missing_directory" / "output.txt").string();
+  assert.equal(OutputSink::open(missing_path) == nullptr, true);
+  assert.equal(BackupSetWriter(backup_set).writeFile(missing_path), false);
+}
+
+TEST_CASE(BackupSetTest, parse_cache) {
+  const TempDirectory temp_directory("backup_set_test_");
+  const auto directory = temp_directory.path() / "cache";
+  const auto path = (temp_directory.path() / "parse_cache.sha1.txt").string();
+  const auto write_text = [&path](const std::string& text) {
+    std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+    ofs << text;
+  };
+  const auto text = makeLargeBackupSetBuffer();
+  write_text(text);
+  BackupSet backup_set;
+  BackupSetReader(backup_set).read(std::string_view(text));
+
+  auto cache = ParseCache::open(directory.string());
+  assert.equal(cache != nullptr, true);
+  ParseCacheKey key;
+  assert.equal(ParseCache::makeKey(path, false, key), true);
+  assert.equal(cache->find(key).empty(), true);
+  assert.equal(cache->store(key, backup_set), true);
+
+  // The snapshot holds the same backup set.
+  const auto snapshot = cache->find(key);
+  assert.equal(snapshot.empty(), false);
+  const auto snapshot_size = std::filesystem::file_size(snapshot);
+  BackupSet cached_set;
+  assert.equal(BackupSetReader(cached_set).readFile(snapshot), true);
+  assert.equal(cached_set.size(), backup_set.size());
+  assert.equal(cached_set.getMissingFiles(backup_set).size(), static_cast<size_t>(0));
+  assert.equal(backup_set.getMissingFiles(cached_set).size(), static_cast<size_t>(0));
+
+  // Files parsed with validation have a snapshot of their own.
+  ParseCacheKey validated_key;
+  assert.equal(ParseCache::makeKey(path, true, validated_key), true);
+  assert.equal(cache->find(validated_key).empty(), true);
+
+  // Changing the file makes the snapshot stale and removes it.
+  write_text(text + "0000000000000000000000000000000000000000 c:\\new file.txt\n");
+  ParseCacheKey changed_key;
+  assert.equal(ParseCache::makeKey(path, false, changed_key), true);
+  assert.equal(changed_key != key, true);
+  assert.equal(cache->find(changed_key).empty(), true);
+  assert.equal(std::filesystem::exists(snapshot), false);
+
+  // A file with the same size and modification time is still told apart by
+  // its contents.
+  auto touched_key = key;
+  touched_key.fingerprint++;
+  assert.equal(cache->store(key, backup_set), true);
+  assert.equal(cache->find(touched_key).empty(), true);
+
+  // Rewriting a hash between the sampled parts keeps the size, and copying
+  // tools keep the modification time, but the change time still moves.
+  write_text(text);
+  ParseCacheKey original_key;
+  assert.equal(ParseCache::makeKey(path, false, original_key), true);
+  assert.equal(cache->store(original_key, backup_set), true);
+  const auto modified_time = std::filesystem::last_write_time(path);
+  // Some filesystems only keep change times to a few milliseconds.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  {
+    const auto offset = text.find('\n', text.size() / 4) + 1;
+    std::fstream fs(path, std::fstream::in | std::fstream::out | std::fstream::binary);
+    fs.seekp(static_cast<std::streamoff>(offset));
+    fs.put(text[offset] == '0' ? '1' : '0');
+  }
+  std::filesystem::last_write_time(path, modified_time);
+  ParseCacheKey edited_key;
+  assert.equal(ParseCache::makeKey(path, false, edited_key), true);
+  assert.equal(edited_key.size, original_key.size);
+  assert.equal(edited_key.modified_time, original_key.modified_time);
+  assert.equal(edited_key.fingerprint, original_key.fingerprint);
+  assert.equal(edited_key != original_key, true);
+  assert.equal(cache->find(edited_key).empty(), true);
+
+  // With room for one snapshot, storing another evicts the older one.
+  auto small_cache = ParseCache::open(directory.string(), snapshot_size);
+  assert.equal(small_cache->store(key, backup_set), true);
+  assert.equal(small_cache->store(validated_key, backup_set), true);
+  assert.equal(small_cache->find(validated_key).empty(), false);
+  assert.equal(small_cache->find(key).empty(), true);
+
+  // A directory can't be made inside a file.
+  assert.equal(ParseCache::open(path + "/nested") == nullptr, true);
+  std::filesystem::remove(path);
+  std::filesystem::remove_all(directory);
+  assert.equal(ParseCache::makeKey(path, false, key), false);
+}
+
+TEST_CASE(BackupSetTest, diff_lazy) {
+  const auto old_buffer = makeLargeBackupSetBuffer();
+  auto new_buffer = old_buffer.substr(old_buffer.find('\n', old_buffer.size() / 3) + 1);
+  new_buffer += "ffffffffffffffffffffffffffffffffffffffff c:\\only in new.txt\nstring c:\\only in new 2.txt\n";
+  trace << std::endl << "Comparing backup sets whose filenames are loaded lazily." << std::endl;
+
+  BackupSet expected_old_set;
+  BackupSetReader(expected_old_set).read(std::string_view(old_buffer));
+  BackupSet expected_new_set;
+  BackupSetReader(expected_new_set).read(std::string_view(new_buffer));
+  const auto expected = expected_old_set.diff(expected_new_set);
+  std::stringstream expected_text;
+  BackupSetWriter(expected_new_set).write(expected_text);
+
+  const TempDirectory directory("backup_set_test_");
+  const auto old_path = (directory.path() / "diff_lazy_old.sha1.txt").string();
+  const auto new_path = (directory.path() / "diff_lazy_new.bsidx").string();
+  {
+    std::ofstream(old_path, std::ofstream::out | std::ofstream::binary) << old_buffer;
+    std::ofstream ofs(new_path, std::ofstream::out | std::ofstream::binary);
+    BackupSetWriter(expected_new_set).writeIndex(ofs);
+  }
+
+  {
+    BackupSet old_set;
+    BackupSetReader old_reader(old_set);
+    old_reader.enableLazyFilenames();
+    old_reader.setThreadCount(4);
+    assert.equal(old_reader.readFile(old_path), true);
+    BackupSet new_set;
+    BackupSetReader new_reader(new_set);
+    new_reader.enableLazyFilenames();
+    assert.equal(new_reader.readFile(new_path), true);
+
+    const auto diff = old_set.diff(new_set);
+    assert.equal(diff.missing_files, expected.missing_files);
+    assert.equal(diff.extra_files, expected.extra_files);
+    std::stringstream text;
+    BackupSetWriter(new_set).write(text);
+    assert.equal(text.str(), expected_text.str());
+  }
+
+  // Lazy filenames are read back one at a time to be compressed.
+  {
+    BackupSet old_set;
+    BackupSetReader old_reader(old_set);
+    old_reader.enableLazyFilenames();
+    assert.equal(old_reader.readFile(old_path), true);
+    old_set.compressFilenames();
+    BackupSet new_set;
+    BackupSetReader new_reader(new_set);
+    new_reader.enableLazyFilenames();
+    assert.equal(new_reader.readFile(new_path), true);
+    new_set.compressFilenames();
+
+    const auto diff = old_set.diff(new_set);
+    assert.equal(diff.missing_files, expected.missing_files);
+    assert.equal(diff.extra_files, expected.extra_files);
+    std::stringstream text;
+    BackupSetWriter(new_set).write(text);
+    assert.equal(text.str(), expected_text.str());
+  }
+}
+
+TEST_CASE(BackupSetTest, frozen_backup_set) {
+  const auto old_buffer = makeLargeBackupSetBuffer();
+  auto new_buffer = old_buffer.substr(old_buffer.find('\n', old_buffer.size() / 3) + 1);
+  new_buffer += "ffffffffffffffffffffffffffffffffffffffff c:\\only in new.txt\nstring c:\\only in new 2.txt\n";
+  trace << std::endl << "Comparing and searching frozen backup sets." << std::endl;
+
+  BackupSet old_set;
+  BackupSetReader(old_set).read(std::string_view(old_buffer));
+  BackupSet new_set;
+  BackupSetReader(new_set).read(std::string_view(new_buffer));
+  const auto expected = old_set.diff(new_set);
+
+  const auto frozen_old_set = FrozenBackupSet::freeze(old_set);
+  const auto frozen_new_set = FrozenBackupSet::freeze(new_set);
+  assert.equal(frozen_old_set->size(), old_set.size());
+  assert.equal(frozen_new_set->size(), new_set.size());
+
+  ThreadPool pool(4);
+  for (auto* diff_pool : {static_cast<ThreadPool*>(nullptr), &pool}) {
+    const auto diff = frozen_old_set->diff(*frozen_new_set, diff_pool);
+    assert.equal(diff.missing_files, expected.missing_files);
+    assert.equal(diff.extra_files, expected.extra_files);
+  }
+  assert.equal(frozen_old_set->getMissingFiles(*frozen_new_set), expected.missing_files);
+
+  std::string_view filename;
+  assert.equal(frozen_new_set->find("ffffffffffffffffffffffffffffffffffffffff", filename), true);
+  assert.equal(filename, std::string_view("c:\\only in new.txt"));
+  assert.equal(frozen_new_set->find("string", filename), true);
+  assert.equal(filename, std::string_view("c:\\only in new 2.txt"));
+  assert.equal(frozen_old_set->find("ffffffffffffffffffffffffffffffffffffffff", filename), false);
+  assert.equal(frozen_old_set->find("strinh", filename), false);
+
+  // Every file written out as text is found again.
+  std::stringstream text;
+  BackupSetWriter(new_set).write(text);
+  std::string line;
+  while (std::getline(text, line)) {
+    const auto space = line.find(' ');
+    assert.equal(frozen_new_set->find(std::string_view(line).substr(0, space), filename), true);
+    assert.equal(filename, std::string_view(line).substr(space + 1));
+  }
+
+  // A frozen set written next to its source opens in place. So does an
+  // index without a lookup table, which is rebuilt, but not one whose table
+  // is wrong.
+  std::stringstream index_str(std::ios::in | std::ios::out | std::ios::binary);
+  frozen_new_set->write(index_str);
+  auto index = index_str.str();
+  BackupSetIndexHeader header;
+  assert.equal(header.decode(index), true);
+  assert.equal(header.hasLookupTable(), true);
+  auto version1_index = index;
+  version1_index[8] = 1;
+  version1_index[12] = static_cast<char>(BackupSetIndexHeader::Version1EncodedSize);
+  auto corrupt_lookup = index;
+  corrupt_lookup[header.lookup_offset + sizeof(uint64_t) * 3] ^= 1;
+
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "frozen.bsidx").string();
+  for (const auto* contents : {&index, &version1_index, &corrupt_lookup}) {
+    {
+      std::ofstream ofs(path, std::ofstream::out | std::ofstream::binary);
+      ofs << *contents;
+    }
+    const auto opened_set = FrozenBackupSet::open(path);
+    if (contents == &corrupt_lookup) {
+      assert.equal(opened_set == nullptr, true);
+      continue;
+    }
+    assert.equal(opened_set != nullptr, true);
+    assert.equal(opened_set->memoryUsage() < frozen_new_set->memoryUsage(), true);
+    const auto diff = frozen_old_set->diff(*opened_set);
+    assert.equal(diff.missing_files, expected.missing_files);
+    assert.equal(diff.extra_files, expected.extra_files);
+    assert.equal(opened_set->find("string", filename), true);
+  }
+  std::filesystem::remove(path);
+}
+
+TEST_CASE(BackupSetTest, storage_policies) {
+  const auto old_buffer = makeLargeBackupSetBuffer();
+  auto new_buffer = old_buffer.substr(old_buffer.find('\n', old_buffer.size() / 3) + 1);
+  new_buffer += "ffffffffffffffffffffffffffffffffffffffff c:\\only in new.txt\nstring c:\\only in new 2.txt\n";
+  new_buffer += "0000000000000000000000000000000000000001 c:\\overwritten out of order.txt\n";
+
+  trace << std::endl << "Comparing backup sets held in a hash map." << std::endl;
+  expectSameAsDefaultStorage<HashMapStorage>(old_buffer, new_buffer);
+  trace << "Comparing backup sets held in a sorted vector." << std::endl;
+  expectSameAsDefaultStorage<SortedVectorStorage>(old_buffer, new_buffer);
+  trace << "Comparing backup sets held in a swiss table." << std::endl;
+  expectSameAsDefaultStorage<SwissTableStorage>(old_buffer, new_buffer);
+}
+
+TEST_CASE(BackupSetTest, allocation_budget) {
+  // Reading and comparing should allocate per arena block and per result,
+  // never per entry.
+  constexpr size_t LineCount = 100000;
+  std::string old_buffer;
+  std::string new_buffer;
+  for (size_t i = 0; i < LineCount; i++) {
+    std::stringstream line;
+    line << std::hex << std::setw(40) << std::setfill('0') << (i * 2654435761u) << " c:\\photos\\" << std::dec << (i / 100) << "\\image " << i << ".jpg\n";
+    // The new set is missing one file in a thousand.
+    if (i % 1000 != 0) {
+      new_buffer += line.str();
+    }
+    old_buffer += line.str();
+  }
+
+  BackupSet old_set;
+  AllocationCounter read_allocations;
+  BackupSetReader(old_set).read(std::string_view(old_buffer));
+  const auto read_count = read_allocations.allocationCount();
+  trace << std::endl << "Reading " << LineCount << " lines made " << read_count << " allocations." << std::endl;
+  assert.equal(old_set.size(), LineCount);
+  assert.equal(read_count < 100, true);
+
+  BackupSet new_set;
+  BackupSetReader(new_set).read(std::string_view(new_buffer));
+  AllocationCounter missing_allocations;
+  const auto missing_files = new_set.getMissingFiles(old_set);
+  const auto missing_count = missing_allocations.allocationCount();
+  trace << "Finding " << missing_files.size() << " missing files made " << missing_count << " allocations." << std::endl;
+  assert.equal(missing_files.size(), LineCount / 1000);
+  // One string per missing file and the growth of the result vector.
+  assert.equal(missing_count < missing_files.size() + 32, true);
+
+  AllocationCounter diff_allocations;
+  const auto diff = new_set.diff(old_set);
+  const auto diff_count = diff_allocations.allocationCount();
+  trace << "Comparing the sets made " << diff_count << " allocations." << std::endl;
+  assert.equal(diff.missing_files.size(), LineCount / 1000);
+  assert.equal(diff_count < diff.missing_files.size() + diff.extra_files.size() + 64, true);
+}
+
+TEST_CASE(BackupSetTest, reader_stats) {
+  const auto buffer = makeLargeBackupSetBuffer();
+  // One line per file, plus a string hash, an invalid line and a blank line
+  // every thousand files.
+  const uint64_t line_count = 20000 + 20 * 3;
+
+  for (const bool should_validate : {false, true}) {
+    // Blank lines are always rejected. Validation also rejects the string
+    // hashes and the invalid lines.
+    const uint64_t rejected_line_count = should_validate ? 20 * 3 : 20;
+    for (const size_t thread_count : {1, 7}) {
+      trace << std::endl << "Reading with validation " << (should_validate ? "on" : "off") << " on " << thread_count << " threads." << std::endl;
+      BackupSet backup_set;
+      BackupSetReader reader(backup_set);
+      reader.setThreadCount(thread_count);
+      if (should_validate) {
+        reader.enableValidation();
+      }
+      reader.read(std::string_view(buffer));
+      assert.equal(reader.getStats().bytes, static_cast<uint64_t>(buffer.size()));
+      assert.equal(reader.getStats().line_count, line_count);
+      assert.equal(reader.getStats().rejected_line_count, rejected_line_count);
+    }
+  }
+
+  BackupSet backup_set;
+  BackupSetReader reader(backup_set);
+  std::stringstream stream(buffer);
+  reader.read(stream);
+  assert.equal(reader.getStats().line_count, line_count);
+  assert.equal(reader.getStats().rejected_line_count, static_cast<uint64_t>(20));
+}
+
+TEST_CASE(BackupSetTest, trace) {
+#if defined(BACKUP_SET_TRACING)
+  Trace::enable();
+  BackupSet backup_set;
+  BackupSetReader reader(backup_set);
+  reader.setThreadCount(3);
+  reader.read(std::string_view(makeLargeBackupSetBuffer()));
+  backup_set.getMissingFiles(backup_set);
+
+  const TempDirectory directory("backup_set_test_");
+  const auto path = (directory.path() / "trace.json").string();
+  assert.equal(Trace::writeChromeJson(path), true);
+  std::ifstream ifs(path, std::ifstream::in | std::ifstream::binary);
+  std::stringstream trace_json;
+  trace_json << ifs.rdbuf();
+  ifs.close();
+  std::filesystem::remove(path);
+  trace << std::endl << "Wrote a " << trace_json.str().size() << " byte trace." << std::endl;
+  for (const auto* name : {"\"BackupSetReader::read\"", "\"parse chunk\"", "\"BackupSet::getMissingFiles\"", "\"thread_name\""}) {
+    assert.equal(trace_json.str().find(name) != std::string::npos, true);
+  }
+#else
+  assert.equal(Trace::isAvailable(), false);
+  assert.equal(Trace::writeChromeJson("unused.json"), false);
+#endif
+}
@@ -0,0 +1,144 @@
+//-------------------------------------------------------------------------------------------------------
+// Copyright (C) Taylor Woll. All rights reserved.
+// Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+//-------------------------------------------------------------------------------------------------------
+
+#ifndef __test_Benchmark_h__
+#define __test_Benchmark_h__
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "test/Logger.h"
+#include "test/Stopwatch.h"
+
+struct BenchmarkOptions {
+  // Untimed runs before the timed ones, to warm caches and the allocator.
+  size_t warmup_count = 1;
+  // Run exactly this many timed iterations. When 0, run at least
+  // min_iteration_count and keep going until min_seconds have passed or
+  // max_iteration_count is reached.
+  size_t iteration_count = 0;
+  size_t min_iteration_count = 5;
+  size_t max_iteration_count = 1000;
+  double min_seconds = 0.5;
+};
+
+struct BenchmarkResult {
+  std::string label;
+  size_t iteration_count = 0;
+  double min_seconds = 0;
+  double median_seconds = 0;
+  double p99_seconds = 0;
+  // Work done by each iteration, for throughput. 0 if not set.
+  uint64_t bytes_per_iteration = 0;
+  uint64_t items_per_iteration = 0;
+
+  // Throughput of the median iteration.
+  double bytesPerSecond() const {
+    return median_seconds > 0 ? static_cast<double>(bytes_per_iteration) / median_seconds : 0;
+  }
+
+  double itemsPerSecond() const {
+    return median_seconds > 0 ? static_cast<double>(items_per_iteration) / median_seconds : 0;
+  }
+};
+
+// Times repeated runs of a function for a BENCHMARK_CASE. The case does its
+// setup, says how much work one run does and then calls run, so only the
+// function itself is timed.
+class Benchmark {
+ private:
+  static inline BenchmarkOptions options_;
+
+  Logger& trace_;
+  uint64_t bytes_per_iteration_ = 0;
+  uint64_t items_per_iteration_ = 0;
+  std::vector<BenchmarkResult> results_;
+
+  bool isDone(size_t iteration_count, double total_seconds) const {
+    if (options_.iteration_count != 0) {
+      return iteration_count >= options_.iteration_count;
+    }
+    return iteration_count >= options_.max_iteration_count ||
+        (iteration_count >= options_.min_iteration_count && total_seconds >= options_.min_seconds);
+  }
+
+ public:
+  Benchmark(Logger& trace) : trace_(trace) {}
+
+  static void setOptions(const BenchmarkOptions& options) {
+    options_ = options;
+  }
+
+  // Set the bytes or items processed by each run of the next call to run.
+  void setBytesPerIteration(uint64_t bytes) {
+    bytes_per_iteration_ = bytes;
+  }
+
+  void setItemsPerIteration(uint64_t items) {
+    items_per_iteration_ = items;
+  }
+
+  // Time |function| and record the result under |label|, which tells apart
+  // several calls made by one case.
+  template <typename Function>
+  void run(const std::string& label, Function function) {
+    for (size_t i = 0; i < options_.warmup_count; i++) {
+      function();
+    }
+
+    std::vector<double> samples;
+    double total_seconds = 0;
+    Stopwatch timer;
+    while (!isDone(samples.size(), total_seconds)) {
+      timer.start();
+      function();
+      timer.stop();
+      samples.push_back(timer.elapsed());
+      total_seconds += samples.back();
+    }
+
+    auto result = summarize(label, samples);
+    result.bytes_per_iteration = bytes_per_iteration_;
+    result.items_per_iteration = items_per_iteration_;
+    bytes_per_iteration_ = 0;
+    items_per_iteration_ = 0;
+    trace_ << "Benchmark " << (label.empty() ? "" : label + " ") << "ran " << result.iteration_count << " iterations. Min: "
+           << result.min_seconds << "s Median: " << result.median_seconds << "s p99: " << result.p99_seconds << "s" << std::endl;
+    results_.push_back(result);
+  }
+
+  template <typename Function>
+  void run(Function function) {
+    run("", function);
+  }
+
+  const std::vector<BenchmarkResult>& getResults() const {
+    return results_;
+  }
+
+  // Returns the min, median and 99th percentile of |samples|.
+  static BenchmarkResult summarize(const std::string& label, std::vector<double> samples) {
+    BenchmarkResult result;
+    result.label = label;
+    result.iteration_count = samples.size();
+    if (samples.empty()) {
+      return result;
+    }
+    std::sort(samples.begin(), samples.end());
+    const auto size = samples.size();
+    result.min_seconds = samples.front();
+    result.median_seconds = size % 2 == 1 ? samples[size / 2] : (samples[size / 2 - 1] + samples[size / 2]) / 2;
+    // Nearest rank: the smallest sample at or above 99% of them.
+    const auto p99_rank = static_cast<size_t>(std::ceil(0.99 * static_cast<double>(size)));
+    result.p99_seconds = samples[std::max<size_t>(p99_rank, 1) - 1];
+    return result;
+  }
+};
+
+#endif  // __test_Benchmark_h__
@@ -6,6 +6,8 @@
 #ifndef __test_Constants_h__
 #define __test_Constants_h__
 
+#include <cstdint>
+
 enum class TestResult : uint8_t {
   Pass = 0,
   Fail,
@@ -17,6 +19,8 @@ enum class TestCaseFlag : uint8_t {
   ExpectPass = 0,
   Disabled = 1 << 0,
   Skip = 1 << 1,
+  // Only run with --bench, and timed rather than just passed or failed.
+  Benchmark = 1 << 2,
 };
 
 TestCaseFlag operator|(const TestCaseFlag& lhs, const TestCaseFlag& rhs);
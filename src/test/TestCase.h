@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "test/Assert.h"
+#include "test/Benchmark.h"
 #include "test/Constants.h"
 #include "test/Logger.h"
 #include "test/TestCaseContainer.h"
@@ -24,7 +25,7 @@
 
 class TestCase {
  public:
-  TestCase() : assert(trace) {}
+  TestCase() : assert(trace), benchmark(trace) {}
   virtual ~TestCase() {}
 
   virtual std::string getName() const = 0;
@@ -56,6 +57,14 @@ class TestCase {
     flags_ |= add;
   }
 
+  bool isBenchmark() const {
+    return (getFlags() & TestCaseFlag::Benchmark) == TestCaseFlag::Benchmark;
+  }
+
+  const std::vector<BenchmarkResult>& getBenchmarkResults() const {
+    return benchmark.getResults();
+  }
+
   TestResult run() {
     if ((getFlags() & TestCaseFlag::Disabled) == TestCaseFlag::Disabled) {
       setResult(TestResult::Disabled);
@@ -89,6 +98,7 @@ class TestCase {
  protected:
   Logger trace;
   Assert assert;
+  Benchmark benchmark;
 };
 
 #define TEST_CASE_COMMON_BASE(base_class, test_name, flags, data_type, data_set) \
@@ -160,4 +170,12 @@ TEST_CASE_WITH_DATA_BASE(base_class, test_name, TestCaseFlag::ExpectPass, data_t
 #define TEST_CASE_WITH_DATA_DISABLED(base_class, test_name, data_type, data_set) \
 TEST_CASE_WITH_DATA_BASE(base_class, test_name, TestCaseFlag::Disabled, data_type, data_set)
 
+// A benchmark case is a test case which is only run by test_runner --bench.
+// Its body sets up and then times the work with benchmark.run.
+#define BENCHMARK_CASE(base_class, test_name) \
+TEST_CASE_BASE(base_class, test_name, TestCaseFlag::Benchmark)
+
+#define BENCHMARK_CASE_WITH_DATA(base_class, test_name, data_type, data_set) \
+TEST_CASE_WITH_DATA_BASE(base_class, test_name, TestCaseFlag::Benchmark, data_type, data_set)
+
 #endif  // __test_TestCase_h__
@@ -3,13 +3,17 @@
 // Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "test/TestCaseContainer.h"
 
+#include "test/AllocationTracker.h"
 #include "test/AutostartStopwatch.h"
 #include "test/Constants.h"
 #include "test/TestCase.h"
@@ -18,22 +22,46 @@ TestCaseMap TestCaseContainer::tests_;
 std::string TestCaseContainer::filter_;
 TestCaseStats TestCaseContainer::stats_;
 bool TestCaseContainer::verbose_ = false;
+bool TestCaseContainer::run_benchmarks_ = false;
+std::string TestCaseContainer::benchmark_output_;
+std::vector<std::pair<std::string, BenchmarkResult>> TestCaseContainer::benchmark_results_;
 
 namespace {
 
-bool shouldRunTest(const TestCase* tc, const std::string& filter) {
-  return filter == "" || tc->getFullName().find(filter) != std::string::npos;
+bool shouldRunTest(const TestCase* tc, const std::string& filter, bool run_benchmarks) {
+  return tc->isBenchmark() == run_benchmarks && (filter == "" || tc->getFullName().find(filter) != std::string::npos);
 }
 
-bool shouldRunTestSuite(const std::unordered_map<std::string, TestCase*>& suite, const std::string& filter) {
+bool shouldRunTestSuite(const std::unordered_map<std::string, TestCase*>& suite, const std::string& filter, bool run_benchmarks) {
   for (const auto& tc_pair : suite) {
-    if (shouldRunTest(tc_pair.second, filter)) {
+    if (shouldRunTest(tc_pair.second, filter, run_benchmarks)) {
       return true;
     }
   }
   return false;
 }
 
+std::string getBenchmarkName(const std::string& full_name, const BenchmarkResult& result) {
+  return result.label.empty() ? full_name : full_name + "/" + result.label;
+}
+
+bool endsWith(const std::string& str, const std::string& suffix) {
+  return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Benchmark names are made of identifiers and labels, so only quotes and
+// backslashes need escaping.
+std::string escapeJson(const std::string& str) {
+  std::string escaped;
+  for (const auto ch : str) {
+    if (ch == '"' || ch == '\\') {
+      escaped.push_back('\\');
+    }
+    escaped.push_back(ch);
+  }
+  return escaped;
+}
+
 }  // namespace
 
 // static
@@ -43,16 +71,25 @@ void TestCaseContainer::add(TestCase* tc) {
 
 // static
 const TestCaseStats& TestCaseContainer::runOneTest(TestCase* tc) {
-  const auto should_skip = !shouldRunTest(tc, filter_);
+  const auto should_skip = !shouldRunTest(tc, filter_, run_benchmarks_);
   if (should_skip) {
     tc->setFlags(TestCaseFlag::Skip);
   }
+  AllocationCounter allocations;
   AutostartStopwatch timer;
   tc->run();
   if (!should_skip && verbose_) {
+    const auto allocation_stats = allocations.elapsed();
     std::cout << std::endl << tc->getFullName() << ":" << std::endl;
     std::cout << tc->getBuffer() << std::endl;
-    std::cout << "Time taken: " << timer.elapsed() << "ns" << std::endl;
+    std::cout << "Time taken: " << timer.elapsed() << "s" << std::endl;
+    std::cout << "Allocations: " << allocation_stats.allocation_count << " (" << allocation_stats.allocated_bytes << " bytes), deallocations: "
+              << allocation_stats.deallocation_count << std::endl;
+  }
+  if (!should_skip) {
+    for (const auto& result : tc->getBenchmarkResults()) {
+      benchmark_results_.emplace_back(getBenchmarkName(tc->getFullName(), result), result);
+    }
   }
   return tc->getStats();
 }
@@ -60,7 +97,7 @@ const TestCaseStats& TestCaseContainer::runOneTest(TestCase* tc) {
 // static
 void TestCaseContainer::runAllTests() {
   for (const auto& base_name_map_pair : tests_) {
-    if (shouldRunTestSuite(base_name_map_pair.second, filter_)) {
+    if (shouldRunTestSuite(base_name_map_pair.second, filter_, run_benchmarks_)) {
       std::cout << "Running " << base_name_map_pair.first << " tests..." << std::endl;
     }
     for (const auto& name_tc_pair : base_name_map_pair.second) {
@@ -80,6 +117,13 @@ void TestCaseContainer::runAllTests() {
     }
   }
 
+  if (run_benchmarks_) {
+    printBenchmarkResults();
+    if (!benchmark_output_.empty() && !writeBenchmarkResults(benchmark_output_)) {
+      std::cout << std::endl << "Failed to write benchmark results to " << std::quoted(benchmark_output_) << std::endl;
+    }
+  }
+
   std::cout << std::endl << "Total tests: " << stats_.run_count << std::endl;
   std::cout << "Passed tests: " << stats_.pass_count << std::endl;
   std::cout << "Failed tests: " << stats_.fail_count << std::endl;
@@ -96,3 +140,56 @@ void TestCaseContainer::setFilter(const std::string& filter) {
 void TestCaseContainer::enableVerbose() {
   verbose_ = true;
 }
+
+// static
+void TestCaseContainer::enableBenchmarks() {
+  run_benchmarks_ = true;
+}
+
+// static
+void TestCaseContainer::setBenchmarkOutput(const std::string& filename) {
+  benchmark_output_ = filename;
+}
+
+// static
+void TestCaseContainer::printBenchmarkResults() {
+  std::cout << std::endl << std::left << std::setw(48) << "benchmark" << std::right << std::setw(8) << "iters" << std::setw(12) << "min ms"
+            << std::setw(12) << "median ms" << std::setw(12) << "p99 ms" << std::setw(12) << "MB/s" << std::setw(14) << "items/s" << std::endl;
+  for (const auto& name_result_pair : benchmark_results_) {
+    const auto& result = name_result_pair.second;
+    std::cout << std::left << std::setw(48) << name_result_pair.first << std::right << std::setw(8) << result.iteration_count
+              << std::fixed << std::setprecision(3) << std::setw(12) << result.min_seconds * 1000 << std::setw(12) << result.median_seconds * 1000
+              << std::setw(12) << result.p99_seconds * 1000 << std::setprecision(1) << std::setw(12) << result.bytesPerSecond() / (1024 * 1024)
+              << std::setprecision(0) << std::setw(14) << result.itemsPerSecond() << std::defaultfloat << std::setprecision(6) << std::endl;
+  }
+}
+
+// static
+bool TestCaseContainer::writeBenchmarkResults(const std::string& filename) {
+  std::ofstream ofs(filename, std::ofstream::out | std::ofstream::binary);
+  if (!ofs) {
+    return false;
+  }
+  ofs << std::setprecision(9);
+  if (endsWith(filename, ".json")) {
+    ofs << "[\n";
+    for (size_t i = 0; i < benchmark_results_.size(); i++) {
+      const auto& result = benchmark_results_[i].second;
+      ofs << "  {\"name\": \"" << escapeJson(benchmark_results_[i].first) << "\", \"iterations\": " << result.iteration_count
+          << ", \"min_seconds\": " << result.min_seconds << ", \"median_seconds\": " << result.median_seconds
+          << ", \"p99_seconds\": " << result.p99_seconds << ", \"bytes_per_iteration\": " << result.bytes_per_iteration
+          << ", \"items_per_iteration\": " << result.items_per_iteration << ", \"bytes_per_second\": " << result.bytesPerSecond()
+          << ", \"items_per_second\": " << result.itemsPerSecond() << "}" << (i + 1 < benchmark_results_.size() ? "," : "") << "\n";
+    }
+    ofs << "]\n";
+  } else {
+    ofs << "name,iterations,min_seconds,median_seconds,p99_seconds,bytes_per_iteration,items_per_iteration,bytes_per_second,items_per_second\n";
+    for (const auto& name_result_pair : benchmark_results_) {
+      const auto& result = name_result_pair.second;
+      ofs << name_result_pair.first << "," << result.iteration_count << "," << result.min_seconds << "," << result.median_seconds << ","
+          << result.p99_seconds << "," << result.bytes_per_iteration << "," << result.items_per_iteration << ","
+          << result.bytesPerSecond() << "," << result.itemsPerSecond() << "\n";
+    }
+  }
+  return static_cast<bool>(ofs.flush());
+}
@@ -8,7 +8,9 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+#include "test/Benchmark.h"
 #include "test/Constants.h"
 #include "test/TestCaseStats.h"
 
@@ -22,6 +24,12 @@ class TestCaseContainer {
   static std::string filter_;
   static TestCaseStats stats_;
   static bool verbose_;
+  static bool run_benchmarks_;
+  static std::string benchmark_output_;
+  static std::vector<std::pair<std::string, BenchmarkResult>> benchmark_results_;
+
+  static void printBenchmarkResults();
+  static bool writeBenchmarkResults(const std::string& filename);
 
  public:
   static void add(TestCase* tc);
@@ -29,6 +37,11 @@ class TestCaseContainer {
   static void runAllTests();
   static void setFilter(const std::string& filter);
   static void enableVerbose();
+  // Run the benchmark cases instead of the other test cases.
+  static void enableBenchmarks();
+  // Also write the benchmark results to |filename|, as JSON if it ends in
+  // .json and as CSV otherwise.
+  static void setBenchmarkOutput(const std::string& filename);
 };
 
 #endif  // __test_TestCaseContainer_h__
@@ -3,24 +3,41 @@
 // Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
 //-------------------------------------------------------------------------------------------------------
 
+#include <charconv>
+#include <cstddef>
 #include <iomanip>
 #include <iostream>
 #include <string>
 #include <vector>
 
+#include "test/Benchmark.h"
 #include "test/TestCaseContainer.h"
 
 void printHelp() {
-  std::cout << "Usage: test_runner [--filter str] [--verbose]" << std::endl << std::endl;
+  std::cout << "Usage: test_runner [--filter str] [--verbose] [--bench] [--bench-output filename] [--bench-iterations count] [--bench-warmup count]" << std::endl << std::endl;
   std::cout << "Options:" << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--filter str";
+  std::cout << std::setw(2) << "" << std::left << std::setw(26) << "--bench";
+  std::cout << "Run the benchmark cases instead of the test cases" << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(26) << "--bench-iterations count";
+  std::cout << "Time exactly count iterations of each benchmark (Default: as many as fit in half a second)" << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(26) << "--bench-output filename";
+  std::cout << "Also write benchmark results to filename, as JSON if it ends in .json and CSV otherwise" << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(26) << "--bench-warmup count";
+  std::cout << "Run each benchmark count times before timing it (Default: 1)" << std::endl;
+  std::cout << std::setw(2) << "" << std::left << std::setw(26) << "--filter str";
   std::cout << "Filter and only execute test cases with names matching str" << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--help";
+  std::cout << std::setw(2) << "" << std::left << std::setw(26) << "--help";
   std::cout << "Display this usage information" << std::endl;
-  std::cout << std::setw(2) << "" << std::left << std::setw(16) << "--verbose";
+  std::cout << std::setw(2) << "" << std::left << std::setw(26) << "--verbose";
   std::cout << "Enable verbose tracing" << std::endl;
 }
 
+bool parseCount(const std::string& str, size_t& count) {
+  const char* end = str.data() + str.size();
+  const auto result = std::from_chars(str.data(), end, count);
+  return result.ec == std::errc() && result.ptr == end;
+}
+
 int main(int argc, const char** argv) {
   std::vector<std::string> args;
   for (int i = 0; i < argc; i++) {
@@ -29,6 +46,8 @@ int main(int argc, const char** argv) {
 
   std::cout << "Simple unit test runner" << std::endl << std::endl;
 
+  BenchmarkOptions benchmark_options;
+
   for (auto iter = args.cbegin() + 1; iter != args.cend(); iter++) {
     const auto& arg = *iter;
     if (arg == "--verbose") {
@@ -39,6 +58,25 @@ int main(int argc, const char** argv) {
         break;
       }
       TestCaseContainer::setFilter(*iter);
+    } else if (arg == "--bench") {
+      TestCaseContainer::enableBenchmarks();
+    } else if (arg == "--bench-output") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      TestCaseContainer::setBenchmarkOutput(*iter);
+    } else if (arg == "--bench-iterations" || arg == "--bench-warmup") {
+      // If there are no more arguments, break out of the loop.
+      if (++iter == args.cend()) {
+        break;
+      }
+      auto& count = arg == "--bench-iterations" ? benchmark_options.iteration_count : benchmark_options.warmup_count;
+      if (!parseCount(*iter, count)) {
+        std::cout << "Invalid count for " << arg << ": " << std::quoted(*iter) << std::endl;
+        printHelp();
+        return -1;
+      }
     } else if (arg == "--help") {
       printHelp();
       return 0;
@@ -49,6 +87,7 @@ int main(int argc, const char** argv) {
     }
   }
 
+  Benchmark::setOptions(benchmark_options);
   TestCaseContainer::runAllTests();
 
   return 0;